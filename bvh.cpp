@@ -0,0 +1,431 @@
+#include "bvh.h"
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_invoke.h>
+#include <tbb/parallel_reduce.h>
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+
+namespace
+{
+    const int BinCount = 16;
+    const uint32_t MaxLeafSize = 4;
+    // leaves above this size are always split, whatever SAH says.
+    const uint32_t ForceSplitSize = 32;
+    // below this, a node is built (and binned) on the current thread.
+    const uint32_t ParallelSize = 4096;
+    const size_t Grain = 4096;
+
+    float _SurfaceArea(pxr::GfRange3f const& box)
+    {
+        if (box.IsEmpty())
+            return 0.0f;
+        const pxr::GfVec3f d = box.GetSize();
+        return 2.0f * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+    }
+
+    // Bounds of the primitives and of their centroids over a range of
+    // _primIndices.
+    struct _RangeBounds
+    {
+        pxr::GfRange3f bounds;
+        pxr::GfRange3f centroids;
+
+        void join(_RangeBounds const& other)
+        {
+            bounds.UnionWith(other.bounds);
+            centroids.UnionWith(other.centroids);
+        }
+    };
+
+    // SAH bins along one axis.
+    struct _Bins
+    {
+        pxr::GfRange3f bounds[BinCount];
+        uint32_t counts[BinCount] = {};
+
+        void join(_Bins const& other)
+        {
+            for (int b = 0; b < BinCount; ++b)
+            {
+                bounds[b].UnionWith(other.bounds[b]);
+                counts[b] += other.counts[b];
+            }
+        }
+    };
+
+    int _BinIndex(float c, float lo, float scale)
+    {
+        int b = int((c - lo) * scale);
+        return std::max(0, std::min(BinCount - 1, b));
+    }
+}
+
+MyBvh::MyBvh()
+    : _primBounds()
+    , _centroids()
+    , _primIndices()
+    , _unbounded()
+    , _nodes()
+    , _nodeCount(0)
+    , _builtCost(0.0f)
+    , _updateTimeMs(0.0)
+    , _refitted(false)
+{
+}
+
+void MyBvh::build(std::vector<pxr::GfRange3f>&& primitiveBounds)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+
+    _Build(std::move(primitiveBounds));
+    _refitted = false;
+
+    auto end = std::chrono::high_resolution_clock::now();
+    _updateTimeMs = std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+void MyBvh::refit(std::vector<pxr::GfRange3f>&& primitiveBounds)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+
+    // the tree only holds the primitives that had bounds when built, it
+    // can be kept as long as that's still the same set.
+    bool sameSet = primitiveBounds.size() == _primBounds.size();
+    for (size_t i = 0; sameSet && i < primitiveBounds.size(); ++i)
+        sameSet = primitiveBounds[i].IsEmpty() == _primBounds[i].IsEmpty();
+
+    if (!sameSet)
+    {
+        _Build(std::move(primitiveBounds));
+        _refitted = false;
+    }
+    else
+    {
+        _primBounds = std::move(primitiveBounds);
+
+        // children are always allocated after their parent, a reverse
+        // walk sees them updated before it.
+        for (size_t n = _nodes.size(); n-- > 0;)
+        {
+            Node& node = _nodes[n];
+            if (node.left == 0)
+            {
+                node.bounds = pxr::GfRange3f();
+                for (uint32_t i = node.first; i < node.first + node.count; ++i)
+                    node.bounds.UnionWith(_primBounds[_primIndices[i]]);
+            }
+            else
+            {
+                node.bounds = pxr::GfRange3f::GetUnion(_nodes[node.left].bounds, _nodes[node.left + 1].bounds);
+            }
+        }
+        _refitted = true;
+
+        // things moved far enough for the tree to be a poor fit anymore.
+        if (_ComputeCost() > 2.0f * _builtCost)
+        {
+            std::vector<pxr::GfRange3f> bounds;
+            bounds.swap(_primBounds);
+            _Build(std::move(bounds));
+            _refitted = false;
+        }
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    _updateTimeMs = std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+void MyBvh::_Build(std::vector<pxr::GfRange3f>&& primitiveBounds)
+{
+    _primBounds = std::move(primitiveBounds);
+    _centroids.resize(_primBounds.size());
+    _primIndices.clear();
+    _unbounded.clear();
+    _nodes.clear();
+    _builtCost = 0.0f;
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, _primBounds.size(), Grain),
+        [this](tbb::blocked_range<size_t> const& r)
+        {
+            for (size_t i = r.begin(); i != r.end(); ++i)
+            {
+                if (!_primBounds[i].IsEmpty())
+                    _centroids[i] = _primBounds[i].GetMidpoint();
+            }
+        });
+
+    _primIndices.reserve(_primBounds.size());
+    for (size_t i = 0; i < _primBounds.size(); ++i)
+    {
+        if (_primBounds[i].IsEmpty())
+            _unbounded.push_back(uint32_t(i));
+        else
+            _primIndices.push_back(uint32_t(i));
+    }
+
+    if (_primIndices.empty())
+        return;
+
+    // a binary tree with n leaves at most has 2n - 1 nodes.
+    _nodes.resize(2 * _primIndices.size() - 1);
+    _nodeCount.store(1);
+    _BuildNode(0, 0, uint32_t(_primIndices.size()));
+    _nodes.resize(_nodeCount.load());
+
+    _builtCost = _ComputeCost();
+}
+
+void MyBvh::_BuildNode(uint32_t nodeIndex, uint32_t first, uint32_t count)
+{
+    const uint32_t* indices = _primIndices.data() + first;
+
+    auto boundsOf = [this, indices](tbb::blocked_range<uint32_t> const& r, _RangeBounds rb)
+    {
+        for (uint32_t i = r.begin(); i != r.end(); ++i)
+        {
+            rb.bounds.UnionWith(_primBounds[indices[i]]);
+            rb.centroids.UnionWith(_centroids[indices[i]]);
+        }
+        return rb;
+    };
+    _RangeBounds rb;
+    if (count > ParallelSize)
+    {
+        rb = tbb::parallel_reduce(tbb::blocked_range<uint32_t>(0, count, Grain), _RangeBounds(), boundsOf,
+            [](_RangeBounds a, _RangeBounds const& b) { a.join(b); return a; });
+    }
+    else
+    {
+        rb = boundsOf(tbb::blocked_range<uint32_t>(0, count), _RangeBounds());
+    }
+
+    Node& node = _nodes[nodeIndex];
+    node.bounds = rb.bounds;
+    node.first = first;
+    node.count = count;
+    node.left = 0;
+
+    if (count <= MaxLeafSize)
+        return;
+
+    // bin centroids along their longest axis (Wald's binned SAH), the
+    // other axes rarely win and would triple the binning cost.
+    const pxr::GfVec3f size = rb.centroids.GetSize();
+    int axis = 0;
+    if (size[1] > size[axis])
+        axis = 1;
+    if (size[2] > size[axis])
+        axis = 2;
+    const float axisLo = rb.centroids.GetMin()[axis];
+    const float axisScale = size[axis] > 0.0f ? BinCount / size[axis] : 0.0f;
+
+    auto binsOf = [this, indices, axis, axisLo, axisScale](tbb::blocked_range<uint32_t> const& r, _Bins bins)
+    {
+        for (uint32_t i = r.begin(); i != r.end(); ++i)
+        {
+            const int b = _BinIndex(_centroids[indices[i]][axis], axisLo, axisScale);
+            bins.bounds[b].UnionWith(_primBounds[indices[i]]);
+            bins.counts[b]++;
+        }
+        return bins;
+    };
+
+    // cheapest split between bins: sweep from the right to get the right
+    // hand areas, then from the left.
+    float bestCost = std::numeric_limits<float>::max();
+    int bestSplit = 0;
+    if (axisScale > 0.0f)
+    {
+        _Bins bins;
+        if (count > ParallelSize)
+        {
+            bins = tbb::parallel_reduce(tbb::blocked_range<uint32_t>(0, count, Grain), _Bins(), binsOf,
+                [](_Bins a, _Bins const& b) { a.join(b); return a; });
+        }
+        else
+        {
+            bins = binsOf(tbb::blocked_range<uint32_t>(0, count), _Bins());
+        }
+
+        float rightCost[BinCount];
+        pxr::GfRange3f right;
+        uint32_t rightCount = 0;
+        for (int b = BinCount - 1; b > 0; --b)
+        {
+            right.UnionWith(bins.bounds[b]);
+            rightCount += bins.counts[b];
+            rightCost[b] = _SurfaceArea(right) * rightCount;
+        }
+
+        pxr::GfRange3f left;
+        uint32_t leftCount = 0;
+        for (int b = 1; b < BinCount; ++b)
+        {
+            left.UnionWith(bins.bounds[b - 1]);
+            leftCount += bins.counts[b - 1];
+            if (leftCount == 0 || leftCount == count)
+                continue;
+            const float cost = _SurfaceArea(left) * leftCount + rightCost[b];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestSplit = b;
+            }
+        }
+    }
+
+    uint32_t mid = 0;
+    if (bestSplit > 0)
+    {
+        // traversal costs about one primitive test.
+        const float area = _SurfaceArea(rb.bounds);
+        const float splitCost = 1.0f + (area > 0.0f ? bestCost / area : 0.0f);
+        if (splitCost >= float(count) && count <= ForceSplitSize)
+            return;
+
+        uint32_t* begin = _primIndices.data() + first;
+        uint32_t* split = std::partition(begin, begin + count,
+            [this, axis, axisLo, axisScale, bestSplit](uint32_t p)
+            {
+                return _BinIndex(_centroids[p][axis], axisLo, axisScale) < bestSplit;
+            });
+        mid = uint32_t(split - begin);
+    }
+
+    if (mid == 0 || mid == count)
+    {
+        // all centroids in one spot, nothing to gain from SAH.
+        if (count <= ForceSplitSize)
+            return;
+        mid = count / 2;
+    }
+
+    const uint32_t left = _nodeCount.fetch_add(2);
+    node.left = left;
+
+    if (count > ParallelSize)
+    {
+        tbb::parallel_invoke(
+            [this, left, first, mid]() { _BuildNode(left, first, mid); },
+            [this, left, first, mid, count]() { _BuildNode(left + 1, first + mid, count - mid); });
+    }
+    else
+    {
+        _BuildNode(left, first, mid);
+        _BuildNode(left + 1, first + mid, count - mid);
+    }
+}
+
+float MyBvh::_ComputeCost() const
+{
+    if (_nodes.empty())
+        return 0.0f;
+
+    const float rootArea = _SurfaceArea(_nodes[0].bounds);
+    if (rootArea <= 0.0f)
+        return 0.0f;
+
+    float cost = 0.0f;
+    for (const Node& node : _nodes)
+    {
+        const float area = _SurfaceArea(node.bounds);
+        cost += node.left == 0 ? area * node.count : area;
+    }
+    return cost / rootArea;
+}
+
+void MyBvh::queryFrustum(MyFrustum const& frustum, std::vector<uint32_t>* o_primitives) const
+{
+    o_primitives->assign(_unbounded.begin(), _unbounded.end());
+    if (_nodes.empty())
+        return;
+
+    std::vector<uint32_t> stack;
+    stack.reserve(64);
+    stack.push_back(0);
+    while (!stack.empty())
+    {
+        const Node& node = _nodes[stack.back()];
+        stack.pop_back();
+
+        const MyFrustum::Containment containment = frustum.classify(node.bounds);
+        if (containment == MyFrustum::Outside)
+            continue;
+
+        if (containment == MyFrustum::Inside)
+        {
+            // the whole subtree is in, no need to go down.
+            o_primitives->insert(o_primitives->end(),
+                _primIndices.begin() + node.first, _primIndices.begin() + node.first + node.count);
+        }
+        else if (node.left == 0)
+        {
+            for (uint32_t i = node.first; i < node.first + node.count; ++i)
+            {
+                if (frustum.intersects(_primBounds[_primIndices[i]]))
+                    o_primitives->push_back(_primIndices[i]);
+            }
+        }
+        else
+        {
+            stack.push_back(node.left);
+            stack.push_back(node.left + 1);
+        }
+    }
+}
+
+void MyBvh::queryRay(pxr::GfVec3f const& origin, pxr::GfVec3f const& direction,
+    std::vector<uint32_t>* o_primitives) const
+{
+    o_primitives->assign(_unbounded.begin(), _unbounded.end());
+    if (_nodes.empty())
+        return;
+
+    // zero components give infinities, which the slab test handles.
+    const pxr::GfVec3f invDirection(1.0f / direction[0], 1.0f / direction[1], 1.0f / direction[2]);
+    auto hit = [&origin, &invDirection](pxr::GfRange3f const& box)
+    {
+        float tmin = 0.0f;
+        float tmax = std::numeric_limits<float>::max();
+        for (int a = 0; a < 3; ++a)
+        {
+            float t0 = (box.GetMin()[a] - origin[a]) * invDirection[a];
+            float t1 = (box.GetMax()[a] - origin[a]) * invDirection[a];
+            if (t0 > t1)
+                std::swap(t0, t1);
+            tmin = std::max(tmin, t0);
+            tmax = std::min(tmax, t1);
+        }
+        return tmin <= tmax;
+    };
+
+    std::vector<uint32_t> stack;
+    stack.reserve(64);
+    stack.push_back(0);
+    while (!stack.empty())
+    {
+        const Node& node = _nodes[stack.back()];
+        stack.pop_back();
+
+        if (!hit(node.bounds))
+            continue;
+
+        if (node.left == 0)
+        {
+            for (uint32_t i = node.first; i < node.first + node.count; ++i)
+            {
+                if (hit(_primBounds[_primIndices[i]]))
+                    o_primitives->push_back(_primIndices[i]);
+            }
+        }
+        else
+        {
+            stack.push_back(node.left);
+            stack.push_back(node.left + 1);
+        }
+    }
+}
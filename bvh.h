@@ -0,0 +1,76 @@
+#ifndef MY_BVH_H
+#define MY_BVH_H
+
+#include <pxr/pxr.h>
+#include <pxr/base/gf/range3f.h>
+#include <pxr/base/gf/vec3f.h>
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "frustum.h"
+
+// Bounding volume hierarchy over world space boxes (one per mesh, or per
+// instance of instanced meshes), so that culling and picking don't have to
+// test every one of them. A primitive is identified by its index in the
+// array it was built from.
+class MyBvh
+{
+public:
+    MyBvh();
+
+    // Build from scratch with SAH binning, subtrees in parallel.
+    void build(std::vector<pxr::GfRange3f>&& primitiveBounds);
+
+    // Same primitives with new bounds (things moved): update the node
+    // bounds bottom up and keep the tree. Rebuilds instead when the
+    // primitives don't match or the refitted tree got too loose.
+    void refit(std::vector<pxr::GfRange3f>&& primitiveBounds);
+
+    // Primitives at least partially inside the frustum.
+    void queryFrustum(MyFrustum const& frustum, std::vector<uint32_t>* o_primitives) const;
+
+    // Primitives whose box is hit by the ray, for picking.
+    void queryRay(pxr::GfVec3f const& origin, pxr::GfVec3f const& direction,
+        std::vector<uint32_t>* o_primitives) const;
+
+    size_t size() const { return _primBounds.size(); }
+    size_t nodeCount() const { return _nodes.size(); }
+
+    // Time of the last build or refit, and which one it was.
+    double updateTimeMs() const { return _updateTimeMs; }
+    bool refitted() const { return _refitted; }
+
+private:
+    struct Node
+    {
+        pxr::GfRange3f bounds;
+        // primitives of the subtree are _primIndices[first, first + count)
+        uint32_t first;
+        uint32_t count;
+        // children are left and left + 1, 0 for leaves.
+        uint32_t left;
+    };
+
+    void _Build(std::vector<pxr::GfRange3f>&& primitiveBounds);
+    void _BuildNode(uint32_t nodeIndex, uint32_t first, uint32_t count);
+    // SAH cost of the tree relative to its root, to tell how much a refit
+    // degraded it.
+    float _ComputeCost() const;
+
+    std::vector<pxr::GfRange3f> _primBounds;
+    std::vector<pxr::GfVec3f> _centroids;
+    std::vector<uint32_t> _primIndices;
+    // primitives with no bounds can't be culled, every query returns them.
+    std::vector<uint32_t> _unbounded;
+
+    std::vector<Node> _nodes;
+    std::atomic<uint32_t> _nodeCount;
+
+    float _builtCost;
+    double _updateTimeMs;
+    bool _refitted;
+};
+
+#endif
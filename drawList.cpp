@@ -0,0 +1,421 @@
+#include "drawList.h"
+#include "shaderPrograms.h"
+
+#include <pxr/base/gf/math.h>
+
+#include <algorithm>
+#include <numeric>
+
+MyDrawList::MyDrawList()
+    : _items()
+    , _order()
+    , _primitiveOffsets(1, 0)
+    , _culledItems(0)
+    , _culledInstances(0)
+    , _drawnInstances(0)
+    , _lodInstances{ 0, 0, 0 }
+    , _lodSlots()
+{
+}
+
+void MyDrawList::clear()
+{
+    _items.clear();
+    _order.clear();
+    _primitiveOffsets.assign(1, 0);
+}
+
+void MyDrawList::add(MyDrawItem&& item)
+{
+    _items.emplace_back(std::move(item));
+}
+
+void MyDrawList::compile()
+{
+    // stable, so unchanged scenes keep their order and the BVH built over
+    // them can be refitted rather than rebuilt.
+    _order.resize(_items.size());
+    std::iota(_order.begin(), _order.end(), 0);
+    std::stable_sort(_order.begin(), _order.end(),
+        [this](uint32_t i, uint32_t j)
+        {
+            MyDrawItem const& a = _items[i];
+            MyDrawItem const& b = _items[j];
+            if (a.state != b.state)
+                return a.state < b.state;
+            return a.geometry < b.geometry;
+        });
+    std::vector<MyDrawItem> sorted;
+    sorted.reserve(_items.size());
+    for (uint32_t i : _order)
+        sorted.emplace_back(std::move(_items[i]));
+    _items.swap(sorted);
+
+    _primitiveOffsets.resize(_items.size() + 1);
+    _primitiveOffsets[0] = 0;
+    for (size_t i = 0; i < _items.size(); ++i)
+    {
+        const MyDrawItem& item = _items[i];
+        _primitiveOffsets[i + 1] = _primitiveOffsets[i] + uint32_t(item.instances ? item.instances->slots() : 1);
+    }
+}
+
+bool MyDrawList::refresh(size_t i, MyDrawItem&& item)
+{
+    MyDrawItem& current = _items[i];
+    if (item.geometry != current.geometry || item.state != current.state || item.instances != current.instances)
+        return false;
+    const uint32_t primitives = uint32_t(item.instances ? item.instances->slots() : 1);
+    if (primitives != _primitiveOffsets[i + 1] - _primitiveOffsets[i])
+        return false;
+    current = std::move(item);
+    return true;
+}
+
+std::vector<pxr::GfRange3f> MyDrawList::primitiveBounds() const
+{
+    std::vector<pxr::GfRange3f> bounds;
+    bounds.reserve(_primitiveOffsets.back());
+    for (const MyDrawItem& item : _items)
+    {
+        if (item.instances)
+            bounds.insert(bounds.end(), item.instances->bounds.begin(), item.instances->bounds.end());
+        else
+            bounds.push_back(item.bounds);
+    }
+    return bounds;
+}
+
+MyInstanceLod::Level MyInstanceLod::classify(pxr::GfRange3f const& bounds) const
+{
+    const pxr::GfVec3f center = bounds.GetMidpoint();
+    const pxr::GfMatrix4d& m = viewProjection;
+    const double w = center[0] * m[0][3] + center[1] * m[1][3] + center[2] * m[2][3] + m[3][3];
+    // around or behind the eye, as close as it gets.
+    if (w <= 0.0)
+        return LevelFull;
+
+    const double pixels = bounds.GetSize().GetLength() * pixelScale / w;
+    if (pixels < pointSize)
+        return LevelPoint;
+    if (pixels < decimatedSize)
+        return LevelDecimated;
+    return LevelFull;
+}
+
+void MyDrawList::draw(pxr::GfMatrix4d const& view, pxr::GfMatrix4d const& projection,
+    std::vector<uint32_t> const& visiblePrimitives, MyInstanceLod const& lod, size_t motionSample) const
+{
+    _culledItems = 0;
+    _culledInstances = 0;
+    _drawnInstances = 0;
+    for (size_t& count : _lodInstances)
+        count = 0;
+
+    // uploads bind their own buffers, get them all done before we start
+    // binding for drawing.
+    for (const MyDrawItem& item : _items)
+    {
+        item.geometry->uploadBuffers();
+        if (item.instances)
+            item.instances->uploadBuffers();
+    }
+
+    const pxr::GfMatrix4f viewMatrix(view);
+    const pxr::GfMatrix4f projectionMatrix(projection);
+
+    glEnableVertexAttribArray(POSITION_LOCATION);
+    glEnable(GL_PROGRAM_POINT_SIZE);
+
+    int boundState = -1;
+    GLuint program = 0;
+    const MyGeometry* boundGeometry = nullptr;
+
+    auto bindGeometry = [&boundGeometry](const MyGeometry& geometry, int state)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, geometry.pointsVBO);
+        glVertexAttribPointer(POSITION_LOCATION, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+
+        if (state & MyDrawItem::StateColors)
+        {
+            // per-vertex color
+            glBindBuffer(GL_ARRAY_BUFFER, geometry.colorsVBO);
+            glVertexAttribPointer(COLOR_LOCATION, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+        }
+
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geometry.indicesIBO);
+
+        glActiveTexture(GL_TEXTURE0 + TRIANGLE_FACES_UNIT);
+        glBindTexture(GL_TEXTURE_BUFFER, geometry.facesTexture);
+        glActiveTexture(GL_TEXTURE0);
+        boundGeometry = &geometry;
+    };
+
+    size_t cursor = 0;
+    for (size_t itemIndex = 0; itemIndex < _items.size(); ++itemIndex)
+    {
+        const MyDrawItem& item = _items[itemIndex];
+        const MyGeometry& geometry = *item.geometry;
+
+        // this item's primitives are the next run of visiblePrimitives.
+        const uint32_t firstPrimitive = _primitiveOffsets[itemIndex];
+        const size_t visibleBegin = cursor;
+        while (cursor < visiblePrimitives.size() && visiblePrimitives[cursor] < _primitiveOffsets[itemIndex + 1])
+            ++cursor;
+        const size_t visibleCount = cursor - visibleBegin;
+
+        if (visibleCount == 0)
+        {
+            _culledItems++;
+            if (item.instances)
+                _culledInstances += item.instances->size();
+            continue;
+        }
+
+        if (item.state != boundState)
+        {
+            // states only differing by their normals share a program.
+            const bool instanced = (item.state & MyDrawItem::StateInstanced) != 0;
+            const GLuint stateProgram = MyShaderPrograms::get(
+                ((item.state & MyDrawItem::StateColors) ? MyShaderPrograms::FeatureVertexColors : 0) |
+                (instanced ? MyShaderPrograms::FeatureInstanced : 0));
+            if (stateProgram != program && stateProgram != 0)
+            {
+                // programs are shared, what others left in their uniforms
+                // isn't ours.
+                glUseProgram(stateProgram);
+                glUniformMatrix4fv(PROJECTION_UNIFORM, 1, GL_FALSE, projectionMatrix.data());
+                glUniformMatrix4fv(VIEW_UNIFORM, 1, GL_FALSE, viewMatrix.data());
+                if (instanced)
+                {
+                    glUniform1i(CHILD_COUNT_UNIFORM, 0);
+                    glUniform1i(USE_INSTANCE_COLOR_UNIFORM, 0);
+                    glUniform1i(USE_CHILD_COLORS_UNIFORM, 0);
+                    glUniform1f(IMPOSTOR_SIZE_UNIFORM, 0.0f);
+                }
+            }
+            program = stateProgram;
+
+            if (item.state & MyDrawItem::StateColors)
+                glEnableVertexAttribArray(COLOR_LOCATION);
+            else
+                glDisableVertexAttribArray(COLOR_LOCATION);
+
+            // instanced items come last, their arrays stay on.
+            if (instanced && (boundState < 0 || !(boundState & MyDrawItem::StateInstanced)))
+            {
+                for (GLuint c = 0; c < 4; ++c)
+                    glEnableVertexAttribArray(INSTANCE_TRANSFORM_LOCATION + c);
+                glEnableVertexAttribArray(INSTANCE_ID_LOCATION);
+                glVertexAttribDivisor(INSTANCE_ID_LOCATION, 1);
+            }
+
+            boundState = item.state;
+            boundGeometry = nullptr;
+        }
+
+        // its program is broken, the error is out already.
+        if (program == 0)
+            continue;
+
+        if (&geometry != boundGeometry)
+            bindGeometry(geometry, item.state);
+
+        if (!(item.state & MyDrawItem::StateColors))
+        {
+            // constant color for the whole mesh
+            glUniform4fv(CONSTANT_COLOR_UNIFORM, 1, item.color.data());
+        }
+
+        glUniform1i(PRIM_ID_UNIFORM, item.primId);
+        glUniformMatrix4fv(MODEL_UNIFORM, 1, GL_FALSE, item.transform.data());
+
+        if (!item.instances)
+        {
+            glUniform1i(USE_TRIANGLE_FACES_UNIFORM, geometry.facesTexture != 0 ? 1 : 0);
+            glDrawElements(GL_TRIANGLES, geometry.indexCount, GL_UNSIGNED_INT, (void*)0);
+            continue;
+        }
+
+        MyInstanceBuffer& instances = *item.instances;
+        const size_t perSlot = instances.instancesPerSlot();
+        _culledInstances += (instances.slots() - visibleCount) * perSlot;
+        _drawnInstances += visibleCount * perSlot;
+
+        // the visible instances (or parents of factored instances) of each
+        // level of detail. Without LOD, all of them are full, and when
+        // every slot is, the full buffers are drawn as they are.
+        for (std::vector<uint32_t>& slots : _lodSlots)
+            slots.clear();
+        const bool allFull = !lod.enabled() && visibleCount == instances.slots();
+        if (!allFull)
+        {
+            for (size_t i = 0; i < visibleCount; ++i)
+            {
+                const uint32_t slot = visiblePrimitives[visibleBegin + i] - firstPrimitive;
+                const MyInstanceLod::Level level = lod.enabled() ?
+                    lod.classify(instances.bounds[slot]) : MyInstanceLod::LevelFull;
+                _lodSlots[level].push_back(slot);
+            }
+        }
+
+        for (int level = 0; level < MyInstanceLod::LevelCount; ++level)
+        {
+            const std::vector<uint32_t>& slots = _lodSlots[level];
+            const bool all = (allFull && level == MyInstanceLod::LevelFull) || slots.size() == instances.slots();
+            if (!all && slots.empty())
+                continue;
+            const size_t instanceCount = all ? instances.slots() : slots.size();
+            _lodInstances[level] += instanceCount * perSlot;
+
+            // keep only the instances of this level, the full buffer is
+            // used as is when all of them are.
+            bool instanceColors = false;
+            GLuint instanceVBO = 0;
+            GLuint colorsVBO = 0;
+            GLuint idsVBO = 0;
+            if (all)
+            {
+                instanceVBO = instances.transformsVBOAt(motionSample);
+                instanceColors = instances.hasColors();
+                colorsVBO = instances.colorsVBO;
+                idsVBO = instances.idsVBO;
+            }
+            else
+            {
+                // colors are per slot like the transforms, ids per
+                // instance: all perSlot instances of a visible slot go.
+                const pxr::GfMatrix4f* transforms = instances.transformsAt(motionSample).cdata();
+                instances.visibleTransforms.resize(instanceCount);
+                instances.visibleColors.resize(instances.hasColors() ? instanceCount : 0);
+                for (size_t i = 0; i < instanceCount; ++i)
+                {
+                    instances.visibleTransforms[i] = transforms[slots[i]];
+                    if (!instances.visibleColors.empty())
+                        instances.visibleColors[i] = instances.colors[slots[i]];
+                }
+                instances.visibleIds.resize(instanceCount * perSlot);
+                for (size_t i = 0; i < instanceCount; ++i)
+                {
+                    const size_t first = slots[i] * perSlot;
+                    for (size_t j = 0; j < perSlot; ++j)
+                        instances.visibleIds[i * perSlot + j] = GLuint(first + j);
+                }
+
+                // attribute pointers already keep their buffers, binding
+                // here for the upload doesn't disturb them. Each level
+                // re-specifies the stores, the driver orphans the ones
+                // earlier levels still draw from.
+                instances.uploadVisible();
+                instanceVBO = instances.visibleVBO;
+                instanceColors = !instances.visibleColors.empty();
+                colorsVBO = instances.visibleColorsVBO;
+                idsVBO = instances.visibleIdsVBO;
+            }
+
+            // what each level draws: the mesh, its decimated triangles
+            // (the full ones when it has none), or the middle of its
+            // bounds as a point.
+            GLenum mode = GL_TRIANGLES;
+            GLsizei indexCount = geometry.indexCount;
+            if (&geometry != boundGeometry)
+                bindGeometry(geometry, item.state);
+            if (level == MyInstanceLod::LevelDecimated && geometry.decimatedIndexCount > 0)
+            {
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geometry.decimatedIBO);
+                indexCount = geometry.decimatedIndexCount;
+                boundGeometry = nullptr;
+            }
+            else if (level == MyInstanceLod::LevelPoint)
+            {
+                glBindBuffer(GL_ARRAY_BUFFER, geometry.impostorVBO);
+                glVertexAttribPointer(POSITION_LOCATION, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+                mode = GL_POINTS;
+                boundGeometry = nullptr;
+            }
+
+            // one row of the instance matrix per attribute, the program
+            // puts it in front of the model transform. Factored instances
+            // advance the parent once every perSlot instances, the program
+            // fetches the child from the texture.
+            glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+            for (GLuint c = 0; c < 4; ++c)
+            {
+                glVertexAttribPointer(INSTANCE_TRANSFORM_LOCATION + c, 4, GL_FLOAT, GL_FALSE,
+                    sizeof(pxr::GfMatrix4f), (void*)(sizeof(GLfloat) * 4 * c));
+                glVertexAttribDivisor(INSTANCE_TRANSFORM_LOCATION + c, GLuint(perSlot));
+            }
+            glUniform1i(CHILD_COUNT_UNIFORM, instances.factored() ? GLint(perSlot) : 0);
+
+            // ids: one per drawn instance. Colors: one per slot, or the
+            // children's from their texture. A missing stream reads the
+            // current (constant) attribute value instead.
+            glBindBuffer(GL_ARRAY_BUFFER, idsVBO);
+            glVertexAttribIPointer(INSTANCE_ID_LOCATION, 1, GL_UNSIGNED_INT, 0, (void*)0);
+            if (instanceColors)
+            {
+                glEnableVertexAttribArray(INSTANCE_COLOR_LOCATION);
+                glBindBuffer(GL_ARRAY_BUFFER, colorsVBO);
+                glVertexAttribPointer(INSTANCE_COLOR_LOCATION, 4, GL_FLOAT, GL_FALSE, 0, (void*)0);
+                glVertexAttribDivisor(INSTANCE_COLOR_LOCATION, GLuint(perSlot));
+            }
+            else
+            {
+                glDisableVertexAttribArray(INSTANCE_COLOR_LOCATION);
+            }
+            glUniform1i(USE_INSTANCE_COLOR_UNIFORM, instanceColors ? 1 : 0);
+            glUniform1i(USE_CHILD_COLORS_UNIFORM, instances.hasChildColors() ? 1 : 0);
+            // faces are those of the full triangles only.
+            glUniform1i(USE_TRIANGLE_FACES_UNIFORM,
+                mode == GL_TRIANGLES && indexCount == geometry.indexCount && geometry.facesTexture != 0 ? 1 : 0);
+
+            // points are as wide as the mesh bounds would be on screen,
+            // the program scales this by the instance's own scale and
+            // divides by w.
+            if (mode == GL_POINTS)
+            {
+                const float modelScale = pxr::GfVec3f(item.transform[0][0], item.transform[0][1],
+                    item.transform[0][2]).GetLength();
+                glUniform1f(IMPOSTOR_SIZE_UNIFORM,
+                    float(geometry.bounds.GetSize().GetLength() * modelScale * lod.pixelScale));
+            }
+
+            glActiveTexture(GL_TEXTURE0 + CHILD_TRANSFORMS_UNIT);
+            glBindTexture(GL_TEXTURE_BUFFER, instances.childTransformsTexture);
+            glActiveTexture(GL_TEXTURE0 + CHILD_COLORS_UNIT);
+            glBindTexture(GL_TEXTURE_BUFFER, instances.hasChildColors() ? instances.childColorsTexture : 0);
+            if (mode == GL_POINTS)
+                glDrawArraysInstanced(GL_POINTS, 0, 1, GLsizei(instanceCount * perSlot));
+            else
+                glDrawElementsInstanced(GL_TRIANGLES, indexCount, GL_UNSIGNED_INT, (void*)0,
+                    GLsizei(instanceCount * perSlot));
+
+            if (mode == GL_POINTS)
+                glUniform1f(IMPOSTOR_SIZE_UNIFORM, 0.0f);
+        }
+    }
+
+    for (GLuint c = 0; c < 4; ++c)
+    {
+        glVertexAttribDivisor(INSTANCE_TRANSFORM_LOCATION + c, 0);
+        glDisableVertexAttribArray(INSTANCE_TRANSFORM_LOCATION + c);
+    }
+    for (GLuint location : { INSTANCE_COLOR_LOCATION, INSTANCE_ID_LOCATION })
+    {
+        glVertexAttribDivisor(location, 0);
+        glDisableVertexAttribArray(location);
+    }
+    glDisableVertexAttribArray(COLOR_LOCATION);
+    glDisableVertexAttribArray(POSITION_LOCATION);
+    glDisable(GL_PROGRAM_POINT_SIZE);
+    glActiveTexture(GL_TEXTURE0 + TRIANGLE_FACES_UNIT);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    glActiveTexture(GL_TEXTURE0 + CHILD_COLORS_UNIT);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    glActiveTexture(GL_TEXTURE0 + CHILD_TRANSFORMS_UNIT);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    glUseProgram(0);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
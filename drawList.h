@@ -0,0 +1,180 @@
+#ifndef MY_DRAWLIST_H
+#define MY_DRAWLIST_H
+
+#include <pxr/pxr.h>
+#include <pxr/base/gf/matrix4d.h>
+#include <pxr/base/gf/matrix4f.h>
+#include <pxr/base/gf/range3f.h>
+#include <pxr/base/gf/vec4f.h>
+#include <pxr/base/vt/types.h>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "geometry.h"
+
+// Everything needed to draw one mesh, copied out of MyMesh when the draw
+// list is compiled (or refreshed) so drawing never has to touch the rprims.
+struct MyDrawItem
+{
+    // StateInstanced is the highest bit, so all instanced items come last.
+    // Items of the same state share one program bind.
+    enum StateBits : int
+    {
+        StateNormals = 1 << 0,
+        StateColors = 1 << 1,
+        StateInstanced = 1 << 2,
+    };
+
+    // not a reference of its own: meshes keep their geometry alive, and
+    // a mesh changing geometry or going away recompiles the list before
+    // the next draw (a count of the meshes using it is what
+    // acquireGeometry relies on).
+    MyGeometry* geometry = nullptr;
+    pxr::GfMatrix4f transform;
+    pxr::GfVec4f color;
+    // null for non instanced meshes.
+    std::shared_ptr<MyInstanceBuffer> instances;
+    // world space bounds, of all instances for instanced items.
+    pxr::GfRange3f bounds;
+    // the rprim's, for the primId AOV.
+    int primId;
+    // Which vertex arrays the item needs, draw items are sorted on it.
+    int state;
+};
+
+// Instance level of detail for a draw: every visible instance (or parent
+// of factored instances) is classified by how many pixels its bounds cover
+// on screen. Below decimatedSize it is drawn with the decimated geometry
+// of its mesh, below pointSize as a single point. Off when pixelScale is 0.
+struct MyInstanceLod
+{
+    enum Level : int
+    {
+        LevelFull,
+        LevelDecimated,
+        LevelPoint,
+        LevelCount
+    };
+
+    // world to clip space, to tell how far an instance is.
+    pxr::GfMatrix4d viewProjection;
+    // pixels a world unit covers at a clip w of 1: half the viewport
+    // height times the [1][1] entry of the projection.
+    double pixelScale = 0.0;
+    float decimatedSize = 0.0f;
+    float pointSize = 0.0f;
+
+    bool enabled() const { return pixelScale > 0.0 && (decimatedSize > 0.0f || pointSize > 0.0f); }
+    Level classify(pxr::GfRange3f const& bounds) const;
+};
+
+// Flat, contiguous list of draw items compiled in CommitResources, sorted
+// by GL state and then by geometry so that consecutive items share as many
+// bindings as possible. Drawing is a linear scan with no lookups.
+class MyDrawList
+{
+public:
+    MyDrawList();
+
+    void clear();
+    void add(MyDrawItem&& item);
+
+    // Sort the items, call once everything has been added.
+    void compile();
+    // Index item i was added with, before compile() sorted it.
+    uint32_t addedIndex(size_t i) const { return _order[i]; }
+
+    // Replace item i with a new copy of it, for a mesh that moved or
+    // deformed. False, leaving it as it was, when the copy doesn't fit
+    // where the list has the item: another geometry, state or instance
+    // buffer, or another count of primitives. The layout of
+    // primitiveBounds() stays the same, only the bounds change.
+    bool refresh(size_t i, MyDrawItem&& item);
+
+    // Cullable primitives of the list: one per non instanced item, one per
+    // instance (or per parent of factored instances) of instanced ones,
+    // numbered in draw order. These are the
+    // bounds to build the scene BVH from.
+    std::vector<pxr::GfRange3f> primitiveBounds() const;
+    std::vector<uint32_t> const& primitiveOffsets() const { return _primitiveOffsets; }
+
+    // Attribute locations of the points and, for meshes with per-vertex
+    // colors, the colors (the constantColor uniform otherwise).
+    static const GLuint POSITION_LOCATION = 0;
+    static const GLuint COLOR_LOCATION = 1;
+    // Attribute location of the per-instance transform (a mat4, so it
+    // takes this location and the 3 following ones) in the instanced
+    // programs. Factored instances also set the childCount uniform and
+    // bind the childTransforms texture buffer on CHILD_TRANSFORMS_UNIT.
+    static const GLuint INSTANCE_TRANSFORM_LOCATION = 4;
+    // Per-instance primvars: displayColor/displayOpacity (used instead of
+    // the mesh color when the useInstanceColor uniform is set, read like
+    // the transform), and the instance id (a uint). Factored instances
+    // with colors of their own set useChildColors instead and bind the
+    // childColors texture buffer on CHILD_COLORS_UNIT. Point impostors
+    // size themselves from the impostorSize uniform.
+    static const GLuint INSTANCE_COLOR_LOCATION = 8;
+    static const GLuint INSTANCE_ID_LOCATION = 10;
+
+    // Uniform locations. The mesh transform goes in front of the instance
+    // transforms, then view and projection, those of the motion subframe.
+    static const GLint PROJECTION_UNIFORM = 0;
+    static const GLint VIEW_UNIFORM = 1;
+    static const GLint MODEL_UNIFORM = 2;
+    static const GLint CONSTANT_COLOR_UNIFORM = 3;
+    static const GLint PRIM_ID_UNIFORM = 4;
+    static const GLint USE_TRIANGLE_FACES_UNIFORM = 5;
+    static const GLint CHILD_COUNT_UNIFORM = 6;
+    static const GLint USE_INSTANCE_COLOR_UNIFORM = 7;
+    static const GLint IMPOSTOR_SIZE_UNIFORM = 8;
+    static const GLint USE_CHILD_COLORS_UNIFORM = 9;
+    static const GLuint CHILD_TRANSFORMS_UNIT = 0;
+    static const GLuint TRIANGLE_FACES_UNIT = 1;
+    static const GLuint CHILD_COLORS_UNIT = 2;
+
+    // G-buffer outputs of the programs, the fragment locations of the
+    // color, primId, instanceId and elementId AOVs. Non instanced items
+    // have an instance id of -1. The elementId comes from the geometry's
+    // triangle faces, bound on TRIANGLE_FACES_UNIT, and is -1 for
+    // decimated triangles and points.
+    static const GLuint COLOR_OUTPUT = 0;
+    static const GLuint PRIM_ID_OUTPUT = 1;
+    static const GLuint INSTANCE_ID_OUTPUT = 2;
+    static const GLuint ELEMENT_ID_OUTPUT = 3;
+
+    // Must be called on the thread owning the GL context, with a vertex
+    // array object of the caller bound. Items are drawn with the
+    // MyShaderPrograms of their state, those whose program failed to
+    // build are skipped. Only the primitives listed in visiblePrimitives,
+    // sorted, are drawn, instances as they are at the given motion
+    // subframe and at their level of detail.
+    void draw(pxr::GfMatrix4d const& view, pxr::GfMatrix4d const& projection,
+        std::vector<uint32_t> const& visiblePrimitives, MyInstanceLod const& lod, size_t motionSample = 0) const;
+
+    size_t size() const { return _items.size(); }
+
+    // What the last draw culled.
+    size_t culledItems() const { return _culledItems; }
+    size_t culledInstances() const { return _culledInstances; }
+    size_t drawnInstances() const { return _drawnInstances; }
+    size_t lodInstances(MyInstanceLod::Level level) const { return _lodInstances[level]; }
+
+private:
+    std::vector<MyDrawItem> _items;
+    // _order[i] is the index item i was added with.
+    std::vector<uint32_t> _order;
+    // item i owns primitives [_primitiveOffsets[i], _primitiveOffsets[i + 1])
+    std::vector<uint32_t> _primitiveOffsets;
+
+    mutable size_t _culledItems;
+    mutable size_t _culledInstances;
+    mutable size_t _drawnInstances;
+    mutable size_t _lodInstances[MyInstanceLod::LevelCount];
+    // visible slots of the item being drawn, per level, kept for their
+    // storage.
+    mutable std::vector<uint32_t> _lodSlots[MyInstanceLod::LevelCount];
+};
+
+#endif
@@ -0,0 +1,102 @@
+#include "frustum.h"
+
+#include <cmath>
+
+MyFrustum::MyFrustum()
+{
+    // nothing gets culled by a default frustum
+    for (int i = 0; i < 6; ++i)
+        _planes[i] = pxr::GfVec4f(0.0f, 0.0f, 0.0f, 1.0f);
+}
+
+MyFrustum::MyFrustum(pxr::GfMatrix4d const& viewProjection)
+{
+    // Gribb/Hartmann with row vectors: clip = p * M, so each plane is a
+    // combination of the columns of M. Clip space is GL's, -w <= z <= w.
+    const pxr::GfMatrix4d& m = viewProjection;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        for (int side = 0; side < 2; ++side)
+        {
+            const double sign = side == 0 ? 1.0 : -1.0;
+            pxr::GfVec4f plane(
+                float(m[0][3] + sign * m[0][axis]),
+                float(m[1][3] + sign * m[1][axis]),
+                float(m[2][3] + sign * m[2][axis]),
+                float(m[3][3] + sign * m[3][axis]));
+            const float length = std::sqrt(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+            if (length > 0.0f)
+                plane /= length;
+            _planes[axis * 2 + side] = plane;
+        }
+    }
+}
+
+bool MyFrustum::intersects(pxr::GfRange3f const& box) const
+{
+    if (box.IsEmpty())
+        return true;
+
+    const pxr::GfVec3f& lo = box.GetMin();
+    const pxr::GfVec3f& hi = box.GetMax();
+    for (int i = 0; i < 6; ++i)
+    {
+        const pxr::GfVec4f& p = _planes[i];
+        // the corner furthest along the plane normal
+        const float x = p[0] >= 0.0f ? hi[0] : lo[0];
+        const float y = p[1] >= 0.0f ? hi[1] : lo[1];
+        const float z = p[2] >= 0.0f ? hi[2] : lo[2];
+        if (p[0] * x + p[1] * y + p[2] * z + p[3] < 0.0f)
+            return false;
+    }
+    return true;
+}
+
+MyFrustum::Containment MyFrustum::classify(pxr::GfRange3f const& box) const
+{
+    if (box.IsEmpty())
+        return Intersecting;
+
+    const pxr::GfVec3f& lo = box.GetMin();
+    const pxr::GfVec3f& hi = box.GetMax();
+    Containment result = Inside;
+    for (int i = 0; i < 6; ++i)
+    {
+        const pxr::GfVec4f& p = _planes[i];
+        // furthest corner along the plane normal, and the nearest one
+        const float fx = p[0] >= 0.0f ? hi[0] : lo[0];
+        const float fy = p[1] >= 0.0f ? hi[1] : lo[1];
+        const float fz = p[2] >= 0.0f ? hi[2] : lo[2];
+        if (p[0] * fx + p[1] * fy + p[2] * fz + p[3] < 0.0f)
+            return Outside;
+
+        const float nx = p[0] >= 0.0f ? lo[0] : hi[0];
+        const float ny = p[1] >= 0.0f ? lo[1] : hi[1];
+        const float nz = p[2] >= 0.0f ? lo[2] : hi[2];
+        if (p[0] * nx + p[1] * ny + p[2] * nz + p[3] < 0.0f)
+            result = Intersecting;
+    }
+    return result;
+}
+
+pxr::GfRange3f MyTransformBounds(pxr::GfRange3f const& box, pxr::GfMatrix4f const& transform)
+{
+    if (box.IsEmpty())
+        return box;
+
+    const pxr::GfVec3f center = (box.GetMin() + box.GetMax()) * 0.5f;
+    const pxr::GfVec3f half = (box.GetMax() - box.GetMin()) * 0.5f;
+
+    // row vectors: p' = p * M
+    pxr::GfVec3f newCenter(transform[3][0], transform[3][1], transform[3][2]);
+    pxr::GfVec3f newHalf(0.0f);
+    for (int j = 0; j < 3; ++j)
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            newCenter[j] += center[i] * transform[i][j];
+            newHalf[j] += half[i] * std::fabs(transform[i][j]);
+        }
+    }
+    return pxr::GfRange3f(newCenter - newHalf, newCenter + newHalf);
+}
@@ -0,0 +1,43 @@
+#ifndef MY_FRUSTUM_H
+#define MY_FRUSTUM_H
+
+#include <pxr/pxr.h>
+#include <pxr/base/gf/matrix4d.h>
+#include <pxr/base/gf/matrix4f.h>
+#include <pxr/base/gf/range3f.h>
+#include <pxr/base/gf/vec4f.h>
+
+// View frustum as 6 clip planes extracted from a world to clip matrix
+// (Gf convention, i.e. view * projection), used to cull world space
+// axis aligned boxes.
+class MyFrustum
+{
+public:
+    MyFrustum();
+    MyFrustum(pxr::GfMatrix4d const& viewProjection);
+
+    // True when the box is at least partially inside. Empty boxes (no
+    // extent known) are never culled.
+    bool intersects(pxr::GfRange3f const& box) const;
+
+    enum Containment
+    {
+        Outside,
+        Intersecting,
+        Inside,
+    };
+
+    // Like intersects, but also tells boxes fully inside apart, so a whole
+    // BVH subtree can be accepted without testing what it holds.
+    Containment classify(pxr::GfRange3f const& box) const;
+
+private:
+    // a, b, c, d with a*x + b*y + c*z + d >= 0 inside.
+    pxr::GfVec4f _planes[6];
+};
+
+// World space axis aligned box of a local box moved by transform, without
+// going through the 8 corners.
+pxr::GfRange3f MyTransformBounds(pxr::GfRange3f const& box, pxr::GfMatrix4f const& transform);
+
+#endif
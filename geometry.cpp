@@ -0,0 +1,474 @@
+#include "geometry.h"
+#include "renderDelegate.h"
+#include "renderPass.h"
+#include "frustum.h"
+
+#include <pxr/base/arch/hash.h>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_reduce.h>
+
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+
+// instances bounded per TBB task.
+static const size_t BOUNDS_GRAIN_SIZE = 4096;
+
+// decimated geometry keeps about this many points per original point, on
+// at most that many cells along the longest axis.
+static const float DECIMATED_CELLS_PER_POINT = 0.125f;
+static const int DECIMATED_MAX_RESOLUTION = 1024;
+
+MyGeometry::MyGeometry(MyRenderDelegate* owner)
+    : key()
+    , topologyHash(0)
+    , buildEpoch(size_t(-1))
+    , decimatedEpoch(size_t(-1))
+    , pointsVBO(0)
+    , normalsVBO(0)
+    , colorsVBO(0)
+    , indicesIBO(0)
+    , indexCount(0)
+    , facesBuffer(0)
+    , facesTexture(0)
+    , decimatedIBO(0)
+    , decimatedIndexCount(0)
+    , impostorVBO(0)
+    , gpuDirtyBits(GpuDirtyAll)
+    , _owner(owner)
+{
+}
+
+MyGeometry::~MyGeometry()
+{
+    _owner->releaseBuffers({ pointsVBO, normalsVBO, colorsVBO, indicesIBO, facesBuffer, decimatedIBO, impostorVBO });
+    _owner->releaseTextures({ facesTexture });
+}
+
+/*static*/
+uint64_t MyGeometry::HashArray(pxr::VtVec3fArray const& values)
+{
+    return pxr::ArchHash64(reinterpret_cast<const char*>(values.cdata()), values.size() * sizeof(pxr::GfVec3f));
+}
+
+/*static*/
+uint64_t MyGeometry::CombineHashes(pxr::HdTopology::ID topologyHash, uint64_t pointsHash, uint64_t colorsHash)
+{
+    const uint64_t hashes[] = { uint64_t(topologyHash), pointsHash, colorsHash };
+    return pxr::ArchHash64(reinterpret_cast<const char*>(hashes), sizeof(hashes));
+}
+
+size_t MyGeometry::byteSize() const
+{
+    return points.size() * sizeof(pxr::GfVec3f)
+        + normals.size() * sizeof(pxr::GfVec3f)
+        + displayColors.size() * sizeof(pxr::GfVec3f)
+        + triangulatedIndices.size() * sizeof(pxr::GfVec3i)
+        + triangleFaces.size() * sizeof(int)
+        + decimatedIndices.size() * sizeof(pxr::GfVec3i);
+}
+
+void MyGeometry::buildDecimated()
+{
+    decimatedIndices = pxr::VtVec3iArray();
+    if (points.empty() || triangulatedIndices.empty() || bounds.IsEmpty())
+        return;
+
+    // a grid of cubic cells over the bounds, a surface crosses about
+    // resolution^2 of them: about DECIMATED_CELLS_PER_POINT points stay.
+    const pxr::GfVec3f size = bounds.GetSize();
+    const float extent = std::max({ size[0], size[1], size[2] });
+    const int resolution = std::min(DECIMATED_MAX_RESOLUTION,
+        std::max(2, int(std::sqrt(float(points.size()) * DECIMATED_CELLS_PER_POINT))));
+    const float cellScale = extent > 0.0f ? float(resolution) / extent : 0.0f;
+    const pxr::GfVec3f origin = bounds.GetMin();
+
+    // every point moves to the first point of its cell.
+    std::vector<int> representative(points.size());
+    std::unordered_map<uint64_t, int> cells;
+    cells.reserve(points.size() / 4);
+    for (size_t i = 0; i < points.size(); ++i)
+    {
+        uint64_t key = 0;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            const int cell = std::min(resolution - 1, std::max(0, int((points[i][axis] - origin[axis]) * cellScale)));
+            key = key * uint64_t(resolution) + uint64_t(cell);
+        }
+        representative[i] = cells.emplace(key, int(i)).first->second;
+    }
+
+    // triangles with two corners in the same cell collapse.
+    pxr::VtVec3iArray decimated;
+    decimated.reserve(triangulatedIndices.size() / 2);
+    const int numPoints = int(points.size());
+    for (const pxr::GfVec3i& triangle : triangulatedIndices)
+    {
+        if (triangle[0] < 0 || triangle[0] >= numPoints || triangle[1] < 0 || triangle[1] >= numPoints ||
+            triangle[2] < 0 || triangle[2] >= numPoints)
+            continue;
+        const int a = representative[triangle[0]];
+        const int b = representative[triangle[1]];
+        const int c = representative[triangle[2]];
+        if (a != b && b != c && a != c)
+            decimated.push_back(pxr::GfVec3i(a, b, c));
+    }
+
+    // not worth a second index buffer, far instances use the full one.
+    if (decimated.size() * 4 > triangulatedIndices.size() * 3)
+        return;
+    decimatedIndices = decimated;
+}
+
+void MyGeometry::uploadBuffers()
+{
+    if (gpuDirtyBits == GpuClean)
+        return;
+
+    if (gpuDirtyBits & GpuDirtyPoints)
+    {
+        if (pointsVBO == 0)
+            pointsVBO = CreateVBO(points.cdata()->data(), GLuint(points.size() * sizeof(pxr::GfVec3f)));
+        else
+            UpdateVBO(pointsVBO, points.cdata()->data(), GLuint(points.size() * sizeof(pxr::GfVec3f)));
+
+        const pxr::GfVec3f center = bounds.IsEmpty() ? pxr::GfVec3f(0.0f) : bounds.GetMidpoint();
+        if (impostorVBO == 0)
+            impostorVBO = CreateVBO(center.data(), GLuint(sizeof(pxr::GfVec3f)));
+        else
+            UpdateVBO(impostorVBO, center.data(), GLuint(sizeof(pxr::GfVec3f)));
+    }
+
+    if (gpuDirtyBits & GpuDirtyNormals)
+    {
+        if (normals.size() != points.size())
+        {
+            // nothing usable to upload, fall back to no normals at all.
+        }
+        else if (normalsVBO == 0)
+            normalsVBO = CreateVBO(normals.cdata()->data(), GLuint(normals.size() * sizeof(pxr::GfVec3f)));
+        else
+            UpdateVBO(normalsVBO, normals.cdata()->data(), GLuint(normals.size() * sizeof(pxr::GfVec3f)));
+    }
+
+    if (gpuDirtyBits & GpuDirtyColors)
+    {
+        // only per-vertex colors need a buffer, a constant color is set
+        // with the constantColor uniform at draw time.
+        if (displayColors.size() != points.size())
+        {
+        }
+        else if (colorsVBO == 0)
+            colorsVBO = CreateVBO(displayColors.cdata()->data(), GLuint(displayColors.size() * sizeof(pxr::GfVec3f)));
+        else
+            UpdateVBO(colorsVBO, displayColors.cdata()->data(), GLuint(displayColors.size() * sizeof(pxr::GfVec3f)));
+    }
+
+    if (gpuDirtyBits & GpuDirtyIndices)
+    {
+        const GLuint* indices = reinterpret_cast<const GLuint*>(triangulatedIndices.cdata());
+        if (indicesIBO == 0)
+            indicesIBO = CreateIBO(indices, GLuint(triangulatedIndices.size() * sizeof(pxr::GfVec3i)));
+        else
+            UpdateIBO(indicesIBO, indices, GLuint(triangulatedIndices.size() * sizeof(pxr::GfVec3i)));
+        indexCount = GLsizei(triangulatedIndices.size() * 3);
+
+        if (!triangleFaces.empty())
+        {
+            const GLfloat* faces = reinterpret_cast<const GLfloat*>(triangleFaces.cdata());
+            const GLuint facesSize = GLuint(triangleFaces.size() * sizeof(int));
+            if (facesBuffer == 0)
+            {
+                facesBuffer = CreateVBO(faces, facesSize);
+                glGenTextures(1, &facesTexture);
+                glBindTexture(GL_TEXTURE_BUFFER, facesTexture);
+                glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, facesBuffer);
+                glBindTexture(GL_TEXTURE_BUFFER, 0);
+            }
+            else
+            {
+                UpdateVBO(facesBuffer, faces, facesSize);
+            }
+        }
+
+        if (!decimatedIndices.empty())
+        {
+            const GLuint* decimated = reinterpret_cast<const GLuint*>(decimatedIndices.cdata());
+            if (decimatedIBO == 0)
+                decimatedIBO = CreateIBO(decimated, GLuint(decimatedIndices.size() * sizeof(pxr::GfVec3i)));
+            else
+                UpdateIBO(decimatedIBO, decimated, GLuint(decimatedIndices.size() * sizeof(pxr::GfVec3i)));
+        }
+        decimatedIndexCount = GLsizei(decimatedIndices.size() * 3);
+    }
+
+    gpuDirtyBits = GpuClean;
+}
+
+MyInstanceBuffer::MyInstanceBuffer(MyRenderDelegate* owner)
+    : transforms()
+    , childTransforms()
+    , motionTransforms()
+    , bounds()
+    , worldBounds()
+    , transformsVBO(0)
+    , childTransformsBuffer(0)
+    , childTransformsTexture(0)
+    , motionVBOs()
+    , gpuDirty(true)
+    , patchedBounds()
+    , patchedTransforms()
+    , colors()
+    , childColors()
+    , colorsVBO(0)
+    , childColorsBuffer(0)
+    , childColorsTexture(0)
+    , idsVBO(0)
+    , idsCount(0)
+    , primvarsDirty(true)
+    , visibleTransforms()
+    , visibleColors()
+    , visibleIds()
+    , visibleVBO(0)
+    , visibleColorsVBO(0)
+    , visibleIdsVBO(0)
+    , _owner(owner)
+{
+}
+
+MyInstanceBuffer::~MyInstanceBuffer()
+{
+    _owner->releaseBuffers({ transformsVBO, visibleVBO, childTransformsBuffer });
+    _owner->releaseBuffers({ colorsVBO, childColorsBuffer, idsVBO, visibleColorsVBO, visibleIdsVBO });
+    _owner->releaseTextures({ childTransformsTexture, childColorsTexture });
+    for (GLuint vbo : motionVBOs)
+        _owner->releaseBuffers({ vbo });
+}
+
+void MyInstanceBuffer::setTransforms(pxr::VtMatrix4fArray const& instanceTransforms,
+    pxr::VtMatrix4fArray const& children)
+{
+    // the instancer cache hands out the same arrays until something
+    // changes, nothing to upload again then.
+    if (transforms.IsIdentical(instanceTransforms) && childTransforms.IsIdentical(children)
+        && motionTransforms.empty())
+        return;
+
+    transforms = instanceTransforms;
+    childTransforms = children;
+    motionTransforms.clear();
+    gpuDirty = true;
+    patchedBounds.clear();
+    patchedTransforms.clear();
+}
+
+void MyInstanceBuffer::setMotionTransforms(std::vector<pxr::VtMatrix4fArray> const& samples)
+{
+    if (samples.size() <= 1)
+    {
+        setTransforms(samples.empty() ? pxr::VtMatrix4fArray() : samples.front());
+        return;
+    }
+
+    if (samples.size() == motionTransforms.size() && childTransforms.empty()
+        && std::equal(samples.begin(), samples.end(), motionTransforms.begin(),
+            [](pxr::VtMatrix4fArray const& a, pxr::VtMatrix4fArray const& b) { return a.IsIdentical(b); }))
+        return;
+
+    motionTransforms = samples;
+    transforms = samples.front();
+    childTransforms = pxr::VtMatrix4fArray();
+    gpuDirty = true;
+    patchedBounds.clear();
+    patchedTransforms.clear();
+}
+
+void MyInstanceBuffer::markTransformsPatched(std::vector<uint32_t> const& changed)
+{
+    patchedBounds.insert(patchedBounds.end(), changed.begin(), changed.end());
+    if (!gpuDirty)
+        patchedTransforms.insert(patchedTransforms.end(), changed.begin(), changed.end());
+}
+
+void MyInstanceBuffer::setPrimvars(pxr::VtVec4fArray const& instanceColors, pxr::VtVec4fArray const& children)
+{
+    if (colors.IsIdentical(instanceColors) && childColors.IsIdentical(children))
+        return;
+
+    colors = instanceColors;
+    childColors = children;
+    primvarsDirty = true;
+}
+
+// Create or refill a buffer with raw bytes.
+static void _UploadBuffer(GLuint* vbo, const void* data, size_t size)
+{
+    if (*vbo == 0)
+        *vbo = CreateVBO(static_cast<const GLfloat*>(data), GLuint(size));
+    else
+        UpdateVBO(*vbo, static_cast<const GLfloat*>(data), GLuint(size));
+}
+
+void MyInstanceBuffer::updateBounds(pxr::GfRange3f const& localBounds, pxr::GfMatrix4f const& meshTransform,
+    bool patchedOnly)
+{
+    // only some instances were patched: bound them again and grow the
+    // union, it may end up a little loose until the next full update.
+    if (patchedOnly && bounds.size() == transforms.size() && patchable())
+    {
+        const pxr::GfMatrix4f* instanceTransforms = transforms.cdata();
+        for (uint32_t i : patchedBounds)
+        {
+            bounds[i] = MyTransformBounds(localBounds, meshTransform * instanceTransforms[i]);
+            worldBounds.UnionWith(bounds[i]);
+        }
+        patchedBounds.clear();
+        return;
+    }
+    patchedBounds.clear();
+
+    // factored instances: bound all children in their parent's space first,
+    // then each slot is that box moved by its parent.
+    pxr::GfRange3f slotBounds = localBounds;
+    pxr::GfMatrix4f slotTransform = meshTransform;
+    if (factored())
+    {
+        slotBounds = pxr::GfRange3f();
+        for (const pxr::GfMatrix4f& child : childTransforms)
+            slotBounds.UnionWith(MyTransformBounds(localBounds, meshTransform * child));
+        slotTransform.SetIdentity();
+    }
+
+    const pxr::GfMatrix4f* instanceTransforms = transforms.cdata();
+    bounds.resize(transforms.size());
+    pxr::GfRange3f* instanceBounds = bounds.data();
+    worldBounds = tbb::parallel_reduce(tbb::blocked_range<size_t>(0, transforms.size(), BOUNDS_GRAIN_SIZE),
+        pxr::GfRange3f(),
+        [this, instanceTransforms, instanceBounds, &slotBounds, &slotTransform](
+            tbb::blocked_range<size_t> const& r, pxr::GfRange3f range)
+        {
+            for (size_t i = r.begin(); i != r.end(); ++i)
+            {
+                // same order as the instancing program: model, then instance.
+                instanceBounds[i] = MyTransformBounds(slotBounds, slotTransform * instanceTransforms[i]);
+                // moving instances are culled on their whole path.
+                for (size_t k = 1; k < motionTransforms.size(); ++k)
+                    instanceBounds[i].UnionWith(MyTransformBounds(slotBounds, slotTransform * motionTransforms[k][i]));
+                range.UnionWith(instanceBounds[i]);
+            }
+            return range;
+        },
+        [](pxr::GfRange3f a, pxr::GfRange3f const& b) { return a.UnionWith(b); });
+}
+
+void MyInstanceBuffer::uploadBuffers()
+{
+    if (transforms.empty())
+        return;
+
+    // ids only depend on the count, primvars are uploaded when they change.
+    if (idsCount != size())
+    {
+        std::vector<GLuint> ids(size());
+        for (size_t i = 0; i < ids.size(); ++i)
+            ids[i] = GLuint(i);
+        _UploadBuffer(&idsVBO, ids.data(), ids.size() * sizeof(GLuint));
+        idsCount = ids.size();
+    }
+    if (primvarsDirty)
+    {
+        if (!colors.empty())
+            _UploadBuffer(&colorsVBO, colors.cdata(), colors.size() * sizeof(pxr::GfVec4f));
+        if (!childColors.empty())
+        {
+            _UploadBuffer(&childColorsBuffer, childColors.cdata(), childColors.size() * sizeof(pxr::GfVec4f));
+            if (childColorsTexture == 0)
+            {
+                glGenTextures(1, &childColorsTexture);
+                glBindTexture(GL_TEXTURE_BUFFER, childColorsTexture);
+                glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, childColorsBuffer);
+                glBindTexture(GL_TEXTURE_BUFFER, 0);
+            }
+        }
+        primvarsDirty = false;
+    }
+
+    // patched instances: upload runs of them, close runs merged so a
+    // scattered edit doesn't turn into thousands of calls.
+    if (!gpuDirty && !patchedTransforms.empty() && transformsVBO != 0)
+    {
+        std::sort(patchedTransforms.begin(), patchedTransforms.end());
+        const pxr::GfMatrix4f* instanceTransforms = transforms.cdata();
+        size_t first = 0;
+        while (first < patchedTransforms.size())
+        {
+            size_t last = first;
+            while (last + 1 < patchedTransforms.size() && patchedTransforms[last + 1] - patchedTransforms[last] <= 16)
+                ++last;
+            const uint32_t begin = patchedTransforms[first];
+            const uint32_t end = patchedTransforms[last] + 1;
+            UpdateVBORange(transformsVBO, GLuint(begin * sizeof(pxr::GfMatrix4f)),
+                instanceTransforms[begin].data(), GLuint((end - begin) * sizeof(pxr::GfMatrix4f)));
+            first = last + 1;
+        }
+    }
+    patchedTransforms.clear();
+
+    if (!gpuDirty)
+        return;
+
+    const GLfloat* data = transforms.cdata()->data();
+    const GLuint size = GLuint(transforms.size() * sizeof(pxr::GfMatrix4f));
+    if (transformsVBO == 0)
+        transformsVBO = CreateVBO(data, size);
+    else
+        UpdateVBO(transformsVBO, data, size);
+
+    if (factored())
+    {
+        const GLfloat* childData = childTransforms.cdata()->data();
+        const GLuint childSize = GLuint(childTransforms.size() * sizeof(pxr::GfMatrix4f));
+        if (childTransformsBuffer == 0)
+        {
+            childTransformsBuffer = CreateVBO(childData, childSize);
+            glGenTextures(1, &childTransformsTexture);
+            glBindTexture(GL_TEXTURE_BUFFER, childTransformsTexture);
+            glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, childTransformsBuffer);
+            glBindTexture(GL_TEXTURE_BUFFER, 0);
+        }
+        else
+        {
+            UpdateVBO(childTransformsBuffer, childData, childSize);
+        }
+    }
+
+    // the other motion subframes, buffers of subframes gone are dropped.
+    const size_t motionBuffers = motionTransforms.empty() ? 0 : motionTransforms.size() - 1;
+    if (motionVBOs.size() > motionBuffers)
+    {
+        glDeleteBuffers(GLsizei(motionVBOs.size() - motionBuffers), motionVBOs.data() + motionBuffers);
+        motionVBOs.resize(motionBuffers);
+    }
+    for (size_t k = 0; k < motionBuffers; ++k)
+    {
+        const GLfloat* sampleData = motionTransforms[k + 1].cdata()->data();
+        if (k < motionVBOs.size())
+            UpdateVBO(motionVBOs[k], sampleData, size);
+        else
+            motionVBOs.push_back(CreateVBO(sampleData, size));
+    }
+
+    gpuDirty = false;
+}
+
+void MyInstanceBuffer::uploadVisible()
+{
+    if (visibleTransforms.empty())
+        return;
+
+    _UploadBuffer(&visibleVBO, visibleTransforms.data(), visibleTransforms.size() * sizeof(pxr::GfMatrix4f));
+    _UploadBuffer(&visibleIdsVBO, visibleIds.data(), visibleIds.size() * sizeof(GLuint));
+    if (!visibleColors.empty())
+        _UploadBuffer(&visibleColorsVBO, visibleColors.data(), visibleColors.size() * sizeof(pxr::GfVec4f));
+}
@@ -0,0 +1,264 @@
+#ifndef MY_GEOMETRY_H
+#define MY_GEOMETRY_H
+
+#include <pxr/pxr.h>
+#include <pxr/imaging/hd/meshTopology.h>
+#include <pxr/imaging/hd/vertexAdjacency.h>
+#include <pxr/usd/sdf/path.h>
+#include <pxr/base/vt/types.h>
+
+#include <pxr/base/gf/matrix4f.h>
+#include <pxr/base/gf/range3f.h>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "glad.h"
+
+class MyRenderDelegate;
+
+// Key of the shared geometry cache: the data sharing id when the scene
+// delegate provides one, otherwise the topology and primvars themselves.
+// Those are compared, not only their hash: meshes whose hashes collide
+// don't share geometry. The arrays are the mesh's own, not copies.
+struct MyGeometryKey
+{
+    pxr::SdfPath dataSharingId;
+    uint64_t hash = 0;
+    pxr::HdMeshTopology topology;
+    pxr::VtVec3fArray points;
+    pxr::VtVec3fArray displayColors;
+
+    bool operator==(MyGeometryKey const& other) const
+    {
+        if (dataSharingId != other.dataSharingId || hash != other.hash)
+            return false;
+        return !dataSharingId.IsEmpty() || (topology == other.topology && points == other.points &&
+            displayColors == other.displayColors);
+    }
+
+    struct HashFunctor
+    {
+        size_t operator()(MyGeometryKey const& key) const
+        {
+            return key.dataSharingId.IsEmpty() ? size_t(key.hash) : pxr::SdfPath::Hash()(key.dataSharingId);
+        }
+    };
+};
+
+// Triangulated, GPU-ready data of a mesh, shared by every MyMesh with the
+// same MyGeometryKey. Lifetime is tied to the meshes holding it: when the
+// last one lets go, its GL buffers are queued for release on the delegate.
+class MyGeometry
+{
+public:
+    MyGeometry(MyRenderDelegate* owner);
+    ~MyGeometry();
+
+    // Hash of a primvar array, and of a whole geometry from the hashes
+    // of its topology and primvars, for MyGeometryKey.
+    static uint64_t HashArray(pxr::VtVec3fArray const& values);
+    static uint64_t CombineHashes(pxr::HdTopology::ID topologyHash, uint64_t pointsHash, uint64_t colorsHash);
+
+    // Upload whatever changed since the last draw into the GPU buffers.
+    // Must be called on the thread owning the GL context.
+    void uploadBuffers();
+
+    // CPU side footprint, also what each extra user saves on the GPU.
+    size_t byteSize() const;
+
+    // Fill decimatedIndices from points and triangulatedIndices by vertex
+    // clustering, for far instances of instanced meshes. Left empty when
+    // that wouldn't save much. Call with buildMutex held.
+    void buildDecimated();
+
+    enum GpuDirtyBits : int
+    {
+        GpuClean = 0,
+        GpuDirtyPoints = 1 << 0,
+        GpuDirtyNormals = 1 << 1,
+        GpuDirtyColors = 1 << 2,
+        GpuDirtyIndices = 1 << 3,
+        GpuDirtyAll = GpuDirtyPoints | GpuDirtyNormals | GpuDirtyColors | GpuDirtyIndices
+    };
+
+    MyGeometryKey key;
+    pxr::HdTopology::ID topologyHash;
+
+    // Meshes sharing a data sharing id sync the same edit concurrently:
+    // the first to take buildMutex in a sync rebuilds and stamps
+    // buildEpoch, the others find it already done.
+    std::mutex buildMutex;
+    size_t buildEpoch;
+
+    pxr::VtVec3fArray points;
+    pxr::VtVec3fArray normals;
+    pxr::VtVec3fArray displayColors;
+    pxr::VtVec3iArray triangulatedIndices;
+    // authored face of each triangle, what the elementId AOV reports.
+    pxr::VtIntArray triangleFaces;
+    std::shared_ptr<pxr::Hd_VertexAdjacency> adjacency;
+    // local bounds of points, used for culling when no extent is authored.
+    pxr::GfRange3f bounds;
+    // coarser triangles over the same points, and the buildEpoch they
+    // were made for.
+    pxr::VtVec3iArray decimatedIndices;
+    size_t decimatedEpoch;
+
+    // GPU copies of the arrays above. Sync runs on Hydra worker threads
+    // without a current GL context, so it only flags gpuDirtyBits and the
+    // actual upload happens at draw time.
+    GLuint pointsVBO;
+    GLuint normalsVBO;
+    GLuint colorsVBO;
+    GLuint indicesIBO;
+    GLsizei indexCount;
+    // triangleFaces, as a R32I texture buffer read with gl_PrimitiveID.
+    GLuint facesBuffer;
+    GLuint facesTexture;
+    GLuint decimatedIBO;
+    GLsizei decimatedIndexCount;
+    // a single point in the middle of bounds, drawn for point impostors.
+    GLuint impostorVBO;
+    int gpuDirtyBits;
+
+private:
+    MyGeometry(const MyGeometry&) = delete;
+    MyGeometry& operator =(const MyGeometry&) = delete;
+
+    MyRenderDelegate* _owner;
+};
+
+// Per-instance data of an instanced mesh, drawn with one instanced draw
+// call: the transforms are uploaded as float matrices into a buffer read
+// with an attribute divisor of 1.
+//
+// Nested instances can be kept factored: transforms then holds the parent
+// transforms, childTransforms the ones of the innermost instancer, and
+// instance i * childTransforms.size() + j is childTransforms[j] *
+// transforms[i]. The parents are read with an attribute divisor of the
+// child count and the children from a texture buffer. Culling works per
+// parent ("slot"), each one bounding all its children.
+//
+// With motion blur, motionTransforms holds the (flat) transforms at each
+// subframe, transforms being the first of them, and every slot bounds its
+// instance over all subframes.
+class MyInstanceBuffer
+{
+public:
+    MyInstanceBuffer(MyRenderDelegate* owner);
+    ~MyInstanceBuffer();
+
+    // Shares the arrays, no copy. No children means flat instances.
+    void setTransforms(pxr::VtMatrix4fArray const& instanceTransforms,
+        pxr::VtMatrix4fArray const& children = pxr::VtMatrix4fArray());
+
+    // One array per motion subframe, all the same size.
+    void setMotionTransforms(std::vector<pxr::VtMatrix4fArray> const& samples);
+
+    // transforms was patched in place (see
+    // MyInstancer::UpdateInstanceTransformsFloat) at these instances,
+    // only they get bounded and uploaded again.
+    void markTransformsPatched(std::vector<uint32_t> const& changed);
+    // ...or replaced as a whole.
+    void markTransformsReplaced()
+    {
+        gpuDirty = true;
+        patchedBounds.clear();
+        patchedTransforms.clear();
+    }
+    // Whether transforms can be patched: flat and static instances.
+    bool patchable() const { return childTransforms.empty() && motionTransforms.empty(); }
+
+    // Per-instance colors (see MyInstancer::ComputeInstancePrimvars), one
+    // per instance, or factored like the transforms: one per slot and
+    // children, the latter winning when not empty. Shares the arrays.
+    void setPrimvars(pxr::VtVec4fArray const& instanceColors,
+        pxr::VtVec4fArray const& children = pxr::VtVec4fArray());
+
+    // Transforms and their buffer for a motion subframe, the static ones
+    // without motion.
+    pxr::VtMatrix4fArray const& transformsAt(size_t motionSample) const
+    {
+        return motionSample < motionTransforms.size() ? motionTransforms[motionSample] : transforms;
+    }
+    GLuint transformsVBOAt(size_t motionSample) const
+    {
+        return motionSample > 0 && motionSample <= motionVBOs.size() ? motionVBOs[motionSample - 1] : transformsVBO;
+    }
+
+    // World space bounds of every instance of a mesh with the given local
+    // bounds and transform, call again whenever any of them changes. With
+    // patchedOnly, when only patched instances did. Parallel, call it
+    // through MyRenderDelegate::runParallel.
+    void updateBounds(pxr::GfRange3f const& localBounds, pxr::GfMatrix4f const& meshTransform,
+        bool patchedOnly = false);
+
+    // Must be called on the thread owning the GL context.
+    void uploadBuffers();
+
+    // Upload visibleTransforms, and the visible primvars, the instances
+    // that survived culling this frame. Must be called on the thread
+    // owning the GL context.
+    void uploadVisible();
+
+    // instances drawn, slots (what gets culled) and instances per slot.
+    size_t size() const { return slots() * instancesPerSlot(); }
+    size_t slots() const { return transforms.size(); }
+    size_t instancesPerSlot() const { return childTransforms.empty() ? 1 : childTransforms.size(); }
+    bool factored() const { return !childTransforms.empty(); }
+    // color streams matching the instances, ready to draw: per slot,
+    // read like the transforms, or per child, like the child transforms.
+    bool hasColors() const { return !colors.empty() && colors.size() == slots(); }
+    bool hasChildColors() const { return factored() && childColors.size() == childTransforms.size(); }
+
+    pxr::VtMatrix4fArray transforms;
+    pxr::VtMatrix4fArray childTransforms;
+    std::vector<pxr::VtMatrix4fArray> motionTransforms;
+    // one per slot.
+    std::vector<pxr::GfRange3f> bounds;
+    // union of bounds.
+    pxr::GfRange3f worldBounds;
+
+    GLuint transformsVBO;
+    // childTransforms, as a RGBA32F texture buffer, 4 texels per matrix.
+    GLuint childTransformsBuffer;
+    GLuint childTransformsTexture;
+    // motionTransforms[1...], the first one is in transformsVBO.
+    std::vector<GLuint> motionVBOs;
+    bool gpuDirty;
+    // instances patched since the last bounds update / upload, when not
+    // everything is dirty.
+    std::vector<uint32_t> patchedBounds;
+    std::vector<uint32_t> patchedTransforms;
+
+    // Instance colors, empty when the instancers have none, and the
+    // instance ids (0 to size() - 1), always uploaded.
+    pxr::VtVec4fArray colors;
+    pxr::VtVec4fArray childColors;
+    GLuint colorsVBO;
+    // childColors, as a RGBA32F texture buffer.
+    GLuint childColorsBuffer;
+    GLuint childColorsTexture;
+    GLuint idsVBO;
+    size_t idsCount;
+    bool primvarsDirty;
+
+    // Subset of transforms, colors and ids refilled at draw time when some
+    // instances are culled, the full buffers above are used when none are.
+    std::vector<pxr::GfMatrix4f> visibleTransforms;
+    std::vector<pxr::GfVec4f> visibleColors;
+    std::vector<GLuint> visibleIds;
+    GLuint visibleVBO;
+    GLuint visibleColorsVBO;
+    GLuint visibleIdsVBO;
+
+private:
+    MyInstanceBuffer(const MyInstanceBuffer&) = delete;
+    MyInstanceBuffer& operator =(const MyInstanceBuffer&) = delete;
+
+    MyRenderDelegate* _owner;
+};
+
+#endif
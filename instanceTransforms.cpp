@@ -0,0 +1,298 @@
+#include "instanceTransforms.h"
+
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+#include <pxr/base/gf/math.h>
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// instances per TBB task.
+static const size_t COMPOSE_GRAIN_SIZE = 4096;
+// instances gathered at once into the SoA block, small enough to stay on
+// the stack and in L1.
+static const size_t COMPOSE_BLOCK_SIZE = 256;
+
+namespace
+{
+    // Translations, quaternions (imaginary, real) and scales of a block of
+    // instances, one array per component.
+    struct _Block
+    {
+        float tx[COMPOSE_BLOCK_SIZE], ty[COMPOSE_BLOCK_SIZE], tz[COMPOSE_BLOCK_SIZE];
+        float qi[COMPOSE_BLOCK_SIZE], qj[COMPOSE_BLOCK_SIZE], qk[COMPOSE_BLOCK_SIZE], qr[COMPOSE_BLOCK_SIZE];
+        float sx[COMPOSE_BLOCK_SIZE], sy[COMPOSE_BLOCK_SIZE], sz[COMPOSE_BLOCK_SIZE];
+    };
+}
+
+// Moves instance k of the block by its velocities, over in.velocityTime.
+static inline void _ApplyVelocities(MyInstanceTransforms::Inputs const& in, size_t index, _Block& b, size_t k)
+{
+    const float time = in.velocityTime;
+    if (index < in.numVelocities)
+    {
+        const pxr::GfVec3f& v = in.velocities[index];
+        b.tx[k] += v[0] * time; b.ty[k] += v[1] * time; b.tz[k] += v[2] * time;
+    }
+
+    if (index < in.numAngularVelocities)
+    {
+        const pxr::GfVec3f& w = in.angularVelocities[index];
+        const float length = std::sqrt(w[0] * w[0] + w[1] * w[1] + w[2] * w[2]);
+        if (length > 0.0f)
+        {
+            // the spin applies after the orientation: as quaternions
+            // (Hamilton product), spin * orientation.
+            const float halfAngle = 0.5f * float(pxr::GfDegreesToRadians(length * time));
+            const float s = std::sin(halfAngle) / length;
+            const float ar = std::cos(halfAngle), ai = w[0] * s, aj = w[1] * s, ak = w[2] * s;
+            const float r = b.qr[k], i = b.qi[k], j = b.qj[k], kk = b.qk[k];
+            b.qr[k] = ar * r - ai * i - aj * j - ak * kk;
+            b.qi[k] = ar * i + ai * r + aj * kk - ak * j;
+            b.qj[k] = ar * j - ai * kk + aj * r + ak * i;
+            b.qk[k] = ar * kk + ai * j - aj * i + ak * r;
+        }
+    }
+}
+
+static void _Gather(MyInstanceTransforms::Inputs const& in, size_t begin, size_t n, _Block& b)
+{
+    for (size_t k = 0; k < n; ++k)
+    {
+        // negative indices wrap past every array and end up identity.
+        const size_t index = in.indices ? size_t(in.indices[begin + k]) : begin + k;
+
+        if (index < in.numTranslations)
+        {
+            const pxr::GfVec3f& t = in.translations[index];
+            b.tx[k] = t[0]; b.ty[k] = t[1]; b.tz[k] = t[2];
+        }
+        else
+        {
+            b.tx[k] = 0.0f; b.ty[k] = 0.0f; b.tz[k] = 0.0f;
+        }
+
+        if (index < in.numHalfRotations)
+        {
+            const pxr::GfQuath& q = in.halfRotations[index];
+            b.qi[k] = q.GetImaginary()[0]; b.qj[k] = q.GetImaginary()[1]; b.qk[k] = q.GetImaginary()[2];
+            b.qr[k] = q.GetReal();
+        }
+        else if (index < in.numQuatRotations)
+        {
+            const pxr::GfQuatf& q = in.quatRotations[index];
+            b.qi[k] = q.GetImaginary()[0]; b.qj[k] = q.GetImaginary()[1]; b.qk[k] = q.GetImaginary()[2];
+            b.qr[k] = q.GetReal();
+        }
+        else if (index < in.numFloatRotations)
+        {
+            const pxr::GfVec4f& q = in.floatRotations[index];
+            b.qr[k] = q[0]; b.qi[k] = q[1]; b.qj[k] = q[2]; b.qk[k] = q[3];
+        }
+        else
+        {
+            b.qi[k] = 0.0f; b.qj[k] = 0.0f; b.qk[k] = 0.0f; b.qr[k] = 1.0f;
+        }
+
+        if (in.velocityTime != 0.0f)
+            _ApplyVelocities(in, index, b, k);
+
+        if (index < in.numScales)
+        {
+            const pxr::GfVec3f& s = in.scales[index];
+            b.sx[k] = s[0]; b.sy[k] = s[1]; b.sz[k] = s[2];
+        }
+        else
+        {
+            b.sx[k] = 1.0f; b.sy[k] = 1.0f; b.sz[k] = 1.0f;
+        }
+    }
+}
+
+// scale * rotate * translate * instancer for instance k of the block. The
+// rotation is GfMatrix4d::SetRotate's (row vectors), and scale/translate
+// only touch its rows, so the TRS matrix is built directly and only the
+// product with the instancer is an actual multiply.
+template <typename T>
+static inline void _ComposeScalar(_Block const& b, size_t k, T const (&m)[4][4], T* out)
+{
+    const T i = b.qi[k], j = b.qj[k], q = b.qk[k], r = b.qr[k];
+    const T s[3] = { b.sx[k], b.sy[k], b.sz[k] };
+    const T rot[3][3] = {
+        { T(1) - T(2) * (j * j + q * q), T(2) * (i * j + q * r), T(2) * (q * i - j * r) },
+        { T(2) * (i * j - q * r), T(1) - T(2) * (q * q + i * i), T(2) * (j * q + i * r) },
+        { T(2) * (q * i + j * r), T(2) * (j * q - i * r), T(1) - T(2) * (i * i + j * j) },
+    };
+
+    for (int row = 0; row < 3; ++row)
+    {
+        const T a = s[row] * rot[row][0], c = s[row] * rot[row][1], d = s[row] * rot[row][2];
+        for (int col = 0; col < 4; ++col)
+            out[row * 4 + col] = a * m[0][col] + c * m[1][col] + d * m[2][col];
+    }
+
+    const T tx = b.tx[k], ty = b.ty[k], tz = b.tz[k];
+    for (int col = 0; col < 4; ++col)
+        out[12 + col] = tx * m[0][col] + ty * m[1][col] + tz * m[2][col] + m[3][col];
+}
+
+#if defined(__AVX2__)
+// r[k] = column k of the 8x8 block, i.e. lane k of every register.
+static inline void _Transpose8(__m256 r[8])
+{
+    const __m256 t0 = _mm256_unpacklo_ps(r[0], r[1]);
+    const __m256 t1 = _mm256_unpackhi_ps(r[0], r[1]);
+    const __m256 t2 = _mm256_unpacklo_ps(r[2], r[3]);
+    const __m256 t3 = _mm256_unpackhi_ps(r[2], r[3]);
+    const __m256 t4 = _mm256_unpacklo_ps(r[4], r[5]);
+    const __m256 t5 = _mm256_unpackhi_ps(r[4], r[5]);
+    const __m256 t6 = _mm256_unpacklo_ps(r[6], r[7]);
+    const __m256 t7 = _mm256_unpackhi_ps(r[6], r[7]);
+    const __m256 u0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    const __m256 u1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    const __m256 u2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    const __m256 u3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    const __m256 u4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+    const __m256 u5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+    const __m256 u6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+    const __m256 u7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+    r[0] = _mm256_permute2f128_ps(u0, u4, 0x20);
+    r[1] = _mm256_permute2f128_ps(u1, u5, 0x20);
+    r[2] = _mm256_permute2f128_ps(u2, u6, 0x20);
+    r[3] = _mm256_permute2f128_ps(u3, u7, 0x20);
+    r[4] = _mm256_permute2f128_ps(u0, u4, 0x31);
+    r[5] = _mm256_permute2f128_ps(u1, u5, 0x31);
+    r[6] = _mm256_permute2f128_ps(u2, u6, 0x31);
+    r[7] = _mm256_permute2f128_ps(u3, u7, 0x31);
+}
+#endif
+
+static void _ComposeBlock(_Block const& b, size_t n, float const (&m)[4][4], pxr::GfMatrix4f* out)
+{
+    size_t k = 0;
+
+#if defined(__AVX2__)
+    __m256 mm[4][4];
+    for (int row = 0; row < 4; ++row)
+        for (int col = 0; col < 4; ++col)
+            mm[row][col] = _mm256_set1_ps(m[row][col]);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 two = _mm256_set1_ps(2.0f);
+
+    for (; k + 8 <= n; k += 8)
+    {
+        const __m256 i = _mm256_loadu_ps(b.qi + k);
+        const __m256 j = _mm256_loadu_ps(b.qj + k);
+        const __m256 q = _mm256_loadu_ps(b.qk + k);
+        const __m256 r = _mm256_loadu_ps(b.qr + k);
+        const __m256 sx = _mm256_loadu_ps(b.sx + k);
+        const __m256 sy = _mm256_loadu_ps(b.sy + k);
+        const __m256 sz = _mm256_loadu_ps(b.sz + k);
+
+        const __m256 ii = _mm256_mul_ps(i, i), jj = _mm256_mul_ps(j, j), qq = _mm256_mul_ps(q, q);
+        const __m256 ij = _mm256_mul_ps(i, j), qi = _mm256_mul_ps(q, i), jq = _mm256_mul_ps(j, q);
+        const __m256 qr = _mm256_mul_ps(q, r), jr = _mm256_mul_ps(j, r), ir = _mm256_mul_ps(i, r);
+
+        // rows of scale * rotate
+        __m256 sr[3][3];
+        sr[0][0] = _mm256_mul_ps(sx, _mm256_fnmadd_ps(two, _mm256_add_ps(jj, qq), one));
+        sr[0][1] = _mm256_mul_ps(sx, _mm256_mul_ps(two, _mm256_add_ps(ij, qr)));
+        sr[0][2] = _mm256_mul_ps(sx, _mm256_mul_ps(two, _mm256_sub_ps(qi, jr)));
+        sr[1][0] = _mm256_mul_ps(sy, _mm256_mul_ps(two, _mm256_sub_ps(ij, qr)));
+        sr[1][1] = _mm256_mul_ps(sy, _mm256_fnmadd_ps(two, _mm256_add_ps(qq, ii), one));
+        sr[1][2] = _mm256_mul_ps(sy, _mm256_mul_ps(two, _mm256_add_ps(jq, ir)));
+        sr[2][0] = _mm256_mul_ps(sz, _mm256_mul_ps(two, _mm256_add_ps(qi, jr)));
+        sr[2][1] = _mm256_mul_ps(sz, _mm256_mul_ps(two, _mm256_sub_ps(jq, ir)));
+        sr[2][2] = _mm256_mul_ps(sz, _mm256_fnmadd_ps(two, _mm256_add_ps(ii, jj), one));
+
+        const __m256 tx = _mm256_loadu_ps(b.tx + k);
+        const __m256 ty = _mm256_loadu_ps(b.ty + k);
+        const __m256 tz = _mm256_loadu_ps(b.tz + k);
+
+        // the 16 matrix elements of 8 instances, element major...
+        __m256 e[16];
+        for (int row = 0; row < 3; ++row)
+        {
+            for (int col = 0; col < 4; ++col)
+            {
+                e[row * 4 + col] = _mm256_fmadd_ps(sr[row][0], mm[0][col],
+                    _mm256_fmadd_ps(sr[row][1], mm[1][col], _mm256_mul_ps(sr[row][2], mm[2][col])));
+            }
+        }
+        for (int col = 0; col < 4; ++col)
+        {
+            e[12 + col] = _mm256_fmadd_ps(tx, mm[0][col],
+                _mm256_fmadd_ps(ty, mm[1][col], _mm256_fmadd_ps(tz, mm[2][col], mm[3][col])));
+        }
+
+        // ...turned instance major, first and second half of each matrix.
+        _Transpose8(e);
+        _Transpose8(e + 8);
+        for (int l = 0; l < 8; ++l)
+        {
+            float* dst = out[k + l].data();
+            _mm256_storeu_ps(dst, e[l]);
+            _mm256_storeu_ps(dst + 8, e[8 + l]);
+        }
+    }
+#endif
+
+    for (; k < n; ++k)
+        _ComposeScalar(b, k, m, out[k].data());
+}
+
+static void _ComposeBlock(_Block const& b, size_t n, double const (&m)[4][4], pxr::GfMatrix4d* out)
+{
+    for (size_t k = 0; k < n; ++k)
+        _ComposeScalar(b, k, m, out[k].data());
+}
+
+template <typename Matrix, typename T>
+static void _Compose(MyInstanceTransforms::Inputs const& in, Matrix* o_transforms)
+{
+    T m[4][4];
+    for (int row = 0; row < 4; ++row)
+        for (int col = 0; col < 4; ++col)
+            m[row][col] = T(in.instancerTransform[row][col]);
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, in.count, COMPOSE_GRAIN_SIZE),
+        [&in, &m, o_transforms](tbb::blocked_range<size_t> const& range)
+        {
+            _Block block;
+            for (size_t begin = range.begin(); begin < range.end(); begin += COMPOSE_BLOCK_SIZE)
+            {
+                const size_t n = std::min(COMPOSE_BLOCK_SIZE, range.end() - begin);
+                _Gather(in, begin, n, block);
+                _ComposeBlock(block, n, m, o_transforms + begin);
+
+                // authored instance transforms are rare, they go in front
+                // of the composed matrix.
+                if (in.instanceTransforms)
+                {
+                    for (size_t k = 0; k < n; ++k)
+                    {
+                        const size_t index = in.indices ? size_t(in.indices[begin + k]) : begin + k;
+                        if (index < in.numInstanceTransforms)
+                            o_transforms[begin + k] = Matrix(in.instanceTransforms[index]) * o_transforms[begin + k];
+                    }
+                }
+            }
+        });
+}
+
+/*static*/
+void MyInstanceTransforms::Compose(Inputs const& inputs, pxr::GfMatrix4f* o_transforms)
+{
+    _Compose<pxr::GfMatrix4f, float>(inputs, o_transforms);
+}
+
+/*static*/
+void MyInstanceTransforms::Compose(Inputs const& inputs, pxr::GfMatrix4d* o_transforms)
+{
+    _Compose<pxr::GfMatrix4d, double>(inputs, o_transforms);
+}
@@ -0,0 +1,68 @@
+#ifndef MY_INSTANCE_TRANSFORMS_H
+#define MY_INSTANCE_TRANSFORMS_H
+
+#include <pxr/pxr.h>
+#include <pxr/base/gf/matrix4d.h>
+#include <pxr/base/gf/matrix4f.h>
+#include <pxr/base/gf/quatf.h>
+#include <pxr/base/gf/quath.h>
+#include <pxr/base/gf/vec3f.h>
+#include <pxr/base/gf/vec4f.h>
+
+#include <cstddef>
+
+// One pass replacement for composing instancer transforms primvar by
+// primvar.
+//
+// For every instance index the result is, in Gf (row vector) order:
+//     instanceTransform * scale * rotate * translate * instancerTransform
+// with any missing primvar (or index past its end) taken as identity,
+// exactly like the four GfMatrix4d passes it replaces. Velocities, when
+// given, are applied to the translations and rotations before composing. The instances are
+// split in TBB ranges; each range gathers its translations, quaternions
+// and scales into SoA float blocks and, when built with AVX2, builds the
+// final matrices 8 at a time straight from them.
+class MyInstanceTransforms
+{
+public:
+    struct Inputs
+    {
+        // null to compose elements 0 to count - 1 of the primvars.
+        int const* indices = nullptr;
+        size_t count = 0;
+
+        pxr::GfMatrix4d instancerTransform = pxr::GfMatrix4d(1.0);
+
+        pxr::GfVec3f const* translations = nullptr;
+        size_t numTranslations = 0;
+        // Rotations, whichever the primvar holds. GfQuath and GfQuatf are
+        // imaginary first, GfVec4f real part first.
+        pxr::GfQuath const* halfRotations = nullptr;
+        size_t numHalfRotations = 0;
+        pxr::GfQuatf const* quatRotations = nullptr;
+        size_t numQuatRotations = 0;
+        pxr::GfVec4f const* floatRotations = nullptr;
+        size_t numFloatRotations = 0;
+        pxr::GfVec3f const* scales = nullptr;
+        size_t numScales = 0;
+        pxr::GfMatrix4d const* instanceTransforms = nullptr;
+        size_t numInstanceTransforms = 0;
+
+        // Motion: per second velocities and angular velocities (degrees,
+        // around the vector) moving the translations and rotations by
+        // velocityTime seconds, like UsdGeomPointInstancer does.
+        pxr::GfVec3f const* velocities = nullptr;
+        size_t numVelocities = 0;
+        pxr::GfVec3f const* angularVelocities = nullptr;
+        size_t numAngularVelocities = 0;
+        float velocityTime = 0.0f;
+    };
+
+    // Float matrices, what ends up on the GPU.
+    static void Compose(Inputs const& inputs, pxr::GfMatrix4f* o_transforms);
+
+    // Double matrices, composed in double precision.
+    static void Compose(Inputs const& inputs, pxr::GfMatrix4d* o_transforms);
+};
+
+#endif
@@ -4,39 +4,141 @@
 #include <pxr/base/gf/rotation.h>
 #include <pxr/base/gf/quath.h>
 
-#include <iostream>
+#include <tbb/blocked_range.h>
+#include <tbb/blocked_range2d.h>
+#include <tbb/parallel_for.h>
+
+#include <algorithm>
+#include <chrono>
+
+// instances per TBB task for the loops only moving data around (gathers,
+// diffs), the grain the instance gather always had.
+static const size_t GATHER_GRAIN_SIZE = 4096;
 
 MyInstancer::MyInstancer(pxr::HdSceneDelegate* delegate, pxr::SdfPath const& id, MyRenderDelegate* renderDelegate) :
     pxr::HdInstancer(delegate, id),
+    _version(0),
+    _changedBaseVersion(0),
+    _changedVersion(size_t(-1)),
+    _changedElements(),
+    _pointTransformsVersion(size_t(-1)),
     _owner(renderDelegate)
 {
 }
 
 MyInstancer::~MyInstancer()
 {
-    TF_FOR_ALL(it, _primvarMap)
-    {
-        delete it->second;
-    }
-    _primvarMap.clear();
-
-    std::lock_guard<std::mutex> guard(_owner->rendererMutex());
-    _owner->removeInstancer(GetId());
 }
 
 void MyInstancer::Sync(
     pxr::HdSceneDelegate* delegate, pxr::HdRenderParam* /*renderParam*/, pxr::HdDirtyBits* dirtyBits)
 {
-    std::lock_guard<std::mutex> guard(_owner->rendererMutex());
-    _owner->addInstancerId(GetId());
+    auto start = std::chrono::steady_clock::now();
+
+    // everything the cached transforms of our prototypes depend on, and
+    // what only touches the primvars, which may just patch them.
+    const bool transformsChanged = (*dirtyBits & (pxr::HdChangeTracker::DirtyPrimvar |
+        pxr::HdChangeTracker::DirtyTransform |
+        pxr::HdChangeTracker::DirtyInstanceIndex |
+        pxr::HdChangeTracker::DirtyInstancer)) != 0;
+    const bool allChanged = (*dirtyBits & (pxr::HdChangeTracker::DirtyTransform |
+        pxr::HdChangeTracker::DirtyInstanceIndex |
+        pxr::HdChangeTracker::DirtyInstancer)) != 0;
 
     _UpdateInstancer(delegate, dirtyBits);
-    _SyncPrimvars(dirtyBits);
+    std::vector<uint8_t> changedElements;
+    const bool primvarsDiffed = _SyncPrimvars(dirtyBits, &changedElements);
+
+    if (*dirtyBits & pxr::HdChangeTracker::DirtyTransform)
+    {
+        // over the shutter interval the scene delegate samples with.
+        delegate->SampleInstancerTransform(GetId(), &_sampleXforms);
+    }
+
+    if (transformsChanged)
+    {
+        std::lock_guard<std::mutex> guard(_cacheMutex);
+        if (!allChanged && primvarsDiffed)
+        {
+            // accumulate from the first of consecutive partial versions,
+            // anything cached since then is patched with the union.
+            if (_changedVersion != _version)
+            {
+                _changedBaseVersion = _version;
+                _changedElements.clear();
+            }
+            if (_changedElements.size() < changedElements.size())
+                _changedElements.resize(changedElements.size(), 0);
+            for (size_t i = 0; i < changedElements.size(); ++i)
+                _changedElements[i] |= changedElements[i];
+            _version++;
+            _changedVersion = _version;
+        }
+        else
+        {
+            _version++;
+            _changedVersion = size_t(-1);
+            _changedElements.clear();
+            _cache.clear();
+        }
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    _owner->recordSync(
+        std::chrono::duration_cast<std::chrono::microseconds>(start.time_since_epoch()).count(),
+        std::chrono::duration_cast<std::chrono::microseconds>(end.time_since_epoch()).count());
+}
+
+// Marks in changed the elements that differ between two values of a
+// primvar: -1 when it doesn't hold a VtArray<T>, 0 when the two can't be
+// compared element by element (new primvar, type or size changed).
+template <typename T>
+static int _DiffAs(pxr::VtValue const& before, pxr::VtValue const& after, std::vector<uint8_t>& changed)
+{
+    if (!after.IsHolding<pxr::VtArray<T>>())
+        return -1;
+    if (!before.IsHolding<pxr::VtArray<T>>())
+        return 0;
+
+    pxr::VtArray<T> const& a = before.UncheckedGet<pxr::VtArray<T>>();
+    pxr::VtArray<T> const& b = after.UncheckedGet<pxr::VtArray<T>>();
+    if (a.size() != b.size())
+        return 0;
+    if (a.IsIdentical(b))
+        return 1;
+
+    if (changed.size() < a.size())
+        changed.resize(a.size(), 0);
+    const T* pa = a.cdata();
+    const T* pb = b.cdata();
+    uint8_t* pc = changed.data();
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, a.size(), GATHER_GRAIN_SIZE),
+        [pa, pb, pc](tbb::blocked_range<size_t> const& r)
+        {
+            for (size_t i = r.begin(); i != r.end(); ++i)
+            {
+                if (pa[i] != pb[i])
+                    pc[i] = 1;
+            }
+        });
+    return 1;
+}
 
+static bool _DiffPrimvar(pxr::VtValue const& before, pxr::VtValue const& after, std::vector<uint8_t>& changed)
+{
+    int diffed = -1;
+    if (diffed < 0) diffed = _DiffAs<pxr::GfVec3f>(before, after, changed);
+    if (diffed < 0) diffed = _DiffAs<pxr::GfQuath>(before, after, changed);
+    if (diffed < 0) diffed = _DiffAs<pxr::GfQuatf>(before, after, changed);
+    if (diffed < 0) diffed = _DiffAs<pxr::GfVec4f>(before, after, changed);
+    if (diffed < 0) diffed = _DiffAs<pxr::GfMatrix4d>(before, after, changed);
+    return diffed == 1;
 }
 
-void MyInstancer::_SyncPrimvars(pxr::HdDirtyBits* dirtyBits)
+bool MyInstancer::_SyncPrimvars(pxr::HdDirtyBits* dirtyBits, std::vector<uint8_t>* o_changedElements)
 {
+    bool diffed = true;
+
     pxr::HdSceneDelegate* delegate = GetDelegate();
     const pxr::SdfPath& id = GetId();
 
@@ -56,33 +158,110 @@ void MyInstancer::_SyncPrimvars(pxr::HdDirtyBits* dirtyBits)
 
             if (pxr::HdChangeTracker::IsPrimvarDirty(*dirtyBits, id, pv.name))
             {
+                // kept as is: typed, and sharing the delegate's array.
                 pxr::VtValue value = delegate->Get(id, pv.name);
                 if (!value.IsEmpty())
                 {
-                    if (_primvarMap.count(pv.name) > 0)
+                    // elements of the primvars composing the transforms
+                    // that actually changed, when they can be told apart.
+                    if (pv.name == pxr::HdInstancerTokens->instanceTranslations ||
+                        pv.name == pxr::HdInstancerTokens->instanceRotations ||
+                        pv.name == pxr::HdInstancerTokens->instanceScales ||
+                        pv.name == pxr::HdInstancerTokens->instanceTransforms)
                     {
-                        delete _primvarMap[pv.name];
+                        auto it = _primvarMap.find(pv.name);
+                        if (diffed && it != _primvarMap.end())
+                        {
+                            _owner->runParallel([&]()
+                                {
+                                    diffed = _DiffPrimvar(it->second, value, *o_changedElements);
+                                });
+                        }
+                        else
+                        {
+                            diffed = false;
+                        }
                     }
-                    _primvarMap[pv.name] = new pxr::HdVtBufferSource(pv.name, value);
+                    _primvarMap[pv.name] = std::move(value);
                 }
             }
         }
     }
+    return diffed;
+}
+
+// The transforms taking nesting into account are computed by:
+// parentTransforms = parentInstancer->ComputeInstanceTransforms(GetId())
+// foreach (parentXf : parentTransforms, xf : transforms) {
+//     parentXf * xf
+// }
+// in parallel blocks of parents x children.
+template <typename MatrixArray>
+static MatrixArray _FlattenNested(MyRenderDelegate const* owner,
+    MatrixArray const& transforms, MatrixArray const& parentTransforms)
+{
+    MatrixArray final(parentTransforms.size() * transforms.size());
+
+    const auto* child = transforms.cdata();
+    const auto* parent = parentTransforms.cdata();
+    auto* out = final.data();
+    const size_t childCount = transforms.size();
+    owner->runParallel([&]()
+        {
+            tbb::parallel_for(tbb::blocked_range2d<size_t>(0, parentTransforms.size(), 16, 0, childCount, 1024),
+                [child, parent, out, childCount](tbb::blocked_range2d<size_t> const& r)
+                {
+                    for (size_t i = r.rows().begin(); i != r.rows().end(); ++i)
+                    {
+                        for (size_t j = r.cols().begin(); j != r.cols().end(); ++j)
+                        {
+                            out[i * childCount + j] = child[j] * parent[i];
+                        }
+                    }
+                });
+        });
+    return final;
+}
+
+MyInstancer* MyInstancer::_GetParentInstancer() const
+{
+    if (GetParentId().IsEmpty())
+        return nullptr;
+    return static_cast<MyInstancer*>(GetDelegate()->GetRenderIndex().GetInstancer(GetParentId()));
 }
 
-bool SampleBuffer(pxr::HdVtBufferSource const& buffer, int index, void* value, pxr::HdTupleType dataType)
+// Data and size of a primvar array, left untouched when missing.
+template <typename T>
+static void _Span(pxr::VtArray<T> const* array, T const** o_data, size_t* o_count)
 {
-    if (buffer.GetNumElements() <= (size_t)index || buffer.GetTupleType() != dataType)
+    if (array)
     {
-        return false;
+        *o_data = array->cdata();
+        *o_count = array->size();
     }
+}
 
-    size_t elemSize = pxr::HdDataSizeOfTupleType(dataType);
-    size_t offset = elemSize * index;
-
-    std::memcpy(value, static_cast<const uint8_t*>(buffer.GetData()) + offset, elemSize);
+MyInstanceTransforms::Inputs MyInstancer::_GetComposerInputs(int const* indices, size_t count) const
+{
+    MyInstanceTransforms::Inputs inputs;
+    inputs.indices = indices;
+    inputs.count = count;
 
-    return true;
+    // only take the primvars holding what we expect, anything else is
+    // ignored as before.
+    _Span(_GetPrimvar<pxr::GfVec3f>(pxr::HdInstancerTokens->instanceTranslations),
+        &inputs.translations, &inputs.numTranslations);
+    _Span(_GetPrimvar<pxr::GfQuath>(pxr::HdInstancerTokens->instanceRotations),
+        &inputs.halfRotations, &inputs.numHalfRotations);
+    _Span(_GetPrimvar<pxr::GfQuatf>(pxr::HdInstancerTokens->instanceRotations),
+        &inputs.quatRotations, &inputs.numQuatRotations);
+    _Span(_GetPrimvar<pxr::GfVec4f>(pxr::HdInstancerTokens->instanceRotations),
+        &inputs.floatRotations, &inputs.numFloatRotations);
+    _Span(_GetPrimvar<pxr::GfVec3f>(pxr::HdInstancerTokens->instanceScales),
+        &inputs.scales, &inputs.numScales);
+    _Span(_GetPrimvar<pxr::GfMatrix4d>(pxr::HdInstancerTokens->instanceTransforms),
+        &inputs.instanceTransforms, &inputs.numInstanceTransforms);
+    return inputs;
 }
 
 pxr::VtMatrix4dArray MyInstancer::ComputeInstanceTransforms(pxr::SdfPath const& prototypeId)
@@ -97,114 +276,608 @@ pxr::VtMatrix4dArray MyInstancer::ComputeInstanceTransforms(pxr::SdfPath const&
     pxr::GfMatrix4d instancerTransform = GetDelegate()->GetInstancerTransform(GetId());
     pxr::VtIntArray instanceIndices = GetDelegate()->GetInstanceIndices(GetId(), prototypeId);
 
-    pxr::VtMatrix4dArray transforms(instanceIndices.size());
-    for (size_t i = 0; i < instanceIndices.size(); ++i)
+    pxr::VtMatrix4dArray transforms;
+    if (_owner->useLegacyInstanceTransforms())
     {
-        transforms[i] = instancerTransform;
+        transforms = _ComposeLegacy(instanceIndices, instancerTransform);
+    }
+    else
+    {
+        MyInstanceTransforms::Inputs inputs = _GetComposerInputs(instanceIndices.cdata(), instanceIndices.size());
+        inputs.instancerTransform = instancerTransform;
+        transforms.resize(instanceIndices.size());
+        _owner->runParallel([&inputs, &transforms]()
+            {
+                MyInstanceTransforms::Compose(inputs, transforms.data());
+            });
     }
-    pxr::HdVtBufferSource* pBuffer = nullptr;
 
-    if (_primvarMap.count(pxr::HdInstancerTokens->instanceTranslations) > 0)
-        pBuffer = _primvarMap[pxr::HdInstancerTokens->instanceTranslations];
-    if (pBuffer)
+    MyInstancer* parentInstancer = _GetParentInstancer();
+    if (!parentInstancer)
     {
-        for (size_t i = 0; i < instanceIndices.size(); ++i)
+        return transforms;
+    }
+
+    return _FlattenNested(_owner, transforms, parentInstancer->ComputeInstanceTransforms(GetId()));
+}
+
+pxr::VtMatrix4fArray MyInstancer::_GetPointTransforms()
+{
+    std::lock_guard<std::mutex> pointGuard(_pointMutex);
+
+    size_t version = 0;
+    bool patch = false;
+    {
+        std::lock_guard<std::mutex> guard(_cacheMutex);
+        version = _version;
+        patch = _IsPatchable(_pointTransformsVersion) && !_owner->useLegacyInstanceTransforms();
+    }
+    if (_pointTransformsVersion == version)
+        return _pointTransforms;
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    if (patch)
+    {
+        // recompose only the elements that changed, in place: nobody else
+        // holds on to _pointTransforms between syncs.
+        std::vector<int> elements;
+        for (size_t i = 0; i < _changedElements.size() && i < _pointTransforms.size(); ++i)
         {
-            pxr::GfVec3f translate;
-            if (SampleBuffer(*pBuffer, instanceIndices[i], &translate, { pxr::HdTypeFloatVec3, 1 }))
-            {
-                pxr::GfMatrix4d translateMat(1);
-                translateMat.SetTranslate(pxr::GfVec3d(translate));
-                transforms[i] = translateMat * transforms[i];
-            }
+            if (_changedElements[i])
+                elements.push_back(int(i));
         }
+
+        MyInstanceTransforms::Inputs inputs = _GetComposerInputs(elements.data(), elements.size());
+        inputs.instancerTransform = GetDelegate()->GetInstancerTransform(GetId());
+        std::vector<pxr::GfMatrix4f> patched(elements.size());
+        pxr::GfMatrix4f* points = _pointTransforms.data();
+        _owner->runParallel([&inputs, &patched, &elements, points]()
+            {
+                MyInstanceTransforms::Compose(inputs, patched.data());
+                tbb::parallel_for(tbb::blocked_range<size_t>(0, elements.size(), GATHER_GRAIN_SIZE),
+                    [&patched, &elements, points](tbb::blocked_range<size_t> const& r)
+                    {
+                        for (size_t i = r.begin(); i != r.end(); ++i)
+                            points[elements[i]] = patched[i];
+                    });
+            });
+
+        auto end = std::chrono::high_resolution_clock::now();
+        _owner->addInstanceTransformsTime(
+            std::chrono::duration_cast<std::chrono::microseconds>(end - start).count(), elements.size());
+
+        _pointTransformsVersion = version;
+        return _pointTransforms;
     }
 
-    if (_primvarMap.count(pxr::HdInstancerTokens->instanceRotations) > 0)
-        pBuffer = _primvarMap[pxr::HdInstancerTokens->instanceRotations];
-    if (pBuffer)
-    {
-        for (size_t i = 0; i < instanceIndices.size(); ++i)
+    MyInstanceTransforms::Inputs inputs = _GetComposerInputs(nullptr, 0);
+    inputs.instancerTransform = GetDelegate()->GetInstancerTransform(GetId());
+    inputs.count = std::max({ inputs.numTranslations, inputs.numHalfRotations, inputs.numQuatRotations,
+        inputs.numFloatRotations,
+        inputs.numScales, inputs.numInstanceTransforms });
+
+    pxr::VtMatrix4fArray transforms(inputs.count);
+    // we hold _pointMutex, runParallel keeps this thread from picking up
+    // another prototype's sync that would block on it.
+    _owner->runParallel([this, &inputs, &transforms]()
         {
-            pxr::GfQuath quat;
-            if (SampleBuffer(*pBuffer, instanceIndices[i], &quat, { pxr::HdTypeHalfFloatVec4, 1 }))
+            if (_owner->useLegacyInstanceTransforms())
             {
-                pxr::GfMatrix4d rotateMat(1);
-                rotateMat.SetRotate(quat);
-                transforms[i] = rotateMat * transforms[i];
+                pxr::VtIntArray indices(inputs.count);
+                for (size_t i = 0; i < inputs.count; ++i)
+                    indices[i] = int(i);
+                pxr::VtMatrix4dArray legacy = _ComposeLegacy(indices, inputs.instancerTransform);
+                for (size_t i = 0; i < inputs.count; ++i)
+                    transforms[i] = pxr::GfMatrix4f(legacy[i]);
             }
             else
             {
-                pxr::GfVec4f quatf;
-                if (SampleBuffer(*pBuffer, instanceIndices[i], &quatf, { pxr::HdTypeFloatVec4, 1 }))
-                {
-                    pxr::GfMatrix4d rotateMat(1);
-                    rotateMat.SetRotate(pxr::GfQuatd(quatf[0],quatf[1],quatf[2],quatf[3]));
-                    transforms[i] = rotateMat * transforms[i];
-                }
+                MyInstanceTransforms::Compose(inputs, transforms.data());
             }
+        });
+
+    auto end = std::chrono::high_resolution_clock::now();
+    _owner->addInstanceTransformsTime(
+        std::chrono::duration_cast<std::chrono::microseconds>(end - start).count(), transforms.size());
+
+    _pointTransforms = transforms;
+    _pointTransformsVersion = version;
+    return transforms;
+}
+
+pxr::VtMatrix4fArray MyInstancer::_GetLocalTransforms(pxr::SdfPath const& prototypeId)
+{
+    size_t version = 0;
+    {
+        std::lock_guard<std::mutex> guard(_cacheMutex);
+        version = _version;
+        auto it = _cache.find(prototypeId);
+        if (it != _cache.end() && it->second.version == version)
+        {
+            _owner->addInstanceTransformsLookup(true);
+            return it->second.local;
         }
     }
+    _owner->addInstanceTransformsLookup(false);
+
+    // every element composed once for all prototypes, each one just
+    // gathers its own.
+    pxr::VtIntArray instanceIndices = GetDelegate()->GetInstanceIndices(GetId(), prototypeId);
+    pxr::VtMatrix4fArray pointTransforms = _GetPointTransforms();
+    // what an index past every primvar composes to.
+    const pxr::GfMatrix4f instancerTransform(GetDelegate()->GetInstancerTransform(GetId()));
 
-    if (_primvarMap.count(pxr::HdInstancerTokens->instanceScales) > 0)
-        pBuffer = _primvarMap[pxr::HdInstancerTokens->instanceScales];
-    if (pBuffer)
+    pxr::VtMatrix4fArray transforms(instanceIndices.size());
     {
-        for (size_t i = 0; i < instanceIndices.size(); ++i)
+        const int* indices = instanceIndices.cdata();
+        const pxr::GfMatrix4f* points = pointTransforms.cdata();
+        const size_t numPoints = pointTransforms.size();
+        pxr::GfMatrix4f* out = transforms.data();
+        const size_t count = instanceIndices.size();
+        _owner->runParallel([indices, points, numPoints, out, count, &instancerTransform]()
+            {
+                tbb::parallel_for(tbb::blocked_range<size_t>(0, count, GATHER_GRAIN_SIZE),
+                    [indices, points, numPoints, out, &instancerTransform](tbb::blocked_range<size_t> const& r)
+                    {
+                        for (size_t i = r.begin(); i != r.end(); ++i)
+                        {
+                            const size_t index = size_t(indices[i]);
+                            out[i] = index < numPoints ? points[index] : instancerTransform;
+                        }
+                    });
+            });
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(_cacheMutex);
+        if (_version == version)
+        {
+            _CacheEntry& entry = _cache[prototypeId];
+            entry.version = version;
+            entry.local = transforms;
+        }
+    }
+    return transforms;
+}
+
+pxr::VtMatrix4fArray MyInstancer::ComputeInstanceTransformsFloat(pxr::SdfPath const& prototypeId)
+{
+    MyInstancer* parentInstancer = _GetParentInstancer();
+    if (!parentInstancer)
+        return _GetLocalTransforms(prototypeId);
+
+    // each level keeps its flattened result, a deeper level asking again
+    // (or another prototype of it) doesn't redo the levels above.
+    const size_t parentVersion = parentInstancer->_GetVersion();
+    size_t version = 0;
+    {
+        std::lock_guard<std::mutex> guard(_cacheMutex);
+        version = _version;
+        auto it = _cache.find(prototypeId);
+        if (it != _cache.end() && it->second.flatVersion == version && it->second.flatParentVersion == parentVersion)
+            return it->second.flat;
+    }
+
+    pxr::VtMatrix4fArray transforms = _FlattenNested(_owner, _GetLocalTransforms(prototypeId),
+        parentInstancer->ComputeInstanceTransformsFloat(GetId()));
+
+    {
+        std::lock_guard<std::mutex> guard(_cacheMutex);
+        if (_version == version)
+        {
+            _CacheEntry& entry = _cache[prototypeId];
+            entry.flatVersion = version;
+            entry.flatParentVersion = parentVersion;
+            entry.flat = transforms;
+        }
+    }
+    return transforms;
+}
+
+bool MyInstancer::UpdateInstanceTransformsFloat(pxr::SdfPath const& prototypeId,
+    pxr::VtMatrix4fArray* io_transforms, std::vector<uint32_t>* o_changed)
+{
+    if (_GetParentInstancer())
+    {
+        *io_transforms = ComputeInstanceTransformsFloat(prototypeId);
+        return false;
+    }
+
+    enum { UpToDate, Patch, Recompute } action = Recompute;
+    size_t version = 0;
+    {
+        std::lock_guard<std::mutex> guard(_cacheMutex);
+        version = _version;
+        auto it = _cache.find(prototypeId);
+        if (it != _cache.end() && it->second.local.IsIdentical(*io_transforms))
         {
-            pxr::GfVec3f scale;
-            if (SampleBuffer(*pBuffer, instanceIndices[i], &scale, { pxr::HdTypeFloatVec3, 1 }))
+            if (it->second.version == version)
             {
-                pxr::GfMatrix4d scaleMat(1);
-                scaleMat.SetScale(pxr::GfVec3d(scale));
-                transforms[i] = scaleMat * transforms[i];
+                action = UpToDate;
+            }
+            else if (_IsPatchable(it->second.version) && !_owner->useLegacyInstanceTransforms())
+            {
+                // let go of the cache's reference so io_transforms is
+                // patched in place instead of copied.
+                it->second.local = pxr::VtMatrix4fArray();
+                action = Patch;
             }
         }
     }
+    if (action == UpToDate)
+        return true;
+    if (action == Recompute)
+    {
+        *io_transforms = _GetLocalTransforms(prototypeId);
+        return false;
+    }
 
-    if (_primvarMap.count(pxr::HdInstancerTokens->instanceTransforms) > 0)
-        pBuffer = _primvarMap[pxr::HdInstancerTokens->instanceTransforms];
-    if (pBuffer)
+    // the (patched) point transforms for the elements in the mask, moved
+    // to every instance using one of them.
+    pxr::VtIntArray instanceIndices = GetDelegate()->GetInstanceIndices(GetId(), prototypeId);
+    pxr::VtMatrix4fArray pointTransforms = _GetPointTransforms();
+    if (instanceIndices.size() != io_transforms->size())
     {
-        for (size_t i = 0; i < instanceIndices.size(); ++i)
+        *io_transforms = _GetLocalTransforms(prototypeId);
+        return false;
+    }
+
+    // scanned in fixed chunks, each listing its changed instances, so the
+    // list comes out sorted whatever order the chunks ran in.
+    const int* indices = instanceIndices.cdata();
+    const pxr::GfMatrix4f* points = pointTransforms.cdata();
+    const size_t numPoints = pointTransforms.size();
+    const uint8_t* mask = _changedElements.data();
+    const size_t maskSize = _changedElements.size();
+    pxr::GfMatrix4f* out = io_transforms->data();
+    const size_t count = instanceIndices.size();
+    std::vector<std::vector<uint32_t>> chunks((count + GATHER_GRAIN_SIZE - 1) / GATHER_GRAIN_SIZE);
+    _owner->runParallel([&]()
+        {
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, chunks.size()),
+                [&](tbb::blocked_range<size_t> const& r)
+                {
+                    for (size_t c = r.begin(); c != r.end(); ++c)
+                    {
+                        const size_t end = std::min(count, (c + 1) * GATHER_GRAIN_SIZE);
+                        for (size_t i = c * GATHER_GRAIN_SIZE; i < end; ++i)
+                        {
+                            const size_t index = size_t(indices[i]);
+                            if (index < maskSize && mask[index] && index < numPoints)
+                            {
+                                out[i] = points[index];
+                                chunks[c].push_back(uint32_t(i));
+                            }
+                        }
+                    }
+                });
+        });
+    for (std::vector<uint32_t> const& chunk : chunks)
+        o_changed->insert(o_changed->end(), chunk.begin(), chunk.end());
+    _owner->addInstanceTransformsPatch(o_changed->size());
+
+    {
+        std::lock_guard<std::mutex> guard(_cacheMutex);
+        if (_version == version)
         {
-            pxr::GfMatrix4d instanceTransform;
-            if (SampleBuffer(
-                *pBuffer, instanceIndices[i], &instanceTransform, { pxr::HdTypeDoubleMat4, 1 }))
+            _CacheEntry& entry = _cache[prototypeId];
+            entry.version = version;
+            entry.local = *io_transforms;
+        }
+    }
+    return true;
+}
+
+bool MyInstancer::ComputeInstanceTransformsFactored(pxr::SdfPath const& prototypeId,
+    pxr::VtMatrix4fArray* o_parents, pxr::VtMatrix4fArray* o_children)
+{
+    MyInstancer* parentInstancer = _GetParentInstancer();
+    if (!parentInstancer)
+        return false;
+
+    // no children would read as unfactored parents, let the flat path
+    // return its (empty) result instead.
+    *o_children = _GetLocalTransforms(prototypeId);
+    if (o_children->empty())
+        return false;
+    *o_parents = parentInstancer->ComputeInstanceTransformsFloat(GetId());
+    return true;
+}
+
+pxr::VtVec4fArray MyInstancer::_GetLocalColors(pxr::SdfPath const& prototypeId)
+{
+    size_t version = 0;
+    {
+        std::lock_guard<std::mutex> guard(_cacheMutex);
+        version = _version;
+        auto it = _cache.find(prototypeId);
+        if (it != _cache.end() && it->second.localColorsVersion == version)
+            return it->second.localColors;
+    }
+
+    // gathered through the instance indices.
+    pxr::VtVec4fArray colors;
+    pxr::VtVec3fArray const* displayColors = _GetPrimvar<pxr::GfVec3f>(pxr::HdTokens->displayColor);
+    pxr::VtFloatArray const* displayOpacities = _GetPrimvar<float>(pxr::HdTokens->displayOpacity);
+    if (displayColors || displayOpacities)
+    {
+        pxr::VtIntArray instanceIndices = GetDelegate()->GetInstanceIndices(GetId(), prototypeId);
+        const int* indices = instanceIndices.cdata();
+        const size_t count = instanceIndices.size();
+        colors.resize(count);
+        pxr::GfVec4f* out = colors.data();
+        _owner->runParallel([&]()
             {
-                transforms[i] = instanceTransform * transforms[i];
-            }
+                tbb::parallel_for(tbb::blocked_range<size_t>(0, count, GATHER_GRAIN_SIZE),
+                    [&](tbb::blocked_range<size_t> const& r)
+                    {
+                        for (size_t i = r.begin(); i != r.end(); ++i)
+                        {
+                            const size_t index = size_t(indices[i]);
+                            pxr::GfVec4f& color = out[i];
+                            color = pxr::GfVec4f(1.0f);
+                            if (displayColors && index < displayColors->size())
+                            {
+                                const pxr::GfVec3f& c = (*displayColors)[index];
+                                color = pxr::GfVec4f(c[0], c[1], c[2], 1.0f);
+                            }
+                            if (displayOpacities && index < displayOpacities->size())
+                                color[3] = (*displayOpacities)[index];
+                        }
+                    });
+            });
+    }
+
+    std::lock_guard<std::mutex> guard(_cacheMutex);
+    if (_version == version)
+    {
+        _CacheEntry& entry = _cache[prototypeId];
+        entry.localColorsVersion = version;
+        entry.localColors = colors;
+    }
+    return colors;
+}
+
+void MyInstancer::ComputeInstancePrimvars(pxr::SdfPath const& prototypeId, pxr::VtVec4fArray* o_colors)
+{
+    MyInstancer* parentInstancer = _GetParentInstancer();
+    if (!parentInstancer)
+    {
+        *o_colors = _GetLocalColors(prototypeId);
+        return;
+    }
+
+    const size_t parentVersion = parentInstancer->_GetVersion();
+    size_t version = 0;
+    {
+        std::lock_guard<std::mutex> guard(_cacheMutex);
+        version = _version;
+        auto it = _cache.find(prototypeId);
+        if (it != _cache.end() && it->second.colorsVersion == version
+            && it->second.colorsParentVersion == parentVersion)
+        {
+            *o_colors = it->second.colors;
+            return;
         }
     }
 
-    if (GetParentId().IsEmpty())
+    // flattened like the transforms, instance i * count + j being child j
+    // of parent i: our colors repeat, the parent's ones fill in when we
+    // have none.
+    pxr::VtVec4fArray colors = _GetLocalColors(prototypeId);
+    pxr::VtVec4fArray parentColors;
+    parentInstancer->ComputeInstancePrimvars(GetId(), &parentColors);
+    if (!colors.empty() || !parentColors.empty())
     {
-        return transforms;
+        const size_t parentCount = parentInstancer->ComputeInstanceTransformsFloat(GetId()).size();
+        const size_t count = GetDelegate()->GetInstanceIndices(GetId(), prototypeId).size();
+        pxr::VtVec4fArray flat(parentCount * count);
+        pxr::GfVec4f* out = flat.data();
+        const pxr::GfVec4f* child = colors.empty() ? nullptr : colors.cdata();
+        const pxr::GfVec4f* parents = parentColors.cdata();
+        const size_t numParents = parentColors.size();
+        _owner->runParallel([=]()
+            {
+                tbb::parallel_for(tbb::blocked_range<size_t>(0, parentCount * count, GATHER_GRAIN_SIZE),
+                    [=](tbb::blocked_range<size_t> const& r)
+                    {
+                        for (size_t k = r.begin(); k != r.end(); ++k)
+                        {
+                            if (child)
+                                out[k] = child[k % count];
+                            else
+                                out[k] = k / count < numParents ? parents[k / count] : pxr::GfVec4f(1.0f);
+                        }
+                    });
+            });
+        colors = flat;
     }
 
-    pxr::HdInstancer* parentInstancer = GetDelegate()->GetRenderIndex().GetInstancer(GetParentId());
+    {
+        std::lock_guard<std::mutex> guard(_cacheMutex);
+        if (_version == version)
+        {
+            _CacheEntry& entry = _cache[prototypeId];
+            entry.colorsVersion = version;
+            entry.colorsParentVersion = parentVersion;
+            entry.colors = colors;
+        }
+    }
+    *o_colors = colors;
+}
+
+bool MyInstancer::ComputeInstancePrimvarsFactored(pxr::SdfPath const& prototypeId,
+    pxr::VtVec4fArray* o_parents, pxr::VtVec4fArray* o_children)
+{
+    MyInstancer* parentInstancer = _GetParentInstancer();
     if (!parentInstancer)
+        return false;
+
+    // the parents' colors are only read when we have none.
+    *o_children = _GetLocalColors(prototypeId);
+    if (o_children->empty())
+        parentInstancer->ComputeInstancePrimvars(GetId(), o_parents);
+    else
+        *o_parents = pxr::VtVec4fArray();
+    return true;
+}
+
+bool MyInstancer::_IsMoving() const
+{
+    if (_sampleXforms.count > 1)
+        return true;
+
+    pxr::VtVec3fArray const* velocities = _GetPrimvar<pxr::GfVec3f>(pxr::HdTokens->velocities);
+    pxr::VtVec3fArray const* angularVelocities = _GetPrimvar<pxr::GfVec3f>(pxr::HdTokens->angularVelocities);
+    if ((velocities && !velocities->empty()) || (angularVelocities && !angularVelocities->empty()))
+        return true;
+
+    MyInstancer* parentInstancer = _GetParentInstancer();
+    return parentInstancer && parentInstancer->_IsMoving();
+}
+
+std::vector<pxr::VtMatrix4fArray> MyInstancer::ComputeInstanceTransformsMotion(pxr::SdfPath const& prototypeId,
+    std::vector<float> const& times)
+{
+    if (!_IsMoving())
+        return std::vector<pxr::VtMatrix4fArray>(times.size(), ComputeInstanceTransformsFloat(prototypeId));
+
+    MyInstancer* parentInstancer = _GetParentInstancer();
+    const size_t parentVersion = parentInstancer ? parentInstancer->_GetVersion() : 0;
+    size_t version = 0;
     {
-        return transforms;
+        std::lock_guard<std::mutex> guard(_cacheMutex);
+        version = _version;
+        auto it = _cache.find(prototypeId);
+        if (it != _cache.end() && it->second.motionVersion == version
+            && it->second.motionParentVersion == parentVersion && it->second.motionTimes == times)
+            return it->second.motion;
     }
 
-    std::cout << "PARENT instancer for " << GetId() << " found in " << GetParentId() << std::endl;
+    auto start = std::chrono::high_resolution_clock::now();
 
-    // The transforms taking nesting into account are computed by:
-    // parentTransforms = parentInstancer->ComputeInstanceTransforms(GetId())
-    // foreach (parentXf : parentTransforms, xf : transforms) {
-    //     parentXf * xf
-    // }
-    pxr::VtMatrix4dArray parentTransforms =
-        static_cast<MyInstancer*>(parentInstancer)->ComputeInstanceTransforms(GetId());
+    pxr::VtIntArray instanceIndices = GetDelegate()->GetInstanceIndices(GetId(), prototypeId);
+    const pxr::GfMatrix4d instancerTransform = GetDelegate()->GetInstancerTransform(GetId());
+    const float framesPerSecond = _owner->framesPerSecond();
+
+    // the same inputs at every time, only the instancer transform and how
+    // far the velocities move things change.
+    MyInstanceTransforms::Inputs inputs = _GetComposerInputs(instanceIndices.cdata(), instanceIndices.size());
+    _Span(_GetPrimvar<pxr::GfVec3f>(pxr::HdTokens->velocities), &inputs.velocities, &inputs.numVelocities);
+    _Span(_GetPrimvar<pxr::GfVec3f>(pxr::HdTokens->angularVelocities),
+        &inputs.angularVelocities, &inputs.numAngularVelocities);
+
+    std::vector<pxr::VtMatrix4fArray> parentSamples;
+    if (parentInstancer)
+        parentSamples = parentInstancer->ComputeInstanceTransformsMotion(GetId(), times);
 
-    pxr::VtMatrix4dArray final(parentTransforms.size() * transforms.size());
-    for (size_t i = 0; i < parentTransforms.size(); ++i)
+    std::vector<pxr::VtMatrix4fArray> samples(times.size());
+    for (size_t k = 0; k < times.size(); ++k)
     {
-        for (size_t j = 0; j < transforms.size(); ++j)
+        inputs.instancerTransform = _sampleXforms.count > 0 ? _sampleXforms.Resample(times[k]) : instancerTransform;
+        inputs.velocityTime = times[k] / framesPerSecond;
+
+        pxr::VtMatrix4fArray transforms(instanceIndices.size());
+        _owner->runParallel([&inputs, &transforms]()
+            {
+                MyInstanceTransforms::Compose(inputs, transforms.data());
+            });
+        samples[k] = parentInstancer ? _FlattenNested(_owner, transforms, parentSamples[k]) : transforms;
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    _owner->addInstanceTransformsTime(
+        std::chrono::duration_cast<std::chrono::microseconds>(end - start).count(),
+        instanceIndices.size() * times.size());
+
+    {
+        std::lock_guard<std::mutex> guard(_cacheMutex);
+        if (_version == version)
         {
-            final[i * transforms.size() + j] = transforms[j] * parentTransforms[i];
+            _CacheEntry& entry = _cache[prototypeId];
+            entry.motionVersion = version;
+            entry.motionParentVersion = parentVersion;
+            entry.motionTimes = times;
+            entry.motion = samples;
         }
     }
-    return final;
-}
\ No newline at end of file
+    return samples;
+}
+
+pxr::VtMatrix4dArray MyInstancer::_ComposeLegacy(pxr::VtIntArray const& instanceIndices,
+    pxr::GfMatrix4d const& instancerTransform)
+{
+    pxr::VtMatrix4dArray transforms(instanceIndices.size());
+    for (size_t i = 0; i < instanceIndices.size(); ++i)
+    {
+        transforms[i] = instancerTransform;
+    }
+
+    // an index past the end of a primvar leaves that transform out.
+    auto sample = [](auto const* array, int index) -> decltype(array->cdata())
+    {
+        if (!array || index < 0 || size_t(index) >= array->size())
+            return nullptr;
+        return array->cdata() + index;
+    };
+
+    if (auto const* translations = _GetPrimvar<pxr::GfVec3f>(pxr::HdInstancerTokens->instanceTranslations))
+    {
+        for (size_t i = 0; i < instanceIndices.size(); ++i)
+        {
+            if (pxr::GfVec3f const* translate = sample(translations, instanceIndices[i]))
+            {
+                pxr::GfMatrix4d translateMat(1);
+                translateMat.SetTranslate(pxr::GfVec3d(*translate));
+                transforms[i] = translateMat * transforms[i];
+            }
+        }
+    }
+
+    auto const* halfRotations = _GetPrimvar<pxr::GfQuath>(pxr::HdInstancerTokens->instanceRotations);
+    auto const* quatRotations = _GetPrimvar<pxr::GfQuatf>(pxr::HdInstancerTokens->instanceRotations);
+    auto const* floatRotations = _GetPrimvar<pxr::GfVec4f>(pxr::HdInstancerTokens->instanceRotations);
+    if (halfRotations || quatRotations || floatRotations)
+    {
+        for (size_t i = 0; i < instanceIndices.size(); ++i)
+        {
+            pxr::GfMatrix4d rotateMat(1);
+            if (pxr::GfQuath const* quat = sample(halfRotations, instanceIndices[i]))
+                rotateMat.SetRotate(*quat);
+            else if (pxr::GfQuatf const* quatf = sample(quatRotations, instanceIndices[i]))
+                rotateMat.SetRotate(pxr::GfQuatd(*quatf));
+            else if (pxr::GfVec4f const* vec = sample(floatRotations, instanceIndices[i]))
+                rotateMat.SetRotate(pxr::GfQuatd((*vec)[0], (*vec)[1], (*vec)[2], (*vec)[3]));
+            else
+                continue;
+            transforms[i] = rotateMat * transforms[i];
+        }
+    }
+
+    if (auto const* scales = _GetPrimvar<pxr::GfVec3f>(pxr::HdInstancerTokens->instanceScales))
+    {
+        for (size_t i = 0; i < instanceIndices.size(); ++i)
+        {
+            if (pxr::GfVec3f const* scale = sample(scales, instanceIndices[i]))
+            {
+                pxr::GfMatrix4d scaleMat(1);
+                scaleMat.SetScale(pxr::GfVec3d(*scale));
+                transforms[i] = scaleMat * transforms[i];
+            }
+        }
+    }
+
+    if (auto const* instanceTransforms = _GetPrimvar<pxr::GfMatrix4d>(pxr::HdInstancerTokens->instanceTransforms))
+    {
+        for (size_t i = 0; i < instanceIndices.size(); ++i)
+        {
+            if (pxr::GfMatrix4d const* instanceTransform = sample(instanceTransforms, instanceIndices[i]))
+            {
+                transforms[i] = *instanceTransform * transforms[i];
+            }
+        }
+    }
+
+    return transforms;
+}
@@ -7,11 +7,21 @@
 #include <pxr/pxr.h>
 #include <pxr/base/gf/half.h>
 #include <pxr/base/gf/matrix4f.h>
+#include <pxr/base/gf/matrix4d.h>
 #include <pxr/base/gf/quatd.h>
+#include <pxr/base/gf/quatf.h>
+#include <pxr/base/gf/quath.h>
 #include <pxr/base/gf/vec2f.h>
 #include <pxr/base/gf/vec3f.h>
 #include <pxr/base/gf/vec4f.h>
-#include <pxr/imaging/hd/vtBufferSource.h>
+#include <pxr/base/vt/array.h>
+#include <pxr/base/vt/value.h>
+
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "instanceTransforms.h"
 
 class MyRenderDelegate;
 
@@ -25,12 +35,140 @@ public:
 
     pxr::VtMatrix4dArray ComputeInstanceTransforms(pxr::SdfPath const& prototypeId);
 
+    // Same, as float matrices ready for the GPU, and cached per prototype
+    // until the instancer primvars, transform, indices or parent change.
+    pxr::VtMatrix4fArray ComputeInstanceTransformsFloat(pxr::SdfPath const& prototypeId);
+
+    // For nested instancers, the same result kept factored: instance
+    // i * children.size() + j is children[j] * parents[i]. The parents are
+    // the (cached) flattened transforms of every level above, children this
+    // level's own, so the product is never materialized. False without a
+    // parent instancer or without instances of this level.
+    bool ComputeInstanceTransformsFactored(pxr::SdfPath const& prototypeId,
+        pxr::VtMatrix4fArray* o_parents, pxr::VtMatrix4fArray* o_children);
+
+    // Brings io_transforms, this prototype's result of a previous
+    // ComputeInstanceTransformsFloat, up to date. When only a few primvar
+    // elements changed since, the instances using them are patched in
+    // place (their positions added to o_changed) and true is returned;
+    // otherwise io_transforms is recomputed and false returned. For the
+    // patch to be free of copies, the caller must hold the only other
+    // reference to the array.
+    bool UpdateInstanceTransformsFloat(pxr::SdfPath const& prototypeId,
+        pxr::VtMatrix4fArray* io_transforms, std::vector<uint32_t>* o_changed);
+
+    // Per-instance displayColor of a prototype, with displayOpacity in
+    // alpha, in the order of ComputeInstanceTransformsFloat. Nested levels
+    // take the innermost level holding either. Empty when no level has
+    // them. Cached per prototype like the transforms.
+    void ComputeInstancePrimvars(pxr::SdfPath const& prototypeId, pxr::VtVec4fArray* o_colors);
+
+    // The same, factored like ComputeInstanceTransformsFactored: parents
+    // holds the flattened colors of the levels above, one per parent, and
+    // children this level's own, which win when not empty. False where
+    // the transforms can't be factored.
+    bool ComputeInstancePrimvarsFactored(pxr::SdfPath const& prototypeId,
+        pxr::VtVec4fArray* o_parents, pxr::VtVec4fArray* o_children);
+
+    // Flattened float transforms at each of times (frames, relative to the
+    // current one), for motion blur: the instancer transform is resampled
+    // and the velocities / angularVelocities primvars applied at each time.
+    // Every sample is the static result when nothing up the chain moves.
+    std::vector<pxr::VtMatrix4fArray> ComputeInstanceTransformsMotion(pxr::SdfPath const& prototypeId,
+        std::vector<float> const& times);
+
 private:
-    void _SyncPrimvars(pxr::HdDirtyBits* dirtyBits);
+    // Fills o_changedElements with the elements of the transform primvars
+    // that changed, false when that can't be told (see _changedElements).
+    bool _SyncPrimvars(pxr::HdDirtyBits* dirtyBits, std::vector<uint8_t>* o_changedElements);
+
+    // Whether what was cached at version can be brought to the current
+    // one by recomposing the _changedElements only. Call with _cacheMutex
+    // held.
+    bool _IsPatchable(size_t version) const
+    {
+        return _changedVersion == _version && version >= _changedBaseVersion && version < _version;
+    }
+
+    // Composer inputs from the synced primvars, for the given indices or
+    // for every element when null.
+    MyInstanceTransforms::Inputs _GetComposerInputs(int const* indices, size_t count) const;
+
+    // Transforms of every element of the instancer primvars, composed once
+    // per version and shared by all prototypes.
+    pxr::VtMatrix4fArray _GetPointTransforms();
+
+    // This level's transforms for a prototype, without the parents.
+    pxr::VtMatrix4fArray _GetLocalTransforms(pxr::SdfPath const& prototypeId);
+    // ...and its colors.
+    pxr::VtVec4fArray _GetLocalColors(pxr::SdfPath const& prototypeId);
+
+    MyInstancer* _GetParentInstancer() const;
+
+    // Whether this level or a parent has transform samples or velocities.
+    bool _IsMoving() const;
+
+    size_t _GetVersion()
+    {
+        std::lock_guard<std::mutex> guard(_cacheMutex);
+        return _version;
+    }
+
+    // The original primvar by primvar composition, kept to compare against
+    // MyInstanceTransforms (see MyRenderSettingsTokens->legacyInstanceTransforms).
+    pxr::VtMatrix4dArray _ComposeLegacy(pxr::VtIntArray const& instanceIndices,
+        pxr::GfMatrix4d const& instancerTransform);
+
+    // instancer transform across the shutter, sampled by Sync.
+    pxr::HdTimeSampleArray< pxr::GfMatrix4d, 16 > _sampleXforms;
+
+    // The instance primvars as the scene delegate returned them, the
+    // values share its arrays. Null unless name holds a VtArray<T>.
+    template <typename T>
+    pxr::VtArray<T> const* _GetPrimvar(pxr::TfToken const& name) const
+    {
+        auto it = _primvarMap.find(name);
+        if (it == _primvarMap.end() || !it->second.IsHolding<pxr::VtArray<T>>())
+            return nullptr;
+        return &it->second.UncheckedGet<pxr::VtArray<T>>();
+    }
 
-    pxr::HdTimeSampleArray< pxr::VtMatrix4dArray, 16 > _sampleXforms;
+    pxr::TfHashMap<pxr::TfToken, pxr::VtValue, pxr::TfToken::HashFunctor> _primvarMap;
 
-    pxr::TfHashMap<pxr::TfToken, pxr::HdVtBufferSource*, pxr::TfToken::HashFunctor> _primvarMap;
+    // Bumped by Sync whenever something the transforms depend on changes.
+    size_t _version;
+    // When the versions from _changedBaseVersion to _changedVersion (the
+    // current one) only changed some primvar elements: a mask, over the
+    // primvar elements, of those that did.
+    size_t _changedBaseVersion;
+    size_t _changedVersion;
+    std::vector<uint8_t> _changedElements;
+    std::mutex _cacheMutex;
+    // held while composing _pointTransforms, the other prototypes wait for
+    // it rather than composing the same thing.
+    std::mutex _pointMutex;
+    pxr::VtMatrix4fArray _pointTransforms;
+    size_t _pointTransformsVersion;
+    // Per prototype, this level alone and flattened with every parent
+    // level, each valid for the versions it was built with.
+    struct _CacheEntry
+    {
+        size_t version = size_t(-1);
+        pxr::VtMatrix4fArray local;
+        size_t flatVersion = size_t(-1);
+        size_t flatParentVersion = size_t(-1);
+        pxr::VtMatrix4fArray flat;
+        size_t motionVersion = size_t(-1);
+        size_t motionParentVersion = size_t(-1);
+        std::vector<float> motionTimes;
+        std::vector<pxr::VtMatrix4fArray> motion;
+        size_t localColorsVersion = size_t(-1);
+        pxr::VtVec4fArray localColors;
+        size_t colorsVersion = size_t(-1);
+        size_t colorsParentVersion = size_t(-1);
+        pxr::VtVec4fArray colors;
+    };
+    std::unordered_map<pxr::SdfPath, _CacheEntry, pxr::SdfPath::Hash> _cache;
 
     MyRenderDelegate* _owner;
 
@@ -2,6 +2,8 @@
 #include "renderDelegate.h"
 #include "renderPass.h"
 #include "instancer.h"
+#include "normals.h"
+#include "frustum.h"
 #include <pxr/imaging/hd/extComputationUtils.h>
 #include <pxr/imaging/hd/material.h>
 #include <pxr/imaging/hd/vertexAdjacency.h>
@@ -14,27 +16,31 @@
 #include <pxr/usd/usdUtils/pipeline.h>
 
 #include <algorithm> // sort
+#include <chrono>
 
 #include <gl/GL.h>
 
 
 MyMesh::MyMesh(const pxr::SdfPath& id, MyRenderDelegate* delegate)
     : pxr::HdMesh(id)
-    , _adjacencyValid(false)
-    , _normalsValid(false)
+    , _instances()
+    , _extent()
+    , _worldBounds()
     , _refined(false)
     , _smoothNormals(false)
-    , _dataSharingId()
+    , _geometry()
+    , _topologyHash(0)
+    , _pointsHash(0)
+    , _colorsHash(0)
     , _owner(delegate)
 {
 }
 
 MyMesh::~MyMesh()
 {
-    std::lock_guard<std::mutex> guard(_owner->rendererMutex());
-    _owner->removeMesh(GetId());
-    _owner->removeDataSharingId(_dataSharingId);
-    _instancerTransforms.clear();
+    // last user of the geometry releases it and its GL buffers.
+    _geometry.reset();
+    _instances.reset();
 }
 
 void
@@ -72,10 +78,17 @@ MyMesh::Sync(pxr::HdSceneDelegate* sceneDelegate,
     pxr::HdDirtyBits* dirtyBits,
     pxr::TfToken const& reprToken)
 {
+    auto start = std::chrono::steady_clock::now();
+
     _MeshReprConfig::DescArray descs = _GetReprDesc(reprToken);
     const pxr::HdMeshReprDesc& desc = descs[0];
 
     _PopulateMesh(sceneDelegate, dirtyBits, desc);
+
+    auto end = std::chrono::steady_clock::now();
+    _owner->recordSync(
+        std::chrono::duration_cast<std::chrono::microseconds>(start.time_since_epoch()).count(),
+        std::chrono::duration_cast<std::chrono::microseconds>(end.time_since_epoch()).count());
 }
 
 void
@@ -85,20 +98,43 @@ MyMesh::_PopulateMesh(pxr::HdSceneDelegate* sceneDelegate,
 {
     const pxr::SdfPath& id = GetId();
 
+    // what the draw item was made of, to tell a new item from a moved one.
+    const bool wasDrawn = _IsDrawn();
+    const MyGeometry* previousGeometry = _geometry.get();
+    const MyInstanceBuffer* previousInstances = _instances.get();
+
     // Synchronize instancer.
     _UpdateInstancer(sceneDelegate, dirtyBits);
     pxr::HdInstancer::_SyncInstancerAndParents(sceneDelegate->GetRenderIndex(), GetInstancerId());
 
 
+    // start from what the current geometry has, so a partial update only
+    // replaces the dirty primvars.
+    pxr::VtVec3fArray points;
+    pxr::VtVec3fArray displayColors;
+    if (_geometry)
+    {
+        std::lock_guard<std::mutex> guard(_geometry->buildMutex);
+        points = _geometry->points;
+        displayColors = _geometry->displayColors;
+    }
+    bool primvarsChanged = false;
+    bool pointsChanged = false;
+    bool colorsChanged = false;
+    bool topologyChanged = false;
+
     if (pxr::HdChangeTracker::IsPrimvarDirty(*dirtyBits, id, pxr::HdTokens->points)) {
         pxr::VtValue value = sceneDelegate->Get(id, pxr::HdTokens->points);
-        _points = value.Get<pxr::VtVec3fArray>();
-        _normalsValid = false;
+        points = value.Get<pxr::VtVec3fArray>();
+        primvarsChanged = true;
+        pointsChanged = true;
     }
 
     if (pxr::HdChangeTracker::IsPrimvarDirty(*dirtyBits, id, pxr::HdTokens->displayColor)) {
         pxr::VtValue value = sceneDelegate->Get(id, pxr::HdTokens->displayColor);
-        _displayColors = value.Get<pxr::VtVec3fArray>();
+        displayColors = value.Get<pxr::VtVec3fArray>();
+        primvarsChanged = true;
+        colorsChanged = true;
     }
 
     if (pxr::HdChangeTracker::IsTopologyDirty(*dirtyBits, id)) {
@@ -106,16 +142,18 @@ MyMesh::_PopulateMesh(pxr::HdSceneDelegate* sceneDelegate,
         int refineLevel = _topology.GetRefineLevel();
         _topology = pxr::HdMeshTopology(GetMeshTopology(sceneDelegate), refineLevel);
         _topology.SetSubdivTags(subdivTags);
-        _adjacencyValid = false;
+        topologyChanged = true;
     }
     if (pxr::HdChangeTracker::IsSubdivTagsDirty(*dirtyBits, id) &&
         _topology.GetRefineLevel() > 0) {
         _topology.SetSubdivTags(sceneDelegate->GetSubdivTags(id));
+        topologyChanged = true;
     }
     if (pxr::HdChangeTracker::IsDisplayStyleDirty(*dirtyBits, id)) {
         pxr::HdDisplayStyle const displayStyle = sceneDelegate->GetDisplayStyle(id);
         _topology = pxr::HdMeshTopology(_topology,
             displayStyle.refineLevel);
+        topologyChanged = true;
     }
 
     if (pxr::HdChangeTracker::IsVisibilityDirty(*dirtyBits, id)) {
@@ -152,102 +190,269 @@ MyMesh::_PopulateMesh(pxr::HdSceneDelegate* sceneDelegate,
         // Destroy the old mesh, if it exists.
 
         _refined = doRefine;
-
-        // Force the smooth normals code to rebuild the "normals" primvar the
-        // next time smooth normals is enabled.
-        _normalsValid = false;
     }
 
  
-    // Add mesh to our delegate
-    if (newMesh || pxr::HdChangeTracker::IsPrimvarDirty(*dirtyBits, id, pxr::HdTokens->points))
+    topologyChanged = topologyChanged || newMesh;
+    if (topologyChanged || primvarsChanged || !_geometry)
     {
-        _topology = sceneDelegate->GetMeshTopology(id);
-        pxr::HdMeshUtil meshUtil(&_topology, id);
-        pxr::VtIntArray trianglePrimitiveParams;
-        meshUtil.ComputeTriangleIndices(&_triangulatedIndices, &trianglePrimitiveParams);
+        MyGeometryKey key;
+#if PXR_VERSION >= 2302
+        key.dataSharingId = sceneDelegate->GetDataSharingId(id);
+#endif
+        if (key.dataSharingId.IsEmpty())
+        {
+            // the hashes are left over from the previous key when it was
+            // one, only what is dirty is hashed again.
+            const bool rehash = !_geometry || !_geometry->key.dataSharingId.IsEmpty();
+            if (rehash || topologyChanged)
+                _topologyHash = _topology.ComputeHash();
+            if (rehash || pointsChanged)
+                _pointsHash = MyGeometry::HashArray(points);
+            if (rehash || colorsChanged)
+                _colorsHash = MyGeometry::HashArray(displayColors);
+            key.hash = MyGeometry::CombineHashes(_topologyHash, _pointsHash, _colorsHash);
+            key.topology = _topology;
+            key.points = points;
+            key.displayColors = displayColors;
+        }
 
-        // Get normals (smooth them for now)
-        //
-        pxr::Hd_VertexAdjacency _adjacency;
-        _adjacency.BuildAdjacencyTable(&_topology);
-        _computedNormals = pxr::Hd_SmoothNormals::ComputeSmoothNormals(&_adjacency, _points.size(), _points.cdata());
+        // Either somebody already built this geometry, or we get one to
+        // build: our current one when nobody else uses it (so a deforming
+        // mesh keeps its buffers, triangulation and adjacency) or a new one.
+        bool needsBuild = false;
+        _geometry = _owner->acquireGeometry(key, _geometry, &needsBuild);
+
+        // a data sharing id doesn't change when the data (or the topology)
+        // does, every sharer sees the edit and the first one to get here
+        // rebuilds it for all.
+        needsBuild = needsBuild || ((primvarsChanged || topologyChanged) && !key.dataSharingId.IsEmpty());
+        if (needsBuild)
+        {
+            std::lock_guard<std::mutex> guard(_geometry->buildMutex);
+            if (_geometry->buildEpoch != _owner->syncEpoch())
+            {
+                _BuildGeometry(*_geometry, points, displayColors);
+                _geometry->buildEpoch = _owner->syncEpoch();
+            }
+        }
 
-        std::lock_guard<std::mutex> guard(_owner->rendererMutex());
-        _owner->addMesh(id, this);
+        // prototypes also get the coarse triangles their far instances are
+        // drawn with, whoever built the geometry.
+        if (!GetInstancerId().IsEmpty())
+        {
+            std::lock_guard<std::mutex> guard(_geometry->buildMutex);
+            if (_geometry->decimatedEpoch != _geometry->buildEpoch)
+            {
+                _geometry->buildDecimated();
+                _geometry->decimatedEpoch = _geometry->buildEpoch;
+                _geometry->gpuDirtyBits |= MyGeometry::GpuDirtyIndices;
+            }
+        }
+    }
 
-#if 0
-        _dataSharingId = sceneDelegate->GetDataSharingId(GetId());
-#endif
-        _owner->addDataSharingId(_dataSharingId);
-        
+    if (pxr::HdChangeTracker::IsExtentDirty(*dirtyBits, id))
+    {
+        // authored extent, empty when there is none.
+        _extent = pxr::GfRange3f(sceneDelegate->GetExtent(id));
     }
 
     if (pxr::HdChangeTracker::IsTransformDirty(*dirtyBits, id))
     {
         // sample transform...
         _transform = pxr::GfMatrix4f(sceneDelegate->GetTransform(id));
+    }
 
-        // ...and instancers
-        if (!GetInstancerId().IsEmpty())
+    // ...and instancers
+    bool instancesPatched = false;
+    if (pxr::HdChangeTracker::IsTransformDirty(*dirtyBits, id) ||
+        pxr::HdChangeTracker::IsInstancerDirty(*dirtyBits, id) ||
+        pxr::HdChangeTracker::IsInstanceIndexDirty(*dirtyBits, id))
+    {
+        pxr::HdInstancer* instancer = GetInstancerId().IsEmpty() ? nullptr :
+            sceneDelegate->GetRenderIndex().GetInstancer(GetInstancerId());
+        if (instancer)
         {
             // retrieve instance transforms from the instancer.
-            pxr::HdInstancer* instancer = sceneDelegate->GetRenderIndex().GetInstancer(GetInstancerId());
-            _instancerTransforms = static_cast<MyInstancer*>(instancer)->ComputeInstanceTransforms(GetId());
+            if (!_instances)
+                _instances = std::make_shared<MyInstanceBuffer>(_owner);
+            MyInstancer* myInstancer = static_cast<MyInstancer*>(instancer);
+            pxr::VtMatrix4fArray parents, children;
+            std::vector<uint32_t> changedInstances;
+            if (_owner->motionSampleTimes().empty() && !_owner->useFactoredNestedInstances()
+                && _instances->patchable())
+            {
+                // patched in place when only a few instances moved.
+                if (myInstancer->UpdateInstanceTransformsFloat(GetId(), &_instances->transforms, &changedInstances))
+                {
+                    _instances->markTransformsPatched(changedInstances);
+                    instancesPatched = true;
+                }
+                else
+                {
+                    _instances->markTransformsReplaced();
+                }
+            }
+            else if (!_owner->motionSampleTimes().empty())
+                _instances->setMotionTransforms(
+                    myInstancer->ComputeInstanceTransformsMotion(GetId(), _owner->motionSampleTimes()));
+            else if (_owner->useFactoredNestedInstances()
+                && myInstancer->ComputeInstanceTransformsFactored(GetId(), &parents, &children))
+                _instances->setTransforms(parents, children);
+            else
+                _instances->setTransforms(myInstancer->ComputeInstanceTransformsFloat(GetId()));
+
+            // ...and their colors, factored the same way or flattened in
+            // the same order.
+            pxr::VtVec4fArray instanceColors, childColors;
+            if (!_instances->factored()
+                || !myInstancer->ComputeInstancePrimvarsFactored(GetId(), &instanceColors, &childColors))
+                myInstancer->ComputeInstancePrimvars(GetId(), &instanceColors);
+            _instances->setPrimvars(instanceColors, childColors);
+        }
+        else
+        {
+            _instances.reset();
+        }
+    }
+
+    // world bounds for culling, of the mesh or of each of its instances.
+    if (pxr::HdChangeTracker::IsExtentDirty(*dirtyBits, id) ||
+        pxr::HdChangeTracker::IsTransformDirty(*dirtyBits, id) ||
+        pxr::HdChangeTracker::IsInstancerDirty(*dirtyBits, id) ||
+        pxr::HdChangeTracker::IsInstanceIndexDirty(*dirtyBits, id) ||
+        newMesh || primvarsChanged)
+    {
+        pxr::GfRange3f localBounds = _extent;
+        if (localBounds.IsEmpty() && _geometry)
+        {
+            std::lock_guard<std::mutex> guard(_geometry->buildMutex);
+            localBounds = _geometry->bounds;
+        }
+
+        if (_instances)
+        {
+            // only the patched instances moved when nothing else changed.
+            const bool patchedOnly = instancesPatched &&
+                !pxr::HdChangeTracker::IsExtentDirty(*dirtyBits, id) &&
+                !pxr::HdChangeTracker::IsTransformDirty(*dirtyBits, id) &&
+                !newMesh && !primvarsChanged;
+            _owner->runParallel([this, &localBounds, patchedOnly]()
+                {
+                    _instances->updateBounds(localBounds, _transform, patchedOnly);
+                });
+            _worldBounds = _instances->worldBounds;
+        }
+        else
+        {
+            _worldBounds = MyTransformBounds(localBounds, _transform);
         }
     }
 
+    // Another item (or none) recompiles the draw list and rebuilds the
+    // BVH. The same one moved or deformed (deforming meshes, animated
+    // instancers) is only copied again and the BVH refitted, the refresh
+    // checks state bits and instance counts and recompiles if they changed.
+    if (newMesh || _IsDrawn() != wasDrawn || _geometry.get() != previousGeometry ||
+        _instances.get() != previousInstances)
+    {
+        _owner->markSceneChanged();
+    }
+    else if (primvarsChanged ||
+        pxr::HdChangeTracker::IsExtentDirty(*dirtyBits, id) ||
+        pxr::HdChangeTracker::IsTransformDirty(*dirtyBits, id) ||
+        pxr::HdChangeTracker::IsInstancerDirty(*dirtyBits, id) ||
+        pxr::HdChangeTracker::IsInstanceIndexDirty(*dirtyBits, id))
+    {
+        _owner->markDrawItemsChanged();
+    }
 
     // Clean all dirty bits.
     *dirtyBits &= ~pxr::HdChangeTracker::AllSceneDirtyBits;
 }
 
-void MyMesh::drawGL()
+void MyMesh::_BuildGeometry(MyGeometry& geometry,
+    pxr::VtVec3fArray const& points,
+    pxr::VtVec3fArray const& displayColors)
 {
-    glPushMatrix();
-    
-    // constant color for the whole mesh
-    glColor3f(0.18f, 0.18f, 0.18f);
-    if (_displayColors.size() == 1)
+    geometry.points = points;
+    geometry.displayColors = displayColors;
+    geometry.gpuDirtyBits |= MyGeometry::GpuDirtyPoints | MyGeometry::GpuDirtyColors;
+
+    geometry.bounds = pxr::GfRange3f();
+    for (const pxr::GfVec3f& p : points)
+        geometry.bounds.UnionWith(p);
+
+    // Topology changes are the only thing requiring a new triangulation
+    // and a new adjacency table. When only the points are dirty (deforming
+    // meshes, sim caches) both are kept from the last topology sync and we
+    // just recompute normals and re-upload positions.
+    const pxr::HdTopology::ID topologyHash = _topology.ComputeHash();
+    if (!geometry.adjacency || geometry.topologyHash != topologyHash)
     {
-        auto& c = _displayColors[0];
-        glColor4f(c.data()[0],c.data()[1],c.data()[2],1.0f);
+        pxr::HdMeshUtil meshUtil(&_topology, GetId());
+        pxr::VtIntArray trianglePrimitiveParams;
+        meshUtil.ComputeTriangleIndices(&geometry.triangulatedIndices, &trianglePrimitiveParams);
+        geometry.triangleFaces.resize(trianglePrimitiveParams.size());
+        for (size_t i = 0; i < trianglePrimitiveParams.size(); ++i)
+            geometry.triangleFaces[i] = pxr::HdMeshUtil::DecodeFaceIndexFromCoarseFaceParam(trianglePrimitiveParams[i]);
+        geometry.adjacency = _owner->acquireAdjacency(_topology);
+        geometry.topologyHash = topologyHash;
+        geometry.gpuDirtyBits |= MyGeometry::GpuDirtyIndices;
     }
 
-    size_t instances = pxr::GfMax(size_t(1), _instancerTransforms.size());
+    // Get normals (smooth them for now)
+    //
+    auto start = std::chrono::high_resolution_clock::now();
+    _owner->runParallel([this, &geometry, &points]()
+        {
+            if (_owner->useHdSmoothNormals())
+                geometry.normals = pxr::Hd_SmoothNormals::ComputeSmoothNormals(geometry.adjacency.get(), points.size(), points.cdata());
+            else
+                geometry.normals = MySmoothNormals::ComputeSmoothNormals(geometry.adjacency.get(), points.size(), points.cdata());
+        });
+    auto end = std::chrono::high_resolution_clock::now();
+    _owner->addNormalsTime(std::chrono::duration_cast<std::chrono::microseconds>(end - start).count());
+    geometry.gpuDirtyBits |= MyGeometry::GpuDirtyNormals;
+}
+
+bool MyMesh::_IsDrawn() const
+{
+    // a prototype nothing instances isn't either.
+    if (!IsVisible() || !_geometry || (_instances && _instances->size() == 0))
+        return false;
+    std::lock_guard<std::mutex> guard(_geometry->buildMutex);
+    return !_geometry->points.empty() && !_geometry->triangulatedIndices.empty();
+}
+
+bool MyMesh::getDrawItem(MyDrawItem* o_item) const
+{
+    if (!_IsDrawn())
+        return false;
+
+    const MyGeometry& geometry = *_geometry;
 
-    for (size_t pi = 0; pi < instances; ++pi)
+    o_item->geometry = _geometry.get();
+    o_item->transform = _transform;
+    o_item->instances = _instances;
+    o_item->bounds = _worldBounds;
+    o_item->primId = GetPrimId();
+
+    // constant color for the whole mesh
+    o_item->color = pxr::GfVec4f(0.18f, 0.18f, 0.18f, 1.0f);
+    if (geometry.displayColors.size() == 1)
     {
-        glPushMatrix();
-        if (_instancerTransforms.size() > 0)
-        {
-            glMultMatrixd(_instancerTransforms[pi].data());
-        }
-        glMultMatrixf(_transform.data());
-        glBegin(GL_TRIANGLES);
-        for (int i = 0; i < _triangulatedIndices.size(); ++i)
-        {
-            for (int ti = 0; ti < 3; ++ti)
-            {
-                auto& p = _points[_triangulatedIndices[i][ti]];
-                if (_displayColors.size() == _points.size())
-                {
-                    // per-vertex color
-                    auto& c = _displayColors[_triangulatedIndices[i][ti]];
-                    glColor4f(c.data()[0], c.data()[1], c.data()[2], 1.0f);
-                }
-                if (_computedNormals.size() == _points.size())
-                {
-                    // per-vertex normal
-                    auto& n = _computedNormals[_triangulatedIndices[i][ti]];
-                    glNormal3fv(n.data());
-                }
-                glVertex3fv(p.data());
-            }
-        }
-        glEnd();
-        glPopMatrix();
+        auto& c = geometry.displayColors[0];
+        o_item->color = pxr::GfVec4f(c[0], c[1], c[2], 1.0f);
     }
 
-    glPopMatrix();
+    o_item->state = 0;
+    if (geometry.normals.size() == geometry.points.size())
+        o_item->state |= MyDrawItem::StateNormals;
+    if (geometry.displayColors.size() == geometry.points.size() && geometry.displayColors.size() > 1)
+        o_item->state |= MyDrawItem::StateColors;
+    if (_instances)
+        o_item->state |= MyDrawItem::StateInstanced;
+
+    return true;
 }
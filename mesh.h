@@ -6,10 +6,16 @@
 #include <pxr/imaging/hd/vertexAdjacency.h>
 #include <pxr/imaging/hd/vtBufferSource.h>
 #include <pxr/base/gf/matrix4f.h>
+#include <pxr/base/gf/range3f.h>
 #include <pxr/imaging/hd/meshUtil.h>
 #include <pxr/imaging/hd/sceneDelegate.h>
 #include <pxr/pxr.h>
 
+#include <memory>
+
+#include "geometry.h"
+#include "drawList.h"
+
 class MyRenderDelegate;
 
 class MyMesh final : public pxr::HdMesh
@@ -28,9 +34,10 @@ public:
 
     virtual void Finalize(pxr::HdRenderParam* renderParam) override;
 
-    void drawGL();
+    // Fill the draw record for this mesh, false if there's nothing to draw.
+    bool getDrawItem(MyDrawItem* o_item) const;
 
-    size_t numInstances() { return _instancerTransforms.size(); }
+    size_t numInstances() { return _instances ? _instances->size() : 0; }
 
     pxr::GfMatrix4f& getTransform() { return _transform; }
 
@@ -45,18 +52,24 @@ private:
         pxr::HdDirtyBits* dirtyBits,
         pxr::HdMeshReprDesc const& desc);
 
+    // Whether getDrawItem has anything to draw.
+    bool _IsDrawn() const;
+
+    // (Re)build the triangulation, adjacency and normals of the given
+    // geometry from the current topology and primvars.
+    void _BuildGeometry(MyGeometry& geometry,
+        pxr::VtVec3fArray const& points,
+        pxr::VtVec3fArray const& displayColors);
+
 private:
-    pxr::VtVec3fArray _points;
-    pxr::VtVec3fArray _displayColors;
     pxr::HdMeshTopology _topology;
     pxr::GfMatrix4f _transform;
-    pxr::VtMatrix4dArray _instancerTransforms;
-    pxr::VtVec3iArray _triangulatedIndices;
-    pxr::VtIntArray _trianglePrimitiveParams;
-    pxr::VtVec3fArray _computedNormals;
-    pxr::Hd_VertexAdjacency _adjacency;
-    bool _adjacencyValid;
-    bool _normalsValid;
+    // null unless the mesh is a prototype of an instancer.
+    std::shared_ptr<MyInstanceBuffer> _instances;
+    // authored extent, in local space.
+    pxr::GfRange3f _extent;
+    // world space bounds of the mesh, or of all its instances.
+    pxr::GfRange3f _worldBounds;
     bool _refined;
     bool _smoothNormals;
     struct PrimvarSource {
@@ -68,7 +81,15 @@ private:
     MyMesh(const MyMesh&) = delete;
     MyMesh& operator =(const MyMesh&) = delete;
 
-    pxr::SdfPath _dataSharingId;
+    // Points, normals, colors, triangulation and GPU buffers, shared with
+    // every other mesh with the same data sharing id or content hash.
+    std::shared_ptr<MyGeometry> _geometry;
+    // hashes of what the geometry key is made of, each updated only when
+    // it is dirty (a deforming mesh doesn't hash its topology every frame,
+    // nor its points when only the colors change).
+    pxr::HdTopology::ID _topologyHash;
+    uint64_t _pointsHash;
+    uint64_t _colorsHash;
 
     MyRenderDelegate* _owner;
 };
@@ -0,0 +1,154 @@
+#include "normals.h"
+
+#include <pxr/base/gf/math.h>
+#include <pxr/base/gf/limits.h>
+
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// vertices per TBB task, large enough to amortize the scheduling and small
+// enough to balance meshes with very uneven valences.
+static const size_t NORMALS_GRAIN_SIZE = 4096;
+
+static inline void _ComputeVertex(int const* entry, pxr::GfVec3f const* points,
+    pxr::GfVec3f* normals, size_t i)
+{
+    int offset = entry[i * 2];
+    int valence = entry[i * 2 + 1];
+    int const* e = &entry[offset];
+    pxr::GfVec3f normal(0.0f);
+    pxr::GfVec3f const& curr = points[i];
+    for (int j = 0; j < valence; ++j)
+    {
+        pxr::GfVec3f const& prev = points[*e++];
+        pxr::GfVec3f const& next = points[*e++];
+        // All meshes are right handed at this point (see Hd_VertexAdjacency).
+        normal += pxr::GfCross(next - curr, prev - curr);
+    }
+    normal.Normalize();
+    normals[i] = normal;
+}
+
+#if defined(__AVX2__)
+static inline int _HorizontalMax(__m256i v)
+{
+    __m128i m = _mm_max_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    m = _mm_max_epi32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm_max_epi32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(m);
+}
+#endif
+
+/*static*/
+void MySmoothNormals::_ComputeRange(int const* entry, pxr::GfVec3f const* points,
+    pxr::GfVec3f* normals, size_t begin, size_t end)
+{
+    size_t i = begin;
+
+#if defined(__AVX2__)
+    float const* p = points->data();
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i three = _mm256_set1_epi32(3);
+    const __m256 eps = _mm256_set1_ps(float(GF_MIN_VECTOR_LENGTH));
+
+    alignas(32) float nx[8], ny[8], nz[8];
+
+    for (; i + 8 <= end; i += 8)
+    {
+        const __m256i vertex = _mm256_add_epi32(_mm256_set1_epi32(int(i)), lane);
+
+        // (offset, valence) pairs of the 8 vertices.
+        const __m256i pair = _mm256_slli_epi32(vertex, 1);
+        const __m256i offset = _mm256_i32gather_epi32(entry, pair, 4);
+        const __m256i valence = _mm256_i32gather_epi32(entry, _mm256_add_epi32(pair, one), 4);
+
+        const __m256i currIdx = _mm256_mullo_epi32(vertex, three);
+        const __m256 cx = _mm256_i32gather_ps(p, currIdx, 4);
+        const __m256 cy = _mm256_i32gather_ps(p + 1, currIdx, 4);
+        const __m256 cz = _mm256_i32gather_ps(p + 2, currIdx, 4);
+
+        __m256 sx = _mm256_setzero_ps();
+        __m256 sy = _mm256_setzero_ps();
+        __m256 sz = _mm256_setzero_ps();
+
+        const int maxValence = _HorizontalMax(valence);
+        for (int j = 0; j < maxValence; ++j)
+        {
+            // lanes past their own valence fetch their own vertex, so both
+            // edges are zero and so is their contribution.
+            const __m256i active = _mm256_cmpgt_epi32(valence, _mm256_set1_epi32(j));
+            const __m256 activef = _mm256_castsi256_ps(active);
+            const __m256i e = _mm256_add_epi32(offset, _mm256_set1_epi32(j * 2));
+
+            __m256i prev = _mm256_mask_i32gather_epi32(vertex, entry, e, active, 4);
+            __m256i next = _mm256_mask_i32gather_epi32(vertex, entry, _mm256_add_epi32(e, one), active, 4);
+            prev = _mm256_mullo_epi32(prev, three);
+            next = _mm256_mullo_epi32(next, three);
+
+            const __m256 ax = _mm256_sub_ps(_mm256_mask_i32gather_ps(cx, p, next, activef, 4), cx);
+            const __m256 ay = _mm256_sub_ps(_mm256_mask_i32gather_ps(cy, p + 1, next, activef, 4), cy);
+            const __m256 az = _mm256_sub_ps(_mm256_mask_i32gather_ps(cz, p + 2, next, activef, 4), cz);
+            const __m256 bx = _mm256_sub_ps(_mm256_mask_i32gather_ps(cx, p, prev, activef, 4), cx);
+            const __m256 by = _mm256_sub_ps(_mm256_mask_i32gather_ps(cy, p + 1, prev, activef, 4), cy);
+            const __m256 bz = _mm256_sub_ps(_mm256_mask_i32gather_ps(cz, p + 2, prev, activef, 4), cz);
+
+            // (next - curr) x (prev - curr)
+            sx = _mm256_add_ps(sx, _mm256_sub_ps(_mm256_mul_ps(ay, bz), _mm256_mul_ps(az, by)));
+            sy = _mm256_add_ps(sy, _mm256_sub_ps(_mm256_mul_ps(az, bx), _mm256_mul_ps(ax, bz)));
+            sz = _mm256_add_ps(sz, _mm256_sub_ps(_mm256_mul_ps(ax, by), _mm256_mul_ps(ay, bx)));
+        }
+
+        // same as GfVec3f::Normalize: divide by the length, clamped to eps.
+        __m256 length = _mm256_add_ps(_mm256_mul_ps(sx, sx),
+            _mm256_add_ps(_mm256_mul_ps(sy, sy), _mm256_mul_ps(sz, sz)));
+        length = _mm256_max_ps(_mm256_sqrt_ps(length), eps);
+        _mm256_store_ps(nx, _mm256_div_ps(sx, length));
+        _mm256_store_ps(ny, _mm256_div_ps(sy, length));
+        _mm256_store_ps(nz, _mm256_div_ps(sz, length));
+
+        for (int k = 0; k < 8; ++k)
+        {
+            normals[i + k].Set(nx[k], ny[k], nz[k]);
+        }
+    }
+#endif
+
+    for (; i < end; ++i)
+    {
+        _ComputeVertex(entry, points, normals, i);
+    }
+}
+
+/*static*/
+pxr::VtVec3fArray MySmoothNormals::ComputeSmoothNormals(
+    pxr::Hd_VertexAdjacency const* adjacency,
+    int numPoints,
+    pxr::GfVec3f const* pointsPtr)
+{
+    // The adjacency table may reference more vertices than we have points,
+    // same clamping as Hd_SmoothNormals.
+    numPoints = std::min(numPoints, adjacency->GetNumPoints());
+
+    pxr::VtVec3fArray normals(numPoints);
+    if (numPoints <= 0)
+        return normals;
+
+    int const* entry = adjacency->GetAdjacencyTable().cdata();
+    pxr::GfVec3f* normalsPtr = normals.data();
+
+    tbb::parallel_for(
+        tbb::blocked_range<size_t>(0, size_t(numPoints), NORMALS_GRAIN_SIZE),
+        [&](tbb::blocked_range<size_t> const& r)
+        {
+            _ComputeRange(entry, pointsPtr, normalsPtr, r.begin(), r.end());
+        });
+
+    return normals;
+}
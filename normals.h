@@ -0,0 +1,30 @@
+#ifndef MY_NORMALS_H
+#define MY_NORMALS_H
+
+#include <pxr/pxr.h>
+#include <pxr/imaging/hd/vertexAdjacency.h>
+#include <pxr/base/gf/vec3f.h>
+#include <pxr/base/vt/array.h>
+
+// Drop-in replacement for Hd_SmoothNormals::ComputeSmoothNormals.
+//
+// Same adjacency table, same per-vertex sum of the corner cross products
+// and same normalization, so results match Hd_SmoothNormals within float
+// rounding. The vertices are split in TBB ranges and, when built with
+// AVX2, each range is processed 8 vertices at a time: neighbours are
+// fetched with masked gathers up to the largest valence in the block and
+// cross products/normalization run on SoA registers.
+class MySmoothNormals
+{
+public:
+    static pxr::VtVec3fArray ComputeSmoothNormals(
+        pxr::Hd_VertexAdjacency const* adjacency,
+        int numPoints,
+        pxr::GfVec3f const* pointsPtr);
+
+private:
+    static void _ComputeRange(int const* entry, pxr::GfVec3f const* points,
+        pxr::GfVec3f* normals, size_t begin, size_t end);
+};
+
+#endif
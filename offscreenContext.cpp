@@ -0,0 +1,406 @@
+#include "offscreenContext.h"
+
+#include "glad.h"
+#include "shaderPrograms.h"
+
+#include <initializer_list>
+#include <iostream>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+std::mutex MyOffscreenContext::_mutex;
+std::weak_ptr<MyOffscreenContext> MyOffscreenContext::_shared;
+
+#if !defined(_WIN32)
+
+// The few EGL and OSMesa entry points and enums used here, their headers
+// aren't needed to build.
+typedef int EGLint;
+typedef void* (*EglGetProcAddressFn)(const char* name);
+typedef void* (*EglGetDisplayFn)(void* nativeDisplay);
+typedef void* (*EglGetPlatformDisplayFn)(unsigned int platform, void* nativeDisplay, const EGLint* attribs);
+typedef unsigned int (*EglInitializeFn)(void* display, EGLint* major, EGLint* minor);
+typedef unsigned int (*EglBindAPIFn)(unsigned int api);
+typedef unsigned int (*EglChooseConfigFn)(void* display, const EGLint* attribs, void** configs, EGLint size,
+    EGLint* count);
+typedef void* (*EglCreateContextFn)(void* display, void* config, void* shareContext, const EGLint* attribs);
+typedef unsigned int (*EglMakeCurrentFn)(void* display, void* draw, void* read, void* context);
+typedef unsigned int (*EglDestroyContextFn)(void* display, void* context);
+typedef unsigned int (*EglTerminateFn)(void* display);
+
+static const EGLint EGL_NONE = 0x3038;
+static const EGLint EGL_SURFACE_TYPE = 0x3033;
+static const EGLint EGL_RENDERABLE_TYPE = 0x3040;
+static const EGLint EGL_OPENGL_BIT = 0x0008;
+static const unsigned int EGL_OPENGL_API = 0x30A2;
+static const EGLint EGL_CONTEXT_MAJOR_VERSION = 0x3098;
+static const EGLint EGL_CONTEXT_MINOR_VERSION = 0x30FB;
+static const EGLint EGL_CONTEXT_OPENGL_PROFILE_MASK = 0x30FD;
+static const EGLint EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT = 0x0001;
+static const unsigned int EGL_PLATFORM_SURFACELESS_MESA = 0x31DD;
+
+typedef void* (*OSMesaCreateContextAttribsFn)(const int* attribs, void* shareContext);
+typedef unsigned char (*OSMesaMakeCurrentFn)(void* context, void* buffer, unsigned int type, int width, int height);
+typedef void (*OSMesaDestroyContextFn)(void* context);
+typedef void* (*OSMesaGetProcAddressFn)(const char* name);
+typedef void* (*GetCurrentContextFn)();
+
+static const int OSMESA_FORMAT = 0x22;
+static const int OSMESA_DEPTH_BITS = 0x30;
+static const int OSMESA_PROFILE = 0x33;
+static const int OSMESA_CORE_PROFILE = 0x34;
+static const int OSMESA_CONTEXT_MAJOR_VERSION = 0x36;
+static const int OSMESA_CONTEXT_MINOR_VERSION = 0x37;
+
+// what the G-buffer programs need, nothing of the compatibility profile:
+// there is no host state to save around our frames.
+static const int CONTEXT_MAJOR_VERSION = 4;
+static const int CONTEXT_MINOR_VERSION = 3;
+
+static struct
+{
+    EglGetDisplayFn getDisplay = nullptr;
+    EglInitializeFn initialize = nullptr;
+    EglBindAPIFn bindAPI = nullptr;
+    EglChooseConfigFn chooseConfig = nullptr;
+    EglCreateContextFn createContext = nullptr;
+    EglMakeCurrentFn makeCurrent = nullptr;
+    EglDestroyContextFn destroyContext = nullptr;
+    EglTerminateFn terminate = nullptr;
+} _egl;
+
+static struct
+{
+    OSMesaCreateContextAttribsFn createContextAttribs = nullptr;
+    OSMesaMakeCurrentFn makeCurrent = nullptr;
+    OSMesaDestroyContextFn destroyContext = nullptr;
+} _osmesa;
+
+// what glad loads the GL entry points with: the backend's own lookup, and
+// the library exporting core GL for what it doesn't know (eglGetProcAddress
+// is only required to know extensions).
+static void* (*_getProcAddress)(const char* name) = nullptr;
+static void* _glLibrary = nullptr;
+
+static void* _GetProcAddress(const char* name)
+{
+    void* proc = _getProcAddress ? _getProcAddress(name) : nullptr;
+    if (!proc && _glLibrary)
+        proc = dlsym(_glLibrary, name);
+    return proc;
+}
+
+static void* _OpenLibrary(std::initializer_list<const char*> names)
+{
+    for (const char* name : names)
+    {
+        if (void* library = dlopen(name, RTLD_NOW | RTLD_LOCAL))
+            return library;
+    }
+    return nullptr;
+}
+
+#endif
+
+MyOffscreenContext::MyOffscreenContext()
+    : _backend(BackendNone)
+    , _library(nullptr)
+    , _display(nullptr)
+    , _context(nullptr)
+    , _osmesaBuffer()
+    , _loaded(false)
+{
+}
+
+MyOffscreenContext::~MyOffscreenContext()
+{
+#if !defined(_WIN32)
+    // the programs were built in this context, delete them with it: the
+    // next one (husk's next frame) builds its own. Not while a new context
+    // is being created either, that reloads the entry points we drop here.
+    std::unique_lock<std::mutex> guard(_mutex, std::defer_lock);
+    if (_loaded)
+    {
+        guard.lock();
+        if (_MakeCurrent())
+            MyShaderPrograms::release();
+    }
+
+    if (_backend == BackendEGL)
+    {
+        _egl.makeCurrent(_display, nullptr, nullptr, nullptr);
+        _egl.destroyContext(_display, _context);
+        _egl.terminate(_display);
+    }
+    else if (_backend == BackendOSMesa)
+    {
+        _osmesa.makeCurrent(nullptr, nullptr, 0, 0, 0);
+        _osmesa.destroyContext(_context);
+    }
+
+    if (_glLibrary && _glLibrary != _library)
+        dlclose(_glLibrary);
+    _glLibrary = nullptr;
+    _getProcAddress = nullptr;
+    if (_library)
+        dlclose(_library);
+#endif
+}
+
+/*static*/
+std::shared_ptr<MyOffscreenContext> MyOffscreenContext::Acquire(std::string const& backend)
+{
+    std::lock_guard<std::mutex> guard(_mutex);
+
+    // another delegate renders offscreen already, and its context may
+    // still be current: it isn't a host's.
+    if (std::shared_ptr<MyOffscreenContext> shared = _shared.lock())
+        return shared;
+
+    if (gladLoadGL())
+        return nullptr;
+
+    std::shared_ptr<MyOffscreenContext> context(new MyOffscreenContext());
+    const bool created = (backend != "osmesa" && context->_CreateEGL()) ||
+        (backend != "egl" && context->_CreateOSMesa());
+    if (!created)
+    {
+        std::cout << "ERROR::CONTEXT::NO_CONTEXT no GL context current and no "
+            << (backend.empty() ? "EGL or OSMesa" : backend) << " one could be created" << std::endl;
+        return nullptr;
+    }
+
+    if (!context->_MakeCurrent())
+    {
+        std::cout << "ERROR::CONTEXT::MAKE_CURRENT_FAILED " << context->backendName() << std::endl;
+        return nullptr;
+    }
+#if !defined(_WIN32)
+    if (!gladLoadGLLoader(&_GetProcAddress))
+    {
+        std::cout << "ERROR::CONTEXT::LOADING_FAILED " << context->backendName() << std::endl;
+        context->_DoneCurrent();
+        return nullptr;
+    }
+#endif
+    std::cout << "offscreen " << context->backendName() << " GL context: "
+        << reinterpret_cast<const char*>(glGetString(GL_RENDERER)) << ", "
+        << reinterpret_cast<const char*>(glGetString(GL_VERSION)) << std::endl;
+    context->_DoneCurrent();
+
+    context->_loaded = true;
+    _shared = context;
+    return context;
+}
+
+bool MyOffscreenContext::_CreateEGL()
+{
+#if !defined(_WIN32)
+    _library = _OpenLibrary({ "libEGL.so.1", "libEGL.so" });
+    if (!_library)
+        return false;
+
+    EglGetProcAddressFn getProcAddress = (EglGetProcAddressFn)dlsym(_library, "eglGetProcAddress");
+    _egl.getDisplay = (EglGetDisplayFn)dlsym(_library, "eglGetDisplay");
+    _egl.initialize = (EglInitializeFn)dlsym(_library, "eglInitialize");
+    _egl.bindAPI = (EglBindAPIFn)dlsym(_library, "eglBindAPI");
+    _egl.chooseConfig = (EglChooseConfigFn)dlsym(_library, "eglChooseConfig");
+    _egl.createContext = (EglCreateContextFn)dlsym(_library, "eglCreateContext");
+    _egl.makeCurrent = (EglMakeCurrentFn)dlsym(_library, "eglMakeCurrent");
+    _egl.destroyContext = (EglDestroyContextFn)dlsym(_library, "eglDestroyContext");
+    _egl.terminate = (EglTerminateFn)dlsym(_library, "eglTerminate");
+    if (!getProcAddress || !_egl.getDisplay || !_egl.initialize || !_egl.bindAPI || !_egl.chooseConfig ||
+        !_egl.createContext || !_egl.makeCurrent || !_egl.destroyContext || !_egl.terminate)
+    {
+        dlclose(_library);
+        _library = nullptr;
+        return false;
+    }
+
+    // Mesa's surfaceless platform needs neither a display nor a GPU (it
+    // falls back to llvmpipe), other drivers have a default display that
+    // works headless.
+    EglGetPlatformDisplayFn getPlatformDisplay =
+        (EglGetPlatformDisplayFn)getProcAddress("eglGetPlatformDisplayEXT");
+    void* display = getPlatformDisplay ?
+        getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, nullptr, nullptr) : nullptr;
+    if (!display || !_egl.initialize(display, nullptr, nullptr))
+    {
+        display = _egl.getDisplay(nullptr);
+        if (!display || !_egl.initialize(display, nullptr, nullptr))
+            display = nullptr;
+    }
+
+    // any surface type, it is never drawn to.
+    const EGLint configAttribs[] = {
+        EGL_SURFACE_TYPE, 0,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+    const EGLint contextAttribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, CONTEXT_MAJOR_VERSION,
+        EGL_CONTEXT_MINOR_VERSION, CONTEXT_MINOR_VERSION,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    void* config = nullptr;
+    EGLint configCount = 0;
+    void* context = nullptr;
+    if (display && _egl.bindAPI(EGL_OPENGL_API) &&
+        _egl.chooseConfig(display, configAttribs, &config, 1, &configCount) && configCount > 0)
+    {
+        context = _egl.createContext(display, config, nullptr, contextAttribs);
+    }
+    if (!context)
+    {
+        if (display)
+            _egl.terminate(display);
+        dlclose(_library);
+        _library = nullptr;
+        return false;
+    }
+
+    _backend = BackendEGL;
+    _display = display;
+    _context = context;
+    _getProcAddress = getProcAddress;
+    _glLibrary = _OpenLibrary({ "libOpenGL.so.0", "libGL.so.1" });
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool MyOffscreenContext::_CreateOSMesa()
+{
+#if !defined(_WIN32)
+    _library = _OpenLibrary({ "libOSMesa.so.8", "libOSMesa.so.6", "libOSMesa.so" });
+    if (!_library)
+        return false;
+
+    OSMesaGetProcAddressFn getProcAddress = (OSMesaGetProcAddressFn)dlsym(_library, "OSMesaGetProcAddress");
+    _osmesa.createContextAttribs = (OSMesaCreateContextAttribsFn)dlsym(_library, "OSMesaCreateContextAttribs");
+    _osmesa.makeCurrent = (OSMesaMakeCurrentFn)dlsym(_library, "OSMesaMakeCurrent");
+    _osmesa.destroyContext = (OSMesaDestroyContextFn)dlsym(_library, "OSMesaDestroyContext");
+    if (!getProcAddress || !_osmesa.createContextAttribs || !_osmesa.makeCurrent || !_osmesa.destroyContext)
+    {
+        dlclose(_library);
+        _library = nullptr;
+        return false;
+    }
+
+    // no depth, the render pass has its own.
+    const int attribs[] = {
+        OSMESA_FORMAT, GL_RGBA,
+        OSMESA_DEPTH_BITS, 0,
+        OSMESA_PROFILE, OSMESA_CORE_PROFILE,
+        OSMESA_CONTEXT_MAJOR_VERSION, CONTEXT_MAJOR_VERSION,
+        OSMESA_CONTEXT_MINOR_VERSION, CONTEXT_MINOR_VERSION,
+        0
+    };
+    void* context = _osmesa.createContextAttribs(attribs, nullptr);
+    if (!context)
+    {
+        dlclose(_library);
+        _library = nullptr;
+        return false;
+    }
+
+    _backend = BackendOSMesa;
+    _context = context;
+    _getProcAddress = getProcAddress;
+    // it exports core GL itself.
+    _glLibrary = _library;
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool MyOffscreenContext::_MakeCurrent()
+{
+#if !defined(_WIN32)
+    if (_backend == BackendEGL)
+        return _egl.makeCurrent(_display, nullptr, nullptr, _context) != 0;
+    if (_backend == BackendOSMesa)
+        return _osmesa.makeCurrent(_context, _osmesaBuffer, GL_UNSIGNED_BYTE, 1, 1) != 0;
+#endif
+    return false;
+}
+
+void MyOffscreenContext::_DoneCurrent()
+{
+#if !defined(_WIN32)
+    if (_backend == BackendEGL)
+        _egl.makeCurrent(_display, nullptr, nullptr, nullptr);
+    else if (_backend == BackendOSMesa)
+        _osmesa.makeCurrent(nullptr, nullptr, 0, 0, 0);
+#endif
+}
+
+MyOffscreenContext::ScopedCurrent::ScopedCurrent(MyOffscreenContext* context)
+    : _context(context)
+    , _lock()
+    , _current(true)
+{
+    if (!_context)
+        return;
+    _lock = std::unique_lock<std::mutex>(_context->_currentMutex);
+    _current = _context->_MakeCurrent();
+    if (!_current)
+    {
+        std::cout << "ERROR::CONTEXT::MAKE_CURRENT_FAILED " << _context->backendName() << std::endl;
+        _lock.unlock();
+    }
+}
+
+MyOffscreenContext::ScopedCurrent::~ScopedCurrent()
+{
+    if (_context && _current)
+        _context->_DoneCurrent();
+}
+
+/*static*/
+void* MyOffscreenContext::CurrentHandle()
+{
+#if defined(_WIN32)
+    return wglGetCurrentContext();
+#else
+    // only asked of libraries loaded already, by the host or by us: the
+    // host's may not be in the global scope, and ours may have been closed
+    // and opened again since the last call.
+    static const struct
+    {
+        const char* library;
+        const char* function;
+    } getters[] = {
+        { "libGL.so.1", "glXGetCurrentContext" },
+        { "libEGL.so.1", "eglGetCurrentContext" },
+        { "libOSMesa.so.8", "OSMesaGetCurrentContext" },
+        { "libOSMesa.so.6", "OSMesaGetCurrentContext" }
+    };
+    for (auto const& getter : getters)
+    {
+        void* library = dlopen(getter.library, RTLD_NOW | RTLD_NOLOAD);
+        if (!library)
+            continue;
+        GetCurrentContextFn getCurrentContext = (GetCurrentContextFn)dlsym(library, getter.function);
+        void* context = getCurrentContext ? getCurrentContext() : nullptr;
+        dlclose(library);
+        if (context)
+            return context;
+    }
+    return nullptr;
+#endif
+}
+
+const char* MyOffscreenContext::backendName() const
+{
+    return _backend == BackendEGL ? "EGL" : _backend == BackendOSMesa ? "OSMesa" : "none";
+}
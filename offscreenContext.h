@@ -0,0 +1,99 @@
+#ifndef MY_OFFSCREENCONTEXT_H
+#define MY_OFFSCREENCONTEXT_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+
+// GL context of our own, for hosts without one current (husk on farm
+// blades with no display and no GPU): EGL on its surfaceless platform (or
+// its default display), or OSMesa, typically llvmpipe. Both libraries are
+// loaded at runtime, the delegate doesn't link against either. The context
+// has no default framebuffer to speak of, the render pass draws into its
+// own framebuffer object.
+//
+// There is one per process, shared by the delegates using it. Like any GL
+// context it can only be current on one thread at a time: a ScopedCurrent
+// makes it current around the GL work of a frame and releases it after,
+// the render threads of other delegates wait for it meanwhile. It goes
+// with the last of them, and the programs built in it too.
+class MyOffscreenContext
+{
+public:
+    ~MyOffscreenContext();
+
+    // Load the GL entry points from the context current on this thread
+    // and return null when there is one (Solaris, usdview). Otherwise
+    // return the offscreen context, created on first use, with the entry
+    // points loaded from it. backend is "egl", "osmesa", or empty to try
+    // EGL then OSMesa. Null as well, with an error, if that fails.
+    static std::shared_ptr<MyOffscreenContext> Acquire(std::string const& backend);
+
+    // The context current on the calling thread for the lifetime of the
+    // scope, other threads wanting it wait. Nothing is current when
+    // current() is false, the error is printed. A null context is left
+    // alone (the host's is current), current() is then always true.
+    class ScopedCurrent
+    {
+    public:
+        explicit ScopedCurrent(MyOffscreenContext* context);
+        ~ScopedCurrent();
+
+        bool current() const { return _current; }
+
+    private:
+        ScopedCurrent(const ScopedCurrent&) = delete;
+        ScopedCurrent& operator =(const ScopedCurrent&) = delete;
+
+        MyOffscreenContext* _context;
+        std::unique_lock<std::mutex> _lock;
+        bool _current;
+    };
+
+    // "EGL" or "OSMesa".
+    const char* backendName() const;
+
+    // Native handle of the GL context current on the calling thread,
+    // whoever made it: GLX, EGL or OSMesa ones, WGL on Windows. Null when
+    // there is none or none of their libraries is loaded.
+    static void* CurrentHandle();
+
+private:
+    MyOffscreenContext();
+    MyOffscreenContext(const MyOffscreenContext&) = delete;
+    MyOffscreenContext& operator =(const MyOffscreenContext&) = delete;
+
+    bool _CreateEGL();
+    bool _CreateOSMesa();
+
+    // Make the context current on the calling thread / release it, see
+    // ScopedCurrent.
+    bool _MakeCurrent();
+    void _DoneCurrent();
+
+    enum _Backend
+    {
+        BackendNone,
+        BackendEGL,
+        BackendOSMesa
+    };
+    _Backend _backend;
+
+    // dlopen handle of libEGL / libOSMesa.
+    void* _library;
+    void* _display;
+    void* _context;
+    // OSMesa wants a color buffer to make a context current, even if
+    // nothing ever draws into it.
+    unsigned char _osmesaBuffer[4];
+    // the GL entry points were loaded from it and it was handed out: the
+    // programs of MyShaderPrograms are its own.
+    bool _loaded;
+    // held by the ScopedCurrent the context is current for.
+    std::mutex _currentMutex;
+
+    static std::mutex _mutex;
+    static std::weak_ptr<MyOffscreenContext> _shared;
+};
+
+#endif
@@ -2,6 +2,20 @@
 #include <pxr/base/gf/half.h>
 #include <pxr/base/gf/vec3i.h>
 
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+
+// F16C is picked at runtime, the file is built for any x86-64 CPU (see
+// _WriteHalfRow).
+#if defined(__x86_64__) || defined(_M_X64)
+#define MY_F16C_DISPATCH 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#endif
+
 MyRenderBuffer::MyRenderBuffer(pxr::SdfPath const& id)
     : pxr::HdRenderBuffer(id)
     , _width(0)
@@ -238,6 +252,122 @@ MyRenderBuffer::Clear(size_t numComponents, int const* value)
     }
 }
 
+#if defined(MY_F16C_DISPATCH)
+// Whether the CPU, and the OS saving the AVX registers, let us use F16C.
+static bool _HasF16C()
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 1);
+    const bool avx = (info[2] & (1 << 28)) != 0;
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool f16c = (info[2] & (1 << 29)) != 0;
+    return avx && osxsave && f16c && (_xgetbv(0) & 0x6) == 0x6;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+#endif
+}
+
+// The first multiple of 8 values of a row, 8 at a time, rounded to the
+// nearest even like GfHalf. Built for F16C whatever the flags of the rest
+// of the file, only called when _HasF16C().
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((target("avx,f16c")))
+#endif
+static size_t _WriteHalfRowF16C(uint16_t* dst, float const* src, size_t count, float scale)
+{
+    size_t i = 0;
+    const __m256 factor = _mm256_set1_ps(scale);
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m256 values = _mm256_mul_ps(_mm256_loadu_ps(src + i), factor);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+            _mm256_cvtps_ph(values, _MM_FROUND_TO_NEAREST_INT));
+    }
+    return i;
+}
+#endif
+
+// A row of float values to half floats.
+static void _WriteHalfRow(uint16_t* dst, float const* src, size_t count, float scale)
+{
+    size_t i = 0;
+#if defined(MY_F16C_DISPATCH)
+    static const bool hasF16C = _HasF16C();
+    if (hasF16C)
+        i = _WriteHalfRowF16C(dst, src, count, scale);
+#endif
+    for (; i < count; ++i)
+        dst[i] = pxr::GfHalf(src[i] * scale).bits();
+}
+
+void
+MyRenderBuffer::WriteFrame(float const* pixels, size_t numComponents, int width, int height, float scale)
+{
+    std::unique_lock<std::shared_mutex> guard(_mapMutex);
+    const size_t columns = std::min<size_t>(std::max(width, 0), _width);
+    const size_t rows = std::min<size_t>(std::max(height, 0), _height);
+    const size_t formatSize = pxr::HdDataSizeOfFormat(_format);
+    const pxr::HdFormat componentFormat = pxr::HdGetComponentFormat(_format);
+    const bool sameArity = pxr::HdGetComponentCount(_format) == numComponents;
+
+    for (size_t y = 0; y < rows; ++y)
+    {
+        float const* src = pixels + y * size_t(width) * numComponents;
+        uint8_t* dst = &_buffer[y * _width * formatSize];
+
+        // the formats a color or depth AOV comes in, straight through.
+        if (componentFormat == pxr::HdFormatFloat16 && sameArity)
+        {
+            _WriteHalfRow(reinterpret_cast<uint16_t*>(dst), src, columns * numComponents, scale);
+        }
+        else if (componentFormat == pxr::HdFormatFloat32 && sameArity && scale == 1.0f)
+        {
+            std::memcpy(dst, src, columns * numComponents * sizeof(float));
+        }
+        else
+        {
+            float value[4];
+            const size_t count = std::min<size_t>(numComponents, 4);
+            for (size_t x = 0; x < columns; ++x)
+            {
+                for (size_t c = 0; c < count; ++c)
+                    value[c] = src[x * numComponents + c] * scale;
+                _WriteOutput(_format, dst + x * formatSize, count, value);
+            }
+        }
+    }
+}
+
+void
+MyRenderBuffer::WriteFrame(int const* pixels, size_t numComponents, int width, int height)
+{
+    std::unique_lock<std::shared_mutex> guard(_mapMutex);
+    const size_t columns = std::min<size_t>(std::max(width, 0), _width);
+    const size_t rows = std::min<size_t>(std::max(height, 0), _height);
+    const size_t formatSize = pxr::HdDataSizeOfFormat(_format);
+    const bool sameLayout = pxr::HdGetComponentFormat(_format) == pxr::HdFormatInt32 &&
+        pxr::HdGetComponentCount(_format) == numComponents;
+
+    for (size_t y = 0; y < rows; ++y)
+    {
+        int const* src = pixels + y * size_t(width) * numComponents;
+        uint8_t* dst = &_buffer[y * _width * formatSize];
+
+        // the ids AOVs, straight through.
+        if (sameLayout)
+        {
+            std::memcpy(dst, src, columns * numComponents * sizeof(int));
+        }
+        else
+        {
+            for (size_t x = 0; x < columns; ++x)
+                _WriteOutput(_format, dst + x * formatSize, numComponents, src + x * numComponents);
+        }
+    }
+}
+
 /*virtual*/
 void
 MyRenderBuffer::Resolve()
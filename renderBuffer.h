@@ -4,6 +4,8 @@
 #include <pxr/pxr.h>
 #include <pxr/imaging/hd/renderBuffer.h>
 
+#include <shared_mutex>
+
 class MyRenderBuffer : public pxr::HdRenderBuffer
 {
 public:
@@ -60,9 +62,11 @@ public:
 
     /// Map the buffer for reading/writing. The control flow should be Map(),
     /// before any I/O, followed by memory access, followed by Unmap() when
-    /// done.
+    /// done, on the same thread. WriteFrame waits for the buffer to be
+    /// unmapped, so a mapped buffer never holds half a frame.
     ///   \return The address of the buffer.
     void* Map() override {
+        _mapMutex.lock_shared();
         _mappers++;
         return _buffer.data();
     }
@@ -70,6 +74,7 @@ public:
     /// Unmap the buffer.
     void Unmap() override {
         _mappers--;
+        _mapMutex.unlock_shared();
     }
 
     /// Return whether any clients have this buffer mapped currently.
@@ -133,6 +138,25 @@ public:
     ///   \param value         An int-valued vector to write. 
     void Clear(size_t numComponents, int const* value);
 
+    /// Write a whole frame of float pixels, rows in the order GL reads
+    /// them back, converted to the buffer's format. Float16 formats are
+    /// converted 8 values at a time with F16C when the CPU has it. Pixels
+    /// outside of the buffer are dropped, components as with Write. Not
+    /// on a mapped buffer: the frame is written once every mapper is done.
+    ///   \param pixels        width * height pixels.
+    ///   \param numComponents The arity of each pixel.
+    ///   \param width         Width of the frame.
+    ///   \param height        Height of the frame.
+    ///   \param scale         Factor applied to every value.
+    void WriteFrame(float const* pixels, size_t numComponents, int width, int height, float scale = 1.0f);
+
+    /// Write a whole frame of int pixels, as above.
+    ///   \param pixels        width * height pixels.
+    ///   \param numComponents The arity of each pixel.
+    ///   \param width         Width of the frame.
+    ///   \param height        Height of the frame.
+    void WriteFrame(int const* pixels, size_t numComponents, int width, int height);
+
 private:
     // Calculate the needed buffer size, given the allocation parameters.
     static size_t _GetBufferSize(pxr::GfVec2i const& dims, pxr::HdFormat format);
@@ -161,8 +185,10 @@ private:
     // For multisampled buffers: the sample count buffer.
     std::vector<uint8_t> _sampleCount;
 
-    // The number of callers mapping this buffer.
+    // The number of callers mapping this buffer, each holding _mapMutex
+    // shared. WriteFrame holds it exclusively.
     std::atomic<int> _mappers;
+    std::shared_mutex _mapMutex;
     // Whether the buffer has been marked as converged.
     std::atomic<bool> _converged;
 };
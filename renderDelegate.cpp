@@ -8,22 +8,24 @@
 #include "mesh.h"
 #include "camera.h"
 #include "instancer.h"
+#include "shaderPrograms.h"
 
 #include <iostream>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+
+#include <tbb/task_arena.h>
 
 #include "glad.h"
 
+PXR_NAMESPACE_OPEN_SCOPE
+TF_DEFINE_PUBLIC_TOKENS(MyRenderSettingsTokens, MY_RENDER_SETTINGS_TOKENS);
+PXR_NAMESPACE_CLOSE_SCOPE
+
 std::mutex MyRenderDelegate::_mutexResourceRegistry;
 std::atomic_int MyRenderDelegate::_counterResourceRegistry;
 pxr::HdResourceRegistrySharedPtr MyRenderDelegate::_resourceRegistry;
-std::map<pxr::SdfPath, MyMesh*> MyRenderDelegate::_myMeshes;
-
-std::set<pxr::SdfPath> MyRenderDelegate::_dataSharingIds;
-std::set<pxr::SdfPath> MyRenderDelegate::_instancerIds;
-
-float* MyRenderDelegate::_pixelsData;
-int MyRenderDelegate::_pixelsWidth;
-int MyRenderDelegate::_pixelsHeight;
 
 const pxr::TfTokenVector MyRenderDelegate::SUPPORTED_RPRIM_TYPES = {
     pxr::HdPrimTypeTokens->mesh,
@@ -53,7 +55,22 @@ pxr::TfTokenVector const& MyRenderDelegate::GetSupportedBprimTypes() const
 }
 
 MyRenderDelegate::MyRenderDelegate()
-    : HdRenderDelegate()
+    : HdRenderDelegate(), _currentStatsTime(0), _drawTimeMs(0.0), _cullTimeMs(0.0), _drawListDirty(true)
+    , _drawItemsDirty(false)
+    , _syncSpans(), _syncTimeMs(0.0), _syncPrimCount(0)
+    , _syncEpoch(0), _useHdSmoothNormals(false), _normalsTimeUs(0), _normalsTimeMs(0.0)
+    , _useLegacyInstanceTransforms(false), _useFactoredNestedInstances(false)
+    , _useInstanceLod(false), _instanceLodDecimatedSize(32.0f), _instanceLodPointSize(4.0f)
+    , _motionSamples(1), _framesPerSecond(24.0f), _shutterOpen(0.0), _shutterClose(0.0), _motionTimes()
+    , _motionVersion(0), _motionDirtyVersion(0), _motionSyncedVersion(0)
+    , _motionSubframes(1), _motionFrameTimeMs(0.0)
+    , _sceneVersion(0), _useAsyncReadback(true), _readbackStallMs(0.0), _readbackLatencyMs(0.0)
+    , _instanceTransformsTimeUs(0), _instanceTransformsCount(0)
+    , _instanceTransformsTimeMs(0.0), _instanceTransformsComposed(0)
+    , _instanceTransformsCached(0), _instanceTransformsComputed(0), _instanceTransformsLookups{ 0, 0 }
+    , _instanceTransformsPatched(0), _instanceTransformsPatchedInstances(0)
+    , _instanceTransformsPatches(0), _instanceTransformsPatchedCount(0)
+    , _firstPixelMs(-1.0)
 {
     std::cout << __FUNCTION__ << std::endl;
     _Initialize();
@@ -61,7 +78,22 @@ MyRenderDelegate::MyRenderDelegate()
 
 MyRenderDelegate::MyRenderDelegate(
     pxr::HdRenderSettingsMap const& settingsMap)
-    : HdRenderDelegate(settingsMap), _currentStatsTime(0)
+    : HdRenderDelegate(settingsMap), _currentStatsTime(0), _drawTimeMs(0.0), _cullTimeMs(0.0), _drawListDirty(true)
+    , _drawItemsDirty(false)
+    , _syncSpans(), _syncTimeMs(0.0), _syncPrimCount(0)
+    , _syncEpoch(0), _useHdSmoothNormals(false), _normalsTimeUs(0), _normalsTimeMs(0.0)
+    , _useLegacyInstanceTransforms(false), _useFactoredNestedInstances(false)
+    , _useInstanceLod(false), _instanceLodDecimatedSize(32.0f), _instanceLodPointSize(4.0f)
+    , _motionSamples(1), _framesPerSecond(24.0f), _shutterOpen(0.0), _shutterClose(0.0), _motionTimes()
+    , _motionVersion(0), _motionDirtyVersion(0), _motionSyncedVersion(0)
+    , _motionSubframes(1), _motionFrameTimeMs(0.0)
+    , _sceneVersion(0), _useAsyncReadback(true), _readbackStallMs(0.0), _readbackLatencyMs(0.0)
+    , _instanceTransformsTimeUs(0), _instanceTransformsCount(0)
+    , _instanceTransformsTimeMs(0.0), _instanceTransformsComposed(0)
+    , _instanceTransformsCached(0), _instanceTransformsComputed(0), _instanceTransformsLookups{ 0, 0 }
+    , _instanceTransformsPatched(0), _instanceTransformsPatchedInstances(0)
+    , _instanceTransformsPatches(0), _instanceTransformsPatchedCount(0)
+    , _firstPixelMs(-1.0)
 {
     std::cout << __FUNCTION__ << std::endl;
     std::cout << "Husk calls this with all rendersettings" << std::endl;
@@ -70,18 +102,164 @@ MyRenderDelegate::MyRenderDelegate(
 
 void MyRenderDelegate::_Initialize()
 {
-    gladLoadGL();
+    _createdTime = std::chrono::high_resolution_clock::now();
+
+    // compiled programs are kept on disk, unless badgl:programCache is
+    // off, in badgl:programCacheDir or a directory of the temporary one.
+    // The programs are process-wide, the last delegate created sets it.
+    bool programCache = true;
+    const pxr::VtValue programCacheValue = GetRenderSetting(pxr::MyRenderSettingsTokens->programCache);
+    if (programCacheValue.IsHolding<bool>())
+        programCache = programCacheValue.UncheckedGet<bool>();
+    const pxr::VtValue programCacheDirValue = GetRenderSetting(pxr::MyRenderSettingsTokens->programCacheDir);
+    if (programCacheDirValue.IsHolding<std::string>())
+        _programCacheDir = programCacheDirValue.UncheckedGet<std::string>();
+    else if (programCacheDirValue.IsHolding<pxr::TfToken>())
+        _programCacheDir = programCacheDirValue.UncheckedGet<pxr::TfToken>().GetString();
+    if (_programCacheDir.empty())
+    {
+        std::error_code error;
+        const std::filesystem::path temp = std::filesystem::temp_directory_path(error);
+        if (!error)
+            _programCacheDir = (temp / "hdBadGL" / "programs").string();
+    }
+    if (!programCache)
+        _programCacheDir.clear();
+    MyShaderPrograms::setCacheDirectory(_programCacheDir);
+
+    // the host's GL context when one is current (Solaris, usdview), our
+    // own offscreen one otherwise (husk). It is only read from the
+    // settings map, once.
+    std::string offscreenBackend;
+    const pxr::VtValue backendValue = GetRenderSetting(pxr::MyRenderSettingsTokens->offscreenContext);
+    if (backendValue.IsHolding<std::string>())
+        offscreenBackend = backendValue.UncheckedGet<std::string>();
+    else if (backendValue.IsHolding<pxr::TfToken>())
+        offscreenBackend = backendValue.UncheckedGet<pxr::TfToken>().GetString();
+    _offscreenContext = MyOffscreenContext::Acquire(offscreenBackend);
+    {
+        MyOffscreenContext::ScopedCurrent current(_offscreenContext.get());
+        if (current.current() && GLVersion.major > 0)
+            _glRenderer = reinterpret_cast<const char*>(glGetString(GL_RENDERER));
+    }
 
     std::lock_guard<std::mutex> guard(_mutexResourceRegistry);
     if (_counterResourceRegistry.fetch_add(1) == 0) {
         _resourceRegistry = std::make_shared<pxr::HdResourceRegistry>();
     }
 
+    _settingFunctions[pxr::MyRenderSettingsTokens->hdSmoothNormals] = [this](pxr::VtValue const& value)
+    {
+        if (!value.IsHolding<bool>())
+            return false;
+        _useHdSmoothNormals = value.UncheckedGet<bool>();
+        return true;
+    };
+
+    _settingFunctions[pxr::MyRenderSettingsTokens->legacyInstanceTransforms] = [this](pxr::VtValue const& value)
+    {
+        if (!value.IsHolding<bool>())
+            return false;
+        _useLegacyInstanceTransforms = value.UncheckedGet<bool>();
+        return true;
+    };
+
+    _settingFunctions[pxr::MyRenderSettingsTokens->factoredNestedInstances] = [this](pxr::VtValue const& value)
+    {
+        if (!value.IsHolding<bool>())
+            return false;
+        _useFactoredNestedInstances = value.UncheckedGet<bool>();
+        return true;
+    };
+
+    _settingFunctions[pxr::MyRenderSettingsTokens->motionSamples] = [this](pxr::VtValue const& value)
+    {
+        if (!value.CanCast<int>())
+            return false;
+        _motionSamples = pxr::VtValue::Cast<int>(value).UncheckedGet<int>();
+        _UpdateMotionTimes();
+        return true;
+    };
+
+    _settingFunctions[pxr::MyRenderSettingsTokens->framesPerSecond] = [this](pxr::VtValue const& value)
+    {
+        if (!value.CanCast<float>())
+            return false;
+        const float framesPerSecond = pxr::VtValue::Cast<float>(value).UncheckedGet<float>();
+        if (framesPerSecond <= 0.0f)
+            return false;
+        if (framesPerSecond != _framesPerSecond)
+        {
+            _framesPerSecond = framesPerSecond;
+            _motionVersion++;
+        }
+        return true;
+    };
+
+    _settingFunctions[pxr::MyRenderSettingsTokens->instanceLod] = [this](pxr::VtValue const& value)
+    {
+        if (!value.IsHolding<bool>())
+            return false;
+        _useInstanceLod = value.UncheckedGet<bool>();
+        return true;
+    };
+
+    _settingFunctions[pxr::MyRenderSettingsTokens->instanceLodDecimatedSize] = [this](pxr::VtValue const& value)
+    {
+        if (!value.CanCast<float>())
+            return false;
+        _instanceLodDecimatedSize = pxr::VtValue::Cast<float>(value).UncheckedGet<float>();
+        return true;
+    };
+
+    _settingFunctions[pxr::MyRenderSettingsTokens->instanceLodPointSize] = [this](pxr::VtValue const& value)
+    {
+        if (!value.CanCast<float>())
+            return false;
+        _instanceLodPointSize = pxr::VtValue::Cast<float>(value).UncheckedGet<float>();
+        return true;
+    };
+
+    _settingFunctions[pxr::MyRenderSettingsTokens->asyncReadback] = [this](pxr::VtValue const& value)
+    {
+        if (!value.IsHolding<bool>())
+            return false;
+        _useAsyncReadback = value.UncheckedGet<bool>();
+        return true;
+    };
+
+    // husk --threads: 0 for all of them, negative to leave that many free.
+    // Caps runParallel's work only, see there.
+    _settingFunctions[pxr::HdRenderSettingsTokens->threadLimit] = [this](pxr::VtValue const& value)
+    {
+        if (!value.CanCast<int>())
+            return false;
+        _SetThreadLimit(pxr::VtValue::Cast<int>(value).UncheckedGet<int>());
+        return true;
+    };
+
+    // apply whatever came in with the settings map (husk)
+    for (auto& setting : _settingFunctions)
+    {
+        pxr::VtValue value = GetRenderSetting(setting.first);
+        if (!value.IsEmpty())
+            setting.second(value);
+    }
 }
 
 MyRenderDelegate::~MyRenderDelegate()
 {
     std::cout << __FUNCTION__ << std::endl;
+
+    // Delete what the prims and passes queued for an UpdateScene that won't come.
+    // Only our own context can be made current here.
+    if (_offscreenContext)
+    {
+        MyOffscreenContext::ScopedCurrent current(_offscreenContext.get());
+        if (current.current())
+            _ReleaseGLObjects();
+    }
+
     std::lock_guard<std::mutex> guard(_mutexResourceRegistry);
     if (_counterResourceRegistry.fetch_sub(1) == 1) {
         _resourceRegistry.reset();
@@ -93,9 +271,155 @@ pxr::HdResourceRegistrySharedPtr MyRenderDelegate::GetResourceRegistry() const
     return _resourceRegistry;
 }
 
-void MyRenderDelegate::CommitResources(pxr::HdChangeTracker* /* tracker */)
+void MyRenderDelegate::CommitResources(pxr::HdChangeTracker* tracker)
 {
     _resourceRegistry->Commit();
+
+    _syncEpoch.fetch_add(1);
+
+    // new motion sample times (badgl:motionSamples, the frame rate or the
+    // shutter of the camera a pass renders through) only reach the
+    // instances on a sync: mark the instancers, and through them their
+    // prototypes, dirty for the next one. Those marked last time were
+    // synced just now.
+    _motionSyncedVersion = _motionDirtyVersion;
+    const size_t motionVersion = _motionVersion.load();
+    if (tracker && motionVersion != _motionDirtyVersion)
+    {
+        for (pxr::SdfPath const& instancerId : instancerIds())
+            tracker->MarkInstancerDirty(instancerId, pxr::HdChangeTracker::DirtyTransform);
+        _motionDirtyVersion = motionVersion;
+    }
+
+    // a recompile refreshes every item too.
+    const bool drawItemsDirty = _drawItemsDirty.exchange(false);
+    if (_drawListDirty.exchange(false) || (drawItemsDirty && !_RefreshDrawList()))
+    {
+        _CompileDrawList();
+        _sceneVersion++;
+    }
+    else if (drawItemsDirty)
+    {
+        _sceneVersion++;
+    }
+
+    // sync is done, keep the wall time of the last one that synced prims.
+    // The threads' spans are reset, not cleared: they sync again next time.
+    int syncedPrims = 0;
+    int64_t syncStartUs = INT64_MAX;
+    int64_t syncEndUs = 0;
+    for (_SyncSpan& span : _syncSpans)
+    {
+        syncedPrims += span.prims;
+        syncStartUs = std::min(syncStartUs, span.startUs);
+        syncEndUs = std::max(syncEndUs, span.endUs);
+        span = _SyncSpan();
+    }
+    if (syncedPrims > 0)
+    {
+        _syncTimeMs = (syncEndUs - syncStartUs) / 1000.0;
+        _syncPrimCount = syncedPrims;
+    }
+
+    // sync is done, keep the normals time of the last sync that did any.
+    int64_t normalsTimeUs = _normalsTimeUs.exchange(0);
+    if (normalsTimeUs > 0)
+        _normalsTimeMs = normalsTimeUs / 1000.0;
+
+    // same for instance transforms.
+    int64_t instanceTransformsTimeUs = _instanceTransformsTimeUs.exchange(0);
+    size_t instanceTransformsCount = _instanceTransformsCount.exchange(0);
+    if (instanceTransformsCount > 0)
+    {
+        _instanceTransformsTimeMs = instanceTransformsTimeUs / 1000.0;
+        _instanceTransformsComposed = instanceTransformsCount;
+    }
+    int instanceTransformsCached = _instanceTransformsCached.exchange(0);
+    int instanceTransformsComputed = _instanceTransformsComputed.exchange(0);
+    int instanceTransformsPatched = _instanceTransformsPatched.exchange(0);
+    size_t instanceTransformsPatchedInstances = _instanceTransformsPatchedInstances.exchange(0);
+    if (instanceTransformsCached + instanceTransformsComputed + instanceTransformsPatched > 0)
+    {
+        _instanceTransformsLookups[0] = instanceTransformsCached;
+        _instanceTransformsLookups[1] = instanceTransformsComputed;
+        _instanceTransformsPatches = instanceTransformsPatched;
+        _instanceTransformsPatchedCount = instanceTransformsPatchedInstances;
+    }
+}
+
+void MyRenderDelegate::_CompileDrawList()
+{
+    std::lock_guard<std::mutex> guard(_rendererMutex);
+
+    _drawList.clear();
+    std::vector<MyMesh*> meshes;
+    for (auto& m : _myMeshes)
+    {
+        MyDrawItem item;
+        if (m.second->getDrawItem(&item))
+        {
+            _drawList.add(std::move(item));
+            meshes.push_back(m.second);
+        }
+    }
+    _drawList.compile();
+    _drawListMeshes.resize(meshes.size());
+    for (size_t i = 0; i < meshes.size(); ++i)
+        _drawListMeshes[i] = meshes[_drawList.addedIndex(i)];
+
+    // same primitives as last time, only their bounds may have moved.
+    if (_drawList.primitiveOffsets() == _bvhOffsets)
+    {
+        runParallel([this]() { _bvh.refit(_drawList.primitiveBounds()); });
+    }
+    else
+    {
+        runParallel([this]() { _bvh.build(_drawList.primitiveBounds()); });
+        _bvhOffsets = _drawList.primitiveOffsets();
+    }
+}
+
+bool MyRenderDelegate::_RefreshDrawList()
+{
+    std::lock_guard<std::mutex> guard(_rendererMutex);
+
+    // meshes have moved but the list is still made of them, in the same
+    // order: no sort, and a refit of the BVH over the same primitives.
+    // Items are copied again even from meshes that didn't sync, those
+    // sharing the geometry of one that did see it change too.
+    for (size_t i = 0; i < _drawListMeshes.size(); ++i)
+    {
+        MyDrawItem item;
+        if (!_drawListMeshes[i]->getDrawItem(&item) || !_drawList.refresh(i, std::move(item)))
+            return false;
+    }
+    runParallel([this]() { _bvh.refit(_drawList.primitiveBounds()); });
+    return true;
+}
+
+void MyRenderDelegate::queryFrustum(pxr::GfMatrix4d const& i_viewProjection, std::vector<uint32_t>* o_primitives) const
+{
+    auto start = std::chrono::high_resolution_clock::now();
+
+    _bvh.queryFrustum(MyFrustum(i_viewProjection), o_primitives);
+    std::sort(o_primitives->begin(), o_primitives->end());
+
+    auto end = std::chrono::high_resolution_clock::now();
+    _cullTimeMs = std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+void MyRenderDelegate::queryRay(pxr::GfVec3f const& i_origin, pxr::GfVec3f const& i_direction, std::vector<uint32_t>* o_primitives) const
+{
+    _bvh.queryRay(i_origin, i_direction, o_primitives);
+    std::sort(o_primitives->begin(), o_primitives->end());
+}
+
+void MyRenderDelegate::recordSync(int64_t i_startUs, int64_t i_endUs)
+{
+    _SyncSpan& span = _syncSpans.local();
+    span.startUs = std::min(span.startUs, i_startUs);
+    span.endUs = std::max(span.endUs, i_endUs);
+    span.prims++;
 }
 
 void MyRenderDelegate::SetRenderSetting(pxr::TfToken const& key, pxr::VtValue const& value)
@@ -103,6 +427,13 @@ void MyRenderDelegate::SetRenderSetting(pxr::TfToken const& key, pxr::VtValue co
     // husk sends a "husk:snapshot" to the renderer to save a snapshot as
     // a checkpoint while it is rendering.
     // it is an opportunity for the delegate to save now.
+
+    HdRenderDelegate::SetRenderSetting(key, value);
+
+    auto it = _settingFunctions.find(key);
+    if (it != _settingFunctions.end())
+        it->second(value);
+    _sceneVersion++;
 }
 
 pxr::VtValue MyRenderDelegate::GetRenderSetting(pxr::TfToken const& key) const
@@ -121,13 +452,16 @@ pxr::HdRprim* MyRenderDelegate::CreateRprim(pxr::TfToken const& typeId, pxr::Sdf
 {
     if (typeId == pxr::HdPrimTypeTokens->mesh)
     {
-        return new MyMesh(rprimId, this);
+        MyMesh* mesh = new MyMesh(rprimId, this);
+        _AddMesh(rprimId, mesh);
+        return mesh;
     }
     return nullptr;
 }
 
 void MyRenderDelegate::DestroyRprim(pxr::HdRprim* rPrim)
 {
+    _RemoveMesh(rPrim->GetId());
     delete rPrim;
 }
 
@@ -174,11 +508,13 @@ void MyRenderDelegate::DestroyBprim(pxr::HdBprim* bPrim)
 
 pxr::HdInstancer* MyRenderDelegate::CreateInstancer(pxr::HdSceneDelegate* delegate, pxr::SdfPath const& id)
 {
+    _AddInstancer(id);
     return new MyInstancer(delegate, id, this);
 }
 
 void MyRenderDelegate::DestroyInstancer(pxr::HdInstancer* instancer)
 {
+    _RemoveInstancer(instancer->GetId());
     delete instancer;
 }
 
@@ -189,30 +525,233 @@ pxr::HdRenderParam* MyRenderDelegate::GetRenderParam() const
 
 pxr::HdAovDescriptor MyRenderDelegate::GetDefaultAovDescriptor(pxr::TfToken const& name) const
 {
+    // everything the render pass G-buffer has, in the formats it reads
+    // them back in (but half float color).
     if (name == pxr::HdAovTokens->color)
     {
         return pxr::HdAovDescriptor(pxr::HdFormatFloat16Vec4, false, pxr::VtValue(pxr::GfVec4f(0.0f)));
     }
+    else if (name == pxr::HdAovTokens->depth)
+    {
+        return pxr::HdAovDescriptor(pxr::HdFormatFloat32, false, pxr::VtValue(1.0f));
+    }
+    else if (name == pxr::HdAovTokens->primId ||
+        name == pxr::HdAovTokens->instanceId ||
+        name == pxr::HdAovTokens->elementId)
+    {
+        return pxr::HdAovDescriptor(pxr::HdFormatInt32, false, pxr::VtValue(-1));
+    }
 
     return pxr::HdAovDescriptor(pxr::HdFormatInvalid, false, pxr::VtValue());
 }
 
-bool MyRenderDelegate::UpdateScene()
+void MyRenderDelegate::setShutter(double i_open, double i_close)
+{
+    if (i_open == _shutterOpen && i_close == _shutterClose)
+        return;
+    _shutterOpen = i_open;
+    _shutterClose = i_close;
+    _UpdateMotionTimes();
+}
+
+void MyRenderDelegate::_SetThreadLimit(int i_limit)
+{
+    const int available = tbb::this_task_arena::max_concurrency();
+    const int threads = i_limit > 0 ? std::min(i_limit, available) : std::max(available + i_limit, 1);
+
+    // an arena in use keeps going until its work is done, new work goes
+    // to the new one.
+    std::shared_ptr<tbb::task_arena> arena;
+    if (threads < available)
+        arena = std::make_shared<tbb::task_arena>(threads);
+    std::atomic_store(&_arena, arena);
+}
+
+int MyRenderDelegate::threadCount() const
+{
+    std::shared_ptr<tbb::task_arena> arena = std::atomic_load(&_arena);
+    return arena ? arena->max_concurrency() : tbb::this_task_arena::max_concurrency();
+}
+
+void MyRenderDelegate::_UpdateMotionTimes()
+{
+    // the middle of N equal slices of the shutter, each subframe then
+    // weighs the same in the accumulation (a box filter).
+    std::vector<float> times;
+    if (_motionSamples > 1 && _shutterClose > _shutterOpen)
+    {
+        times.resize(_motionSamples);
+        for (int k = 0; k < _motionSamples; ++k)
+            times[k] = float(_shutterOpen + (_shutterClose - _shutterOpen) * (k + 0.5) / _motionSamples);
+    }
+
+    if (times != _motionTimes)
+    {
+        _motionTimes = times;
+        _motionVersion++;
+    }
+}
+
+void MyRenderDelegate::_ReleaseGLObjects()
+{
+    std::lock_guard<std::mutex> guard(_releasedBuffersMutex);
+    if (!_releasedBuffers.empty())
+    {
+        glDeleteBuffers(GLsizei(_releasedBuffers.size()), _releasedBuffers.data());
+        _releasedBuffers.clear();
+    }
+    if (!_releasedTextures.empty())
+    {
+        glDeleteTextures(GLsizei(_releasedTextures.size()), _releasedTextures.data());
+        _releasedTextures.clear();
+    }
+    if (!_releasedRenderbuffers.empty())
+    {
+        glDeleteRenderbuffers(GLsizei(_releasedRenderbuffers.size()), _releasedRenderbuffers.data());
+        _releasedRenderbuffers.clear();
+    }
+    if (!_releasedFramebuffers.empty())
+    {
+        glDeleteFramebuffers(GLsizei(_releasedFramebuffers.size()), _releasedFramebuffers.data());
+        _releasedFramebuffers.clear();
+    }
+    if (!_releasedVertexArrays.empty())
+    {
+        glDeleteVertexArrays(GLsizei(_releasedVertexArrays.size()), _releasedVertexArrays.data());
+        _releasedVertexArrays.clear();
+    }
+    for (GLsync s : _releasedSyncs)
+        glDeleteSync(s);
+    _releasedSyncs.clear();
+}
+
+void MyRenderDelegate::recordFirstPixel()
+{
+    if (_firstPixelMs.load() >= 0.0)
+        return;
+    auto now = std::chrono::high_resolution_clock::now();
+    const double firstPixelMs = std::chrono::duration<double, std::milli>(now - _createdTime).count();
+    double pending = -1.0;
+    if (!_firstPixelMs.compare_exchange_strong(pending, firstPixelMs))
+        return;
+
+    // one line to compare runs with and without badgl:programCache, see
+    // the README.
+    double programsMs = 0.0;
+    size_t programsLoaded = 0;
+    size_t programsCompiled = 0;
+    MyShaderPrograms::stats(&programsMs, &programsLoaded, &programsCompiled);
+    std::cout << "first pixel " << firstPixelMs << " ms after the delegate was created, programs "
+        << programsMs << " ms (" << programsLoaded << " from cache, " << programsCompiled << " compiled, cache "
+        << (_programCacheDir.empty() ? std::string("off") : _programCacheDir) << ")" << std::endl;
+}
+
+bool MyRenderDelegate::UpdateScene(std::vector<uint32_t> const& i_visiblePrimitives, pxr::GfMatrix4d const& i_view,
+    pxr::GfMatrix4d const& i_projection, double i_pixelScale, size_t i_motionSample)
 {
     bool updated = false;
 
+    auto start = std::chrono::high_resolution_clock::now();
+
+    _ReleaseGLObjects();
+
     // your scene rendered/updated/etc
 
-    for (std::map<pxr::SdfPath, MyMesh*>::iterator it = _myMeshes.begin(); it != _myMeshes.end(); ++it)
+    MyInstanceLod lod;
+    if (_useInstanceLod)
+    {
+        lod.viewProjection = i_view * i_projection;
+        lod.pixelScale = i_pixelScale;
+        lod.decimatedSize = _instanceLodDecimatedSize;
+        lod.pointSize = _instanceLodPointSize;
+    }
+    _drawList.draw(i_view, i_projection, i_visiblePrimitives, lod, i_motionSample);
+
+    auto end = std::chrono::high_resolution_clock::now();
+    _drawTimeMs = std::chrono::duration<double, std::milli>(end - start).count();
+
+    return updated;
+}
+
+std::shared_ptr<pxr::Hd_VertexAdjacency> MyRenderDelegate::acquireAdjacency(pxr::HdMeshTopology const& i_topology)
+{
+    const pxr::HdTopology::ID key = i_topology.ComputeHash();
     {
-        if (&it)
+        std::lock_guard<std::mutex> guard(_adjacencyMutex);
+        auto it = _adjacencies.find(key);
+        if (it != _adjacencies.end() && it->second.topology == i_topology)
         {
-            it->second->drawGL();
+            if (auto adjacency = it->second.adjacency.lock())
+                return adjacency;
         }
     }
 
+    // build outside the lock, so meshes with different topologies don't
+    // wait on each other.
+    auto adjacency = std::make_shared<pxr::Hd_VertexAdjacency>();
+    adjacency->BuildAdjacencyTable(&i_topology);
 
-    return updated;
+    std::lock_guard<std::mutex> guard(_adjacencyMutex);
+    _AdjacencyEntry& entry = _adjacencies[key];
+    if (auto existing = entry.adjacency.lock())
+    {
+        // another topology with the same hash holds the entry: ours is
+        // built but not shared.
+        return entry.topology == i_topology ? existing : adjacency;
+    }
+    entry.topology = i_topology;
+    entry.adjacency = adjacency;
+
+    // drop entries whose meshes are all gone.
+    for (auto it = _adjacencies.begin(); it != _adjacencies.end();)
+    {
+        if (it->second.adjacency.expired())
+            it = _adjacencies.erase(it);
+        else
+            ++it;
+    }
+    return adjacency;
+}
+
+std::shared_ptr<MyGeometry> MyRenderDelegate::acquireGeometry(MyGeometryKey const& i_key,
+    std::shared_ptr<MyGeometry> const& i_current, bool* o_needsBuild)
+{
+    std::lock_guard<std::mutex> guard(_geometryMutex);
+
+    auto& slot = _geometries[i_key];
+    if (auto existing = slot.lock())
+    {
+        *o_needsBuild = false;
+        return existing;
+    }
+
+    *o_needsBuild = true;
+
+    // strong references only live in meshes, and new ones are only handed
+    // out under this lock, so a count of 1 means the caller is alone.
+    if (i_current && i_current.use_count() == 1)
+    {
+        auto it = _geometries.find(i_current->key);
+        if (it != _geometries.end() && !(it->first == i_key) && it->second.lock() == i_current)
+            _geometries.erase(it);
+        i_current->key = i_key;
+        slot = i_current;
+        return i_current;
+    }
+
+    auto geometry = std::make_shared<MyGeometry>(this);
+    geometry->key = i_key;
+    slot = geometry;
+
+    // drop entries whose meshes are all gone.
+    for (auto it = _geometries.begin(); it != _geometries.end();)
+    {
+        if (it->second.expired())
+            it = _geometries.erase(it);
+        else
+            ++it;
+    }
+    return geometry;
 }
 
 pxr::VtDictionary MyRenderDelegate::GetRenderStats() const
@@ -225,6 +764,23 @@ pxr::VtDictionary MyRenderDelegate::GetRenderStats() const
 
     std::vector< std::string > lines;
 
+    std::lock_guard<std::mutex> registryGuard(_rendererMutex);
+
+    {
+        std::stringstream tokenStr;
+        tokenStr << "sync time: " << _syncTimeMs << " ms for " << _syncPrimCount << " prims, "
+            << threadCount() << " threads";
+        for (int i = tokenStr.str().size(); i < 100; ++i) tokenStr << " ";
+        lines.emplace_back(tokenStr.str());
+    }
+
+    {
+        std::stringstream tokenStr;
+        tokenStr << "draw items: " << _drawList.size();
+        for (int i = tokenStr.str().size(); i < 100; ++i) tokenStr << " ";
+        lines.emplace_back(tokenStr.str());
+    }
+
     {
         std::stringstream tokenStr;
         tokenStr << "meshes: " << _myMeshes.size();
@@ -241,6 +797,13 @@ pxr::VtDictionary MyRenderDelegate::GetRenderStats() const
         }
     }
 
+    {
+        std::stringstream tokenStr;
+        tokenStr << "draw time: " << _drawTimeMs << " ms";
+        for (int i = tokenStr.str().size(); i < 100; ++i) tokenStr << " ";
+        lines.emplace_back(tokenStr.str());
+    }
+
     {
         size_t instances = 0;
         for (auto& m : _myMeshes)
@@ -253,16 +816,165 @@ pxr::VtDictionary MyRenderDelegate::GetRenderStats() const
 
     {
         std::stringstream tokenStr;
-        tokenStr << "dataSharingIds: " << _dataSharingIds.size();
+        tokenStr << "culled: " << _drawList.culledItems() << " draw items, "
+            << _drawList.culledInstances() << " instances ("
+            << _drawList.drawnInstances() << " instances drawn) in " << _cullTimeMs << " ms";
+        for (int i = tokenStr.str().size(); i < 100; ++i) tokenStr << " ";
+        lines.emplace_back(tokenStr.str());
+    }
+
+    {
+        std::stringstream tokenStr;
+        tokenStr << "instance lod: " << _drawList.lodInstances(MyInstanceLod::LevelFull) << " full, "
+            << _drawList.lodInstances(MyInstanceLod::LevelDecimated) << " decimated, "
+            << _drawList.lodInstances(MyInstanceLod::LevelPoint) << " points";
+        if (!_useInstanceLod)
+            tokenStr << " (off)";
+        for (int i = tokenStr.str().size(); i < 100; ++i) tokenStr << " ";
+        lines.emplace_back(tokenStr.str());
+    }
+
+    {
+        std::stringstream tokenStr;
+        tokenStr << "bvh: " << _bvh.nodeCount() << " nodes over " << _bvh.size() << " primitives, "
+            << (_bvh.refitted() ? "refit" : "build") << " " << _bvh.updateTimeMs() << " ms";
+        for (int i = tokenStr.str().size(); i < 100; ++i) tokenStr << " ";
+        lines.emplace_back(tokenStr.str());
+    }
+
+    {
+        std::stringstream tokenStr;
+        tokenStr << "normals time: " << _normalsTimeMs << " ms ("
+            << (_useHdSmoothNormals ? "Hd_SmoothNormals" : "MySmoothNormals") << ")";
+        for (int i = tokenStr.str().size(); i < 100; ++i) tokenStr << " ";
+        lines.emplace_back(tokenStr.str());
+    }
+
+    {
+        std::stringstream tokenStr;
+        tokenStr << "instance transforms: " << _instanceTransformsTimeMs << " ms for "
+            << _instanceTransformsComposed << " instances ("
+            << (_useLegacyInstanceTransforms ? "legacy" : "MyInstanceTransforms") << ")";
+        for (int i = tokenStr.str().size(); i < 100; ++i) tokenStr << " ";
+        lines.emplace_back(tokenStr.str());
+    }
+
+    {
+        std::stringstream tokenStr;
+        tokenStr << "instance transforms cache: " << _instanceTransformsLookups[0] << " prototypes cached, "
+            << _instanceTransformsLookups[1] << " computed, " << _instanceTransformsPatches << " patched ("
+            << _instanceTransformsPatchedCount << " instances changed)";
+        for (int i = tokenStr.str().size(); i < 100; ++i) tokenStr << " ";
+        lines.emplace_back(tokenStr.str());
+    }
+
+    if (_motionSamples > 1)
+    {
+        std::stringstream tokenStr;
+        tokenStr << "motion blur: " << _motionSubframes << " subframes";
+        if (!_motionTimes.empty())
+            tokenStr << " over shutter [" << _shutterOpen << ", " << _shutterClose << "]";
+        tokenStr << ", frame " << _motionFrameTimeMs << " ms";
+        for (int i = tokenStr.str().size(); i < 100; ++i) tokenStr << " ";
+        lines.emplace_back(tokenStr.str());
+    }
+
+    {
+        std::stringstream tokenStr;
+        tokenStr << "gl: " << (_glRenderer.empty() ? "none" : _glRenderer) << ", "
+            << (_offscreenContext ? std::string(_offscreenContext->backendName()) + " offscreen" : std::string("host"))
+            << " context";
+        for (int i = tokenStr.str().size(); i < 100; ++i) tokenStr << " ";
+        lines.emplace_back(tokenStr.str());
+    }
+
+    {
+        double programsMs = 0.0;
+        size_t programsLoaded = 0;
+        size_t programsCompiled = 0;
+        MyShaderPrograms::stats(&programsMs, &programsLoaded, &programsCompiled);
+        std::stringstream tokenStr;
+        tokenStr << "programs: " << programsMs << " ms, " << programsLoaded << " from cache, "
+            << programsCompiled << " compiled, first pixel ";
+        const double firstPixelMs = _firstPixelMs.load();
+        if (firstPixelMs >= 0.0)
+            tokenStr << firstPixelMs << " ms";
+        else
+            tokenStr << "pending";
+        if (_programCacheDir.empty())
+            tokenStr << ", cache off";
+        for (int i = tokenStr.str().size(); i < 100; ++i) tokenStr << " ";
+        lines.emplace_back(tokenStr.str());
+    }
+
+    {
+        std::stringstream tokenStr;
+        tokenStr << "readback: " << (_useAsyncReadback ? "async" : "glReadPixels") << ", stalled "
+            << _readbackStallMs << " ms";
+        if (_useAsyncReadback)
+            tokenStr << ", latency " << _readbackLatencyMs << " ms";
+        for (int i = tokenStr.str().size(); i < 100; ++i) tokenStr << " ";
+        lines.emplace_back(tokenStr.str());
+    }
+
+    {
+        // entries outlive their tables until the next insertion prunes
+        // them, count only the live ones.
+        size_t adjacencies = 0;
+        {
+            std::lock_guard<std::mutex> guard(_adjacencyMutex);
+            for (auto& a : _adjacencies)
+                if (a.second.adjacency.lock())
+                    adjacencies++;
+        }
+        std::stringstream tokenStr;
+        tokenStr << "adjacency tables: " << adjacencies;
         for (int i = tokenStr.str().size(); i < 100; ++i) tokenStr << " ";
         lines.emplace_back(tokenStr.str());
     }
 
     {
-        for (auto& d : _dataSharingIds)
+        std::lock_guard<std::mutex> guard(_geometryMutex);
+
+        size_t geometries = 0;
+        size_t users = 0;
+        size_t savedBytes = 0;
+        std::vector<std::pair<pxr::SdfPath, long>> dataSharingIds;
+        for (auto& g : _geometries)
+        {
+            auto geometry = g.second.lock();
+            if (!geometry)
+                continue;
+            // one reference is ours, the others are meshes
+            long count = geometry.use_count() - 1;
+            if (count <= 0)
+                continue;
+            geometries++;
+            users += count;
+            savedBytes += geometry->byteSize() * (count - 1);
+            if (!g.first.dataSharingId.IsEmpty())
+                dataSharingIds.emplace_back(g.first.dataSharingId, count);
+        }
+
         {
             std::stringstream tokenStr;
-            tokenStr << " - " << d.GetText();
+            tokenStr << "geometries: " << geometries << " for " << users << " meshes, saved "
+                << savedBytes / (1024.0 * 1024.0) << " MB";
+            for (int i = tokenStr.str().size(); i < 100; ++i) tokenStr << " ";
+            lines.emplace_back(tokenStr.str());
+        }
+
+        {
+            std::stringstream tokenStr;
+            tokenStr << "dataSharingIds: " << dataSharingIds.size();
+            for (int i = tokenStr.str().size(); i < 100; ++i) tokenStr << " ";
+            lines.emplace_back(tokenStr.str());
+        }
+
+        for (auto& d : dataSharingIds)
+        {
+            std::stringstream tokenStr;
+            tokenStr << " - " << d.first.GetText() << " x" << d.second;
             for (int i = tokenStr.str().size(); i < 100; ++i) tokenStr << " ";
             lines.emplace_back(tokenStr.str());
         }
@@ -375,30 +1087,6 @@ pxr::VtDictionary MyRenderDelegate::GetRenderStats() const
         }
     }
 
-    bool drawBuffer = false;
-    if (drawBuffer)
-    {
-        for (int i = lines.size(); i < height; ++i)
-        {
-            lines.emplace_back(std::string());
-        }
-        
-        std::string grad = " .:x#";
-        for (int y = 0; y < height; ++y)
-        {
-            std::stringstream tokenStr;
-            for (int x = 0; x < width; ++x)
-            {
-                int mapx = x * _pixelsWidth / width;
-                int mapy = (height-y-1) * _pixelsHeight / height;
-                float red = _pixelsData[(mapy * _pixelsWidth + mapx) * 4];
-                int mapred = red * (grad.size() - 1);
-                tokenStr << grad[mapred];
-            }
-            lines[y] = tokenStr.str();
-        }
-    }
-
     int gap = (height) - lines.size();
     for (int i = 0; i < height; ++i)
     {
@@ -410,7 +1098,10 @@ pxr::VtDictionary MyRenderDelegate::GetRenderStats() const
 
 
     //const auto& stokens = HusdHdRenderStatsTokens();
-    stats[pxr::TfToken("ttfp")] = pxr::VtValue(444);
+    // in seconds, like the other renderers report it, once there is one.
+    const double firstPixelMs = _firstPixelMs.load();
+    if (firstPixelMs >= 0.0)
+        stats[pxr::TfToken("ttfp")] = pxr::VtValue(firstPixelMs / 1000.0);
     stats[pxr::TfToken("cameraCounts")] = pxr::VtValue(333);
     stats[pxr::TfToken("system_memory")] = pxr::VtValue(222);
     stats[pxr::TfToken("system_time")] = pxr::VtValue(111);
@@ -7,10 +7,42 @@
 #include <pxr/imaging/hd/renderThread.h>
 #include <pxr/base/tf/staticTokens.h>
 #include <pxr/base/gf/vec2f.h>
+#include <pxr/base/gf/matrix4d.h>
+
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/task_arena.h>
 
 #include <map>
+#include <memory>
+#include <set>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
+#include <vector>
 
 #include "mesh.h"
+#include "bvh.h"
+#include "offscreenContext.h"
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+#define MY_RENDER_SETTINGS_TOKENS \
+    ((hdSmoothNormals, "badgl:hdSmoothNormals")) \
+    ((legacyInstanceTransforms, "badgl:legacyInstanceTransforms")) \
+    ((factoredNestedInstances, "badgl:factoredNestedInstances")) \
+    ((motionSamples, "badgl:motionSamples")) \
+    ((framesPerSecond, "badgl:framesPerSecond")) \
+    ((instanceLod, "badgl:instanceLod")) \
+    ((instanceLodDecimatedSize, "badgl:instanceLodDecimatedSize")) \
+    ((instanceLodPointSize, "badgl:instanceLodPointSize")) \
+    ((asyncReadback, "badgl:asyncReadback")) \
+    ((offscreenContext, "badgl:offscreenContext")) \
+    ((programCache, "badgl:programCache")) \
+    ((programCacheDir, "badgl:programCacheDir"))
+
+TF_DECLARE_PUBLIC_TOKENS(MyRenderSettingsTokens, MY_RENDER_SETTINGS_TOKENS);
+
+PXR_NAMESPACE_CLOSE_SCOPE
 
 using UpdateRenderSettingFunction = std::function<bool(pxr::VtValue const& value)>;
 
@@ -58,60 +90,258 @@ public:
     std::mutex& rendererMutex() { return _rendererMutex; }
     std::mutex& primIndexMutex() { return _primIndexMutex; }
 
-    bool UpdateScene();
+    // Draw what is visible through i_view and i_projection, i_pixelScale
+    // being the pixels a world unit covers at w = 1 (see MyInstanceLod).
+    bool UpdateScene(std::vector<uint32_t> const& i_visiblePrimitives, pxr::GfMatrix4d const& i_view,
+        pxr::GfMatrix4d const& i_projection, double i_pixelScale, size_t i_motionSample = 0);
+
+    // Spatial queries over the scene BVH, rebuilt or refitted in
+    // CommitResources. Primitives are the draw list ones, one per mesh or
+    // per instance, and come back sorted in draw order.
+    void queryFrustum(pxr::GfMatrix4d const& i_viewProjection, std::vector<uint32_t>* o_primitives) const;
+    void queryRay(pxr::GfVec3f const& i_origin, pxr::GfVec3f const& i_direction, std::vector<uint32_t>* o_primitives) const;
+
+    // Flag the draw list for recompilation at the next CommitResources:
+    // a mesh draws something else (another geometry, state or instancing)
+    // or starts or stops drawing.
+    void markSceneChanged() { _drawListDirty.store(true); }
+    // What meshes draw moved or deformed, the draw list is the same: its
+    // items are refreshed and the BVH refitted at the next
+    // CommitResources, or everything recompiled if an item doesn't fit
+    // anymore.
+    void markDrawItemsChanged() { _drawItemsDirty.store(true); }
+
+    // Prim sync timing: each MyMesh/MyInstancer Sync reports its span, kept
+    // per thread so the parallel sync shares nothing, and CommitResources
+    // turns the earliest start / latest end into the wall time of the
+    // whole sync phase.
+    void recordSync(int64_t i_startUs, int64_t i_endUs);
+
+    // GL objects can only be deleted with the context current, so rprims
+    // going away queue theirs here and UpdateScene releases them.
+    void releaseBuffers(std::initializer_list<GLuint> i_buffers)
+    {
+        std::lock_guard<std::mutex> guard(_releasedBuffersMutex);
+        for (GLuint b : i_buffers)
+            if (b != 0)
+                _releasedBuffers.push_back(b);
+    }
 
-    void addMesh(const pxr::SdfPath& i_path, MyMesh* i_mesh)
+    void releaseTextures(std::initializer_list<GLuint> i_textures)
     {
-        _myMeshes[i_path] = i_mesh;
+        std::lock_guard<std::mutex> guard(_releasedBuffersMutex);
+        for (GLuint t : i_textures)
+            if (t != 0)
+                _releasedTextures.push_back(t);
     }
-    void removeMesh(const pxr::SdfPath& i_path)
+
+    void releaseRenderbuffers(std::initializer_list<GLuint> i_renderbuffers)
     {
-        if (_myMeshes.find(i_path) != _myMeshes.end())
-            _myMeshes.erase(i_path);
+        std::lock_guard<std::mutex> guard(_releasedBuffersMutex);
+        for (GLuint r : i_renderbuffers)
+            if (r != 0)
+                _releasedRenderbuffers.push_back(r);
     }
 
-    void addDataSharingId(const pxr::SdfPath& i_path)
+    void releaseFramebuffers(std::initializer_list<GLuint> i_framebuffers)
     {
-        _dataSharingIds.insert(i_path);
+        std::lock_guard<std::mutex> guard(_releasedBuffersMutex);
+        for (GLuint f : i_framebuffers)
+            if (f != 0)
+                _releasedFramebuffers.push_back(f);
     }
-    void removeDataSharingId(const pxr::SdfPath& i_path)
+
+    void releaseVertexArrays(std::initializer_list<GLuint> i_vertexArrays)
     {
-        if (_dataSharingIds.find(i_path) != _dataSharingIds.end())
-            _dataSharingIds.erase(i_path);
+        std::lock_guard<std::mutex> guard(_releasedBuffersMutex);
+        for (GLuint v : i_vertexArrays)
+            if (v != 0)
+                _releasedVertexArrays.push_back(v);
     }
 
-    void addInstancerId(const pxr::SdfPath& i_path)
+    void releaseSyncs(std::initializer_list<GLsync> i_syncs)
     {
-        _instancerIds.insert(i_path);
+        std::lock_guard<std::mutex> guard(_releasedBuffersMutex);
+        for (GLsync s : i_syncs)
+            if (s != nullptr)
+                _releasedSyncs.push_back(s);
     }
-    void removeInstancer(const pxr::SdfPath& i_path)
+
+    // Return the geometry cached under i_key if any mesh still holds it.
+    // Otherwise i_current is re-keyed when the caller is its only user, or
+    // a new geometry is created, and *o_needsBuild is set: the caller must
+    // then fill it before the end of the sync.
+    std::shared_ptr<MyGeometry> acquireGeometry(MyGeometryKey const& i_key,
+        std::shared_ptr<MyGeometry> const& i_current, bool* o_needsBuild);
+
+    // Return the vertex adjacency for the given topology, building it only
+    // if no other mesh with the same topology is holding one already. A
+    // different topology with the same hash gets a table of its own.
+    std::shared_ptr<pxr::Hd_VertexAdjacency> acquireAdjacency(pxr::HdMeshTopology const& i_topology);
+
+    // Incremented once per CommitResources, identifies the current sync.
+    size_t syncEpoch() const { return _syncEpoch.load(); }
+
+    // When set, normals go through Hd_SmoothNormals instead of
+    // MySmoothNormals, to compare both engines on the same scene.
+    bool useHdSmoothNormals() const { return _useHdSmoothNormals; }
+
+    // Time spent computing normals, accumulated over a sync by all meshes.
+    void addNormalsTime(int64_t i_microseconds) { _normalsTimeUs.fetch_add(i_microseconds); }
+
+    // When set, instancers compose their transforms primvar by primvar in
+    // GfMatrix4d as they used to, instead of with MyInstanceTransforms.
+    bool useLegacyInstanceTransforms() const { return _useLegacyInstanceTransforms; }
+
+    // Instance LOD: with badgl:instanceLod, instances smaller on screen
+    // than badgl:instanceLodDecimatedSize pixels are drawn with decimated
+    // geometry, smaller than badgl:instanceLodPointSize as points.
+    bool useInstanceLod() const { return _useInstanceLod; }
+
+    // When set, meshes under nested instancers keep their instances
+    // factored (parents x children) instead of flattening them.
+    bool useFactoredNestedInstances() const { return _useFactoredNestedInstances; }
+
+    // Motion blur: badgl:motionSamples subframes spread over the shutter
+    // interval of the camera rendered through, in frames relative to the
+    // current one. Empty when off (one sample, or a closed shutter).
+    std::vector<float> const& motionSampleTimes() const { return _motionTimes; }
+    // Bumped whenever motionSampleTimes changes; instanced meshes need a
+    // sync to pick the new times up: CommitResources marks the instancers
+    // dirty for it, motionPending() until the next sync is done.
+    size_t motionVersion() const { return _motionVersion.load(); }
+    bool motionPending() const { return _motionVersion.load() != _motionSyncedVersion.load(); }
+    void setShutter(double i_open, double i_close);
+    // to turn velocities (per second) into per frame motion.
+    float framesPerSecond() const { return _framesPerSecond; }
+    // Subframes the last frame was rendered with and its total time.
+    void recordMotionBlur(size_t i_subframes, double i_frameTimeMs)
     {
-        if (_instancerIds.find(i_path) != _instancerIds.end())
-            _instancerIds.erase(i_path);
+        _motionSubframes = i_subframes;
+        _motionFrameTimeMs = i_frameTimeMs;
     }
 
-    pxr::VtDictionary GetRenderStats() const;
+    // Bumped whenever what a frame shows may have changed: a new draw
+    // list or a render setting. The camera and AOVs are up to the pass.
+    size_t sceneVersion() const { return _sceneVersion.load(); }
+
+    // When set (the default), frames are read back through a ring of
+    // pixel pack buffers and picked up once the GPU is done, instead of
+    // with a glReadPixels waiting for it.
+    bool useAsyncReadback() const { return _useAsyncReadback; }
+    // Time the last frame blocked on its readback and, for async ones,
+    // from its submission to its pixels being there.
+    void recordReadback(double i_stallMs, double i_latencyMs)
+    {
+        _readbackStallMs = i_stallMs;
+        _readbackLatencyMs = i_latencyMs;
+    }
+    // The first frame is in the AOVs: time to first pixel, from the
+    // creation of the delegate, printed with what building the programs
+    // took of it. Only the first call counts.
+    void recordFirstPixel();
+
+    // TBB work of the sync (instance transforms and bounds, normals, the
+    // BVH) runs in an arena of at most threadLimit threads when one is set
+    // (husk --threads), in the caller's arena otherwise. It is isolated
+    // too: a thread waiting on it won't pick up another prim's sync, which
+    // could block on a mutex the caller holds. Don't lock in i_work.
+    // The cap is only ours: Hydra's parallel sync of the prims around this
+    // work runs on the host's scheduler, which husk --threads limits
+    // itself, and is left alone (no tbb::global_control in a delegate).
+    template <typename F>
+    void runParallel(F const& i_work) const
+    {
+        std::shared_ptr<tbb::task_arena> arena = std::atomic_load(&_arena);
+        if (arena)
+            arena->execute([&i_work]() { tbb::this_task_arena::isolate(i_work); });
+        else
+            tbb::this_task_arena::isolate(i_work);
+    }
+    // Threads runParallel uses, what the stats report.
+    int threadCount() const;
 
+    std::set<pxr::SdfPath> instancerIds() const
+    {
+        std::lock_guard<std::mutex> guard(_rendererMutex);
+        return _instancerIds;
+    }
 
-    bool ValidPixels(int w, int h) 
+    // Time spent composing instance transforms over a sync, and for how
+    // many instances.
+    void addInstanceTransformsTime(int64_t i_microseconds, size_t i_count)
     {
-        if (_pixelsData == nullptr || w != _pixelsWidth || h != _pixelsHeight)
-            return false;
-        return true;
+        _instanceTransformsTimeUs.fetch_add(i_microseconds);
+        _instanceTransformsCount.fetch_add(i_count);
     }
-    float* GetPixels() { return _pixelsData; }
-    void ResetPixels( int w, int h ) 
+
+    // Prototypes asking their instancer for transforms, and whether its
+    // per-prototype cache had them.
+    void addInstanceTransformsLookup(bool i_cached)
+    {
+        (i_cached ? _instanceTransformsCached : _instanceTransformsComputed).fetch_add(1);
+    }
+
+    // Prototypes whose transforms were patched in place rather than
+    // recomputed, and how many of their instances changed.
+    void addInstanceTransformsPatch(size_t i_changedInstances)
     {
-        if (_pixelsData != nullptr)
-            delete[] _pixelsData;
-        _pixelsWidth = w;
-        _pixelsHeight = h;
-        _pixelsData = new float[_pixelsWidth * _pixelsHeight * 4];
+        _instanceTransformsPatched.fetch_add(1);
+        _instanceTransformsPatchedInstances.fetch_add(i_changedInstances);
     }
 
+    // Our own GL context when the host has none current (husk on farm
+    // blades), null when rendering in the host's. badgl:offscreenContext
+    // picks its backend: "egl", "osmesa", or unset for the first that
+    // works. The pass makes it current around its GL work.
+    MyOffscreenContext* offscreenContext() const { return _offscreenContext.get(); }
+
+    pxr::VtDictionary GetRenderStats() const;
+
 private:
     void _Initialize();
 
+    // Delete the GL objects queued by the release* methods, with the
+    // context current.
+    void _ReleaseGLObjects();
+
+    // Meshes and instancers are registered from Create*/Destroy*, which
+    // the render index calls serially from the main thread, so the prims'
+    // Sync (run in parallel by Hydra) never has to touch these.
+    void _AddMesh(const pxr::SdfPath& i_path, MyMesh* i_mesh)
+    {
+        std::lock_guard<std::mutex> guard(_rendererMutex);
+        _myMeshes[i_path] = i_mesh;
+        markSceneChanged();
+    }
+    void _RemoveMesh(const pxr::SdfPath& i_path)
+    {
+        std::lock_guard<std::mutex> guard(_rendererMutex);
+        _myMeshes.erase(i_path);
+        markSceneChanged();
+    }
+
+    // Rebuild _drawList from the registered meshes.
+    void _CompileDrawList();
+    // Copy the items of _drawList again from their meshes and refit the
+    // BVH, false when the list has to be compiled again.
+    bool _RefreshDrawList();
+
+    // Recompute _motionTimes from the settings and the shutter.
+    void _UpdateMotionTimes();
+    void _SetThreadLimit(int i_limit);
+
+    void _AddInstancer(const pxr::SdfPath& i_path)
+    {
+        std::lock_guard<std::mutex> guard(_rendererMutex);
+        _instancerIds.insert(i_path);
+    }
+    void _RemoveInstancer(const pxr::SdfPath& i_path)
+    {
+        std::lock_guard<std::mutex> guard(_rendererMutex);
+        _instancerIds.erase(i_path);
+    }
+
     static const pxr::TfTokenVector SUPPORTED_RPRIM_TYPES;
     static const pxr::TfTokenVector SUPPORTED_SPRIM_TYPES;
     static const pxr::TfTokenVector SUPPORTED_BPRIM_TYPES;
@@ -120,19 +350,114 @@ private:
     static std::atomic_int _counterResourceRegistry;
     static pxr::HdResourceRegistrySharedPtr _resourceRegistry;
 
-    std::mutex _rendererMutex;
+    mutable std::mutex _rendererMutex;
     std::mutex _primIndexMutex;
 
-    static float* _pixelsData;
-    static int _pixelsWidth;
-    static int _pixelsHeight;
-
     std::map<pxr::TfToken, UpdateRenderSettingFunction> _settingFunctions;
 
-    static std::map<pxr::SdfPath, MyMesh*> _myMeshes;
+    std::map<pxr::SdfPath, MyMesh*> _myMeshes;
+
+    std::set<pxr::SdfPath> _instancerIds;
+
+    MyDrawList _drawList;
+    // the mesh of each draw list item.
+    std::vector<MyMesh*> _drawListMeshes;
+    // over the draw list primitives, and the layout it was built for.
+    MyBvh _bvh;
+    std::vector<uint32_t> _bvhOffsets;
+    mutable double _cullTimeMs;
+    std::atomic<bool> _drawListDirty;
+    std::atomic<bool> _drawItemsDirty;
 
-    static std::set<pxr::SdfPath> _dataSharingIds;
-    static std::set<pxr::SdfPath> _instancerIds;
+    struct _SyncSpan
+    {
+        int64_t startUs = INT64_MAX;
+        int64_t endUs = 0;
+        int prims = 0;
+    };
+    tbb::enumerable_thread_specific<_SyncSpan> _syncSpans;
+    double _syncTimeMs;
+    int _syncPrimCount;
+
+    std::mutex _releasedBuffersMutex;
+    std::vector<GLuint> _releasedBuffers;
+    std::vector<GLuint> _releasedTextures;
+    std::vector<GLuint> _releasedRenderbuffers;
+    std::vector<GLuint> _releasedFramebuffers;
+    std::vector<GLuint> _releasedVertexArrays;
+    std::vector<GLsync> _releasedSyncs;
+
+    std::atomic<size_t> _syncEpoch;
+    mutable std::mutex _geometryMutex;
+    std::unordered_map<MyGeometryKey, std::weak_ptr<MyGeometry>, MyGeometryKey::HashFunctor> _geometries;
+
+    // by topology hash, with the topology the table was built from to
+    // tell collisions apart.
+    struct _AdjacencyEntry
+    {
+        pxr::HdMeshTopology topology;
+        std::weak_ptr<pxr::Hd_VertexAdjacency> adjacency;
+    };
+    mutable std::mutex _adjacencyMutex;
+    std::unordered_map<pxr::HdTopology::ID, _AdjacencyEntry> _adjacencies;
+
+    double _drawTimeMs;
+
+    bool _useHdSmoothNormals;
+    std::atomic<int64_t> _normalsTimeUs;
+    double _normalsTimeMs;
+
+    bool _useLegacyInstanceTransforms;
+    bool _useFactoredNestedInstances;
+
+    bool _useInstanceLod;
+    float _instanceLodDecimatedSize;
+    float _instanceLodPointSize;
+
+    int _motionSamples;
+    float _framesPerSecond;
+    double _shutterOpen;
+    double _shutterClose;
+    std::vector<float> _motionTimes;
+    std::atomic<size_t> _motionVersion;
+    // motionVersion the instancers were last marked dirty for, and the
+    // one the last sync brought them to.
+    size_t _motionDirtyVersion;
+    std::atomic<size_t> _motionSyncedVersion;
+    size_t _motionSubframes;
+    double _motionFrameTimeMs;
+
+    std::atomic<size_t> _sceneVersion;
+    bool _useAsyncReadback;
+    double _readbackStallMs;
+    double _readbackLatencyMs;
+
+    std::atomic<int64_t> _instanceTransformsTimeUs;
+    std::atomic<size_t> _instanceTransformsCount;
+    double _instanceTransformsTimeMs;
+    size_t _instanceTransformsComposed;
+    std::atomic<int> _instanceTransformsCached;
+    std::atomic<int> _instanceTransformsComputed;
+    int _instanceTransformsLookups[2];
+    std::atomic<int> _instanceTransformsPatched;
+    std::atomic<size_t> _instanceTransformsPatchedInstances;
+    int _instanceTransformsPatches;
+    size_t _instanceTransformsPatchedCount;
+
+    // null when uncapped, swapped atomically by _SetThreadLimit.
+    std::shared_ptr<tbb::task_arena> _arena;
+
+    std::shared_ptr<MyOffscreenContext> _offscreenContext;
+    // GL_RENDERER of the context drawn with.
+    std::string _glRenderer;
+
+    // Where MyShaderPrograms keeps compiled programs, empty when
+    // badgl:programCache is off.
+    std::string _programCacheDir;
+    std::chrono::high_resolution_clock::time_point _createdTime;
+    // -1 until the first frame, written by the render thread, read by
+    // the stats.
+    std::atomic<double> _firstPixelMs;
 
     pxr::HdRenderThread _renderThread;
 
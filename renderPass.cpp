@@ -10,9 +10,19 @@
 #include <pxr/base/gf/quaternion.h>
 #include <pxr/base/gf/matrix3d.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
 #include <iostream>
 #include <bitset>
 
+// Per G-buffer target (see MyRenderPass::_Target): renderbuffer format and
+// how it is read back, 4 bytes a component.
+static const GLenum TARGET_INTERNAL_FORMATS[] = { GL_RGBA16F, GL_R32I, GL_R32I, GL_R32I, GL_DEPTH_COMPONENT32F };
+static const GLenum TARGET_READ_FORMATS[] = { GL_RGBA, GL_RED_INTEGER, GL_RED_INTEGER, GL_RED_INTEGER, GL_DEPTH_COMPONENT };
+static const GLenum TARGET_READ_TYPES[] = { GL_FLOAT, GL_INT, GL_INT, GL_INT, GL_FLOAT };
+static const size_t TARGET_COMPONENTS[] = { 4, 1, 1, 1, 1 };
+
 GLuint CreateVBO(const GLfloat* data, const GLuint size)
 {
     GLuint id;
@@ -22,6 +32,21 @@ GLuint CreateVBO(const GLfloat* data, const GLuint size)
     return id;
 }
 
+void UpdateVBO(const GLuint id, const GLfloat* data, const GLuint size)
+{
+    // re-specify the whole store, so the driver can orphan the old one
+    // instead of waiting on draws still using it.
+    glBindBuffer(GL_ARRAY_BUFFER, id);
+    glBufferData(GL_ARRAY_BUFFER, size, data, GL_DYNAMIC_DRAW);
+}
+
+void UpdateVBORange(const GLuint id, const GLuint offset, const GLfloat* data, const GLuint size)
+{
+    // in place, for small edits of a large buffer.
+    glBindBuffer(GL_ARRAY_BUFFER, id);
+    glBufferSubData(GL_ARRAY_BUFFER, offset, size, data);
+}
+
 void BindVBO(const GLuint idx, const GLuint N, const GLuint id)
 {
     glEnableVertexAttribArray(idx);
@@ -29,6 +54,96 @@ void BindVBO(const GLuint idx, const GLuint N, const GLuint id)
     glVertexAttribPointer(idx, N, GL_FLOAT, GL_FALSE, 0, (void*)0);
 }
 
+GLuint CreateIBO(const GLuint* data, const GLuint size)
+{
+    GLuint id;
+    glGenBuffers(1, &id);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, id);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, size, data, GL_STATIC_DRAW);
+    return id;
+}
+
+void UpdateIBO(const GLuint id, const GLuint* data, const GLuint size)
+{
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, id);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, size, data, GL_STATIC_DRAW);
+}
+
+// What a frame changes of the host's context, put back after it:
+// glPushAttrib is gone from core profile contexts, and would save a lot
+// more than this anyway. Texture buffers are bound on the units of
+// MyDrawList, and on the first one by uploads.
+struct HostState
+{
+    static const int TEXTURE_UNITS = 3;
+
+    GLint drawFrameBuffer = 0;
+    GLint readFrameBuffer = 0;
+    GLint renderbuffer = 0;
+    GLint vertexArray = 0;
+    GLint arrayBuffer = 0;
+    GLint pixelPackBuffer = 0;
+    GLint program = 0;
+    GLint activeTexture = GL_TEXTURE0;
+    GLint textureBuffers[TEXTURE_UNITS] = {};
+    GLint viewport[4] = {};
+    GLboolean depthTest = GL_FALSE;
+    GLboolean scissorTest = GL_FALSE;
+    GLboolean programPointSize = GL_FALSE;
+    GLint depthFunc = GL_LESS;
+    GLboolean depthMask = GL_TRUE;
+    GLboolean colorMask[4] = { GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE };
+
+    void save()
+    {
+        glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &drawFrameBuffer);
+        glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &readFrameBuffer);
+        glGetIntegerv(GL_RENDERBUFFER_BINDING, &renderbuffer);
+        glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &vertexArray);
+        glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &arrayBuffer);
+        glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &pixelPackBuffer);
+        glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+        glGetIntegerv(GL_ACTIVE_TEXTURE, &activeTexture);
+        for (int unit = 0; unit < TEXTURE_UNITS; ++unit)
+        {
+            glActiveTexture(GL_TEXTURE0 + unit);
+            glGetIntegerv(GL_TEXTURE_BINDING_BUFFER, &textureBuffers[unit]);
+        }
+        glActiveTexture(GL_TEXTURE0);
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        depthTest = glIsEnabled(GL_DEPTH_TEST);
+        scissorTest = glIsEnabled(GL_SCISSOR_TEST);
+        programPointSize = glIsEnabled(GL_PROGRAM_POINT_SIZE);
+        glGetIntegerv(GL_DEPTH_FUNC, &depthFunc);
+        glGetBooleanv(GL_DEPTH_WRITEMASK, &depthMask);
+        glGetBooleanv(GL_COLOR_WRITEMASK, colorMask);
+    }
+
+    void restore() const
+    {
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, GLuint(drawFrameBuffer));
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, GLuint(readFrameBuffer));
+        glBindRenderbuffer(GL_RENDERBUFFER, GLuint(renderbuffer));
+        glBindVertexArray(GLuint(vertexArray));
+        glBindBuffer(GL_ARRAY_BUFFER, GLuint(arrayBuffer));
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, GLuint(pixelPackBuffer));
+        glUseProgram(GLuint(program));
+        for (int unit = 0; unit < TEXTURE_UNITS; ++unit)
+        {
+            glActiveTexture(GL_TEXTURE0 + unit);
+            glBindTexture(GL_TEXTURE_BUFFER, GLuint(textureBuffers[unit]));
+        }
+        glActiveTexture(GLenum(activeTexture));
+        glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+        depthTest ? glEnable(GL_DEPTH_TEST) : glDisable(GL_DEPTH_TEST);
+        scissorTest ? glEnable(GL_SCISSOR_TEST) : glDisable(GL_SCISSOR_TEST);
+        programPointSize ? glEnable(GL_PROGRAM_POINT_SIZE) : glDisable(GL_PROGRAM_POINT_SIZE);
+        glDepthFunc(GLenum(depthFunc));
+        glDepthMask(depthMask);
+        glColorMask(colorMask[0], colorMask[1], colorMask[2], colorMask[3]);
+    }
+};
+
 MyRenderPass::MyRenderPass(
     pxr::HdRenderIndex* index, 
     pxr::HdRprimCollection const& collection,
@@ -41,19 +156,48 @@ MyRenderPass::MyRenderPass(
     , _colorBuffer(pxr::SdfPath::EmptyPath())
     , _renderThread(renderThread)
     , _owner(renderDelegate)
-    , shaderCreated(false)
-    , _shaderProgram()
+    , _frameBuffer(0)
     , _gBuffer()
-    , _frameBuffer()
+    , _gBufferSize(0)
+    , _readTargets(0)
+    , _vertexArray(0)
+    , _visiblePrimitives()
+    , _subframePixels()
+    , _readPixels()
+    , _readOffsets()
+    , _readbacks()
+    , _readbackNext(0)
+    , _readbackSceneVersion(size_t(-1))
+    , _readbackStallMs(0.0)
+    , _readbackLatencyMs(0.0)
 {
 }
 
 MyRenderPass::~MyRenderPass()
 {
+    // readbacks still in flight: their fences go too, nobody waits on them.
+    for (_Readback& readback : _readbacks)
+    {
+        _owner->releaseBuffers({ readback.pbo });
+        _owner->releaseSyncs({ readback.fence });
+    }
+    _owner->releaseRenderbuffers({ _gBuffer[TargetColor], _gBuffer[TargetPrimId], _gBuffer[TargetInstanceId],
+        _gBuffer[TargetElementId], _gBuffer[TargetDepth] });
+    _owner->releaseFramebuffers({ _frameBuffer });
+    _owner->releaseVertexArrays({ _vertexArray });
 }
 
 bool MyRenderPass::IsConverged() const
 {
+    // the instances don't have the current motion sample times yet.
+    if (_owner->motionPending())
+        return false;
+
+    // the last frame isn't in the pixels yet.
+    for (const _Readback& readback : _readbacks)
+        if (readback.fence)
+            return false;
+
     if (_aovBindings.size() == 0) 
         return true;
 
@@ -82,6 +226,8 @@ void MyRenderPass::_Execute(
     pxr::TfTokenVector const& renderTags)
 {
     bool needStartRender = false;
+    // camera, data window or AOVs, what the scene version doesn't tell.
+    bool frameChanged = false;
 
     // has the camera moved ?
     //
@@ -92,6 +238,7 @@ void MyRenderPass::_Execute(
     {
         _renderThread->StopRender();
         needStartRender = true;
+        frameChanged = true;
         _viewMatrix = view;
         _projMatrix = proj;
     }
@@ -103,6 +250,7 @@ void MyRenderPass::_Execute(
     {
         _renderThread->StopRender();
         needStartRender = true;
+        frameChanged = true;
         _dataWindow = dataWindow;
         const pxr::GfVec3i dimensions(_dataWindow.GetWidth(), _dataWindow.GetHeight(), 1);
         _colorBuffer.Allocate(dimensions, pxr::HdFormatFloat16Vec4, false);
@@ -145,7 +293,18 @@ void MyRenderPass::_Execute(
     {
         _renderThread->StopRender();
         needStartRender = true;
+        frameChanged = true;
         _aovBindings = aovBindings;
+
+        // one draw fills every target, only those of bound AOVs are
+        // written and read back.
+        _readTargets = 0;
+        for (pxr::HdRenderPassAovBinding const& binding : _aovBindings)
+        {
+            const _Target target = _GetTarget(binding.aovName);
+            if (binding.renderBuffer && target != TargetCount)
+                _readTargets |= 1 << target;
+        }
     }
 
     if( needStartRender )
@@ -171,146 +330,307 @@ void MyRenderPass::_Execute(
     // Do we need to get the sampleXform param here instead ?
     auto& passMatrix = hdCamera->GetTransform();
 
-    if (!shaderCreated)
+    // motion blur happens over the shutter of the camera we render
+    // through. New sample times only reach the instances after the next
+    // CommitResources and the sync following it, we aren't converged
+    // until then.
+    _owner->setShutter(hdCamera->GetShutterOpen(), hdCamera->GetShutterClose());
+    const bool motionPending = _owner->motionPending();
+
+    // husk has no context of its own: the offscreen one is current for
+    // the GL work of the frame only, the render thread of another delegate
+    // may want it next and waits meanwhile.
+    MyOffscreenContext* offscreenContext = _owner->offscreenContext();
+    MyOffscreenContext::ScopedCurrent current(offscreenContext);
+    if (!current.current() || GLVersion.major == 0)
+        return;
+
+    // the host's state is left as it was, our own context has nobody
+    // else's.
+    HostState hostState;
+    if (!offscreenContext)
+        hostState.save();
+
+    // everything goes to the G-buffer, not to whatever the host has bound,
+    // and the vertex arrays are specified in our own vertex array object.
+    _UpdateFrameBuffer();
+    glBindFramebuffer(GL_FRAMEBUFFER, _frameBuffer);
+    glViewport(0, 0, _gBufferSize[0], _gBufferSize[1]);
+    if (_vertexArray == 0)
+        glGenVertexArrays(1, &_vertexArray);
+    glBindVertexArray(_vertexArray);
+
+    // the targets read back.
+    GLenum drawBuffers[TargetDepth];
+    for (int target = 0; target < TargetDepth; ++target)
+        drawBuffers[target] = (_readTargets & (1 << target)) ? GL_COLOR_ATTACHMENT0 + target : GL_NONE;
+    const GLfloat clearColor[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+    const GLint clearId[4] = { -1, -1, -1, -1 };
+    const GLfloat clearDepth = 1.0f;
+
+    //glDisable(GL_BLEND);
+    glDisable(GL_SCISSOR_TEST);
+    glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_LESS);
+    glDepthMask(GL_TRUE);
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+    // motion blur: one subframe per motion sample time, averaged. The
+    // camera moves with them too when it has transform samples.
+    auto frameStart = std::chrono::high_resolution_clock::now();
+    const size_t sceneVersion = _owner->sceneVersion();
+    const bool readbackUnchanged = !frameChanged && !motionPending && sceneVersion == _readbackSceneVersion;
+    _readbackStallMs = 0.0;
+    const std::vector<float>& motionTimes = _owner->motionSampleTimes();
+    const pxr::HdTimeSampleArray<pxr::GfMatrix4d, 16>& cameraXforms = hdCamera->GetTimeSampleXforms();
+    const size_t subframes = std::max<size_t>(1, motionTimes.size());
+    bool needsRestart = false;
+    for (size_t subframe = 0; subframe < subframes; ++subframe)
     {
-        shaderCreated = true;
-
-        //glGenFramebuffers(1, &_frameBuffer);
-
-        //glBindFramebuffer(GL_FRAMEBUFFER, _frameBuffer);
-
-        glGenTextures(1, &_gBuffer);
-        //glBindTexture(GL_TEXTURE_2D, _gBuffer);
-        //glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 1024, 768, 0, GL_RGB, GL_UNSIGNED_BYTE, 0);
-        //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        //GLuint depthrenderbuffer;
-        //glGenRenderbuffers(1, &depthrenderbuffer);
-        //glBindRenderbuffer(GL_RENDERBUFFER, depthrenderbuffer);
-        //glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, 1024, 768);
-        //glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthrenderbuffer);
-
-        //glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, _gBuffer, 0);
-        //GLenum DrawBuffers[1] = { GL_COLOR_ATTACHMENT0 };
-        //glDrawBuffers(1, DrawBuffers);
-
-        //glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-
-
-        const char* vertexShaderSource = "#version 430\n"
-            "layout(location = 0) in vec4 position;\n"
-            "layout(location = 1) in vec2 iTexcoord;\n"
-            "layout(location = 2) in vec4 incolor;\n"
-            "out vec2 texcoord;\n"
-            "uniform mat4 projection;\n"
-            "uniform mat4 view;\n"
-            "uniform mat4 model;\n"
-            "void main()\n"
-            "{\n"
-            "   gl_Position = projection * view * position;\n"
-            "   texcoord = iTexcoord;\n"
-            "}\0";
-
-        const char* fragmentShaderSource = "#version 430\n"
-            "layout(origin_upper_left) in vec4 gl_FragCoord;\n"
-            "in vec3 normal;\n"
-            "in vec2 texcoord;\n"
-            "layout(location = 0) out vec4 FragColor;\n"
-            "void main()\n"
-            "{\n"
-            "   float alpha = 1.0;\n"
-            "   float posX = gl_FragCoord.x;\n"
-            "   //float posZ = gl_DepthRange.diff * (gl_FragCoord.z/gl_FragCoord.w) / 2.0;\n"
-            "   float posZ = gl_DepthRange.diff * (gl_FragCoord.z/gl_FragCoord.w) / 2.0;\n"
-            "   if(posZ < 1.0) FragColor = vec4(1,0,0,alpha);\n"
-            "   else if(posZ < 2.0) FragColor = vec4(0,1,0,alpha);\n"
-            "   else if(posZ < 3.0) FragColor = vec4(0,0,1,alpha);\n"
-            "   else if(posZ < 4.0) FragColor = vec4(1,0,1,alpha);\n"
-            "   else if(posZ < 5.0) FragColor = vec4(1,1,0,alpha);\n"
-            "   else if(posZ < 6.0) FragColor = vec4(0,1,1,alpha);\n"
-            "   //else FragColor = vec4(gl_FragCoord.x/1000.0, gl_FragCoord.y/1000.0, posZ, alpha);\n"
-            "   //FragColor = vec4(gl_FragCoord.x/1000.0, gl_FragCoord.y/1000.0, posZ, alpha);\n"
-            "   //FragColor = vec4(gl_ClipDistance, gl_PrimitiveID/100, posZ, alpha);\n"
-            "   FragColor = vec4(uvOut.x, uvOut.y, 1.0, alpha);\n"
-            "}\n\0";
-
-        // vertex shader
-        unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
-        glShaderSource(vertexShader, 1, &vertexShaderSource, NULL);
-        glCompileShader(vertexShader);
-        // check for shader compile errors
-        int success;
-        char infoLog[512];
-        glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &success);
-        if (!success)
+        pxr::GfMatrix4d subframeView = view;
+        if (!motionTimes.empty() && cameraXforms.count > 1)
+            subframeView = cameraXforms.Resample(motionTimes[subframe]).GetInverse();
+
+        glDrawBuffers(TargetDepth, drawBuffers);
+        glClearBufferfv(GL_COLOR, TargetColor, clearColor);
+        for (int target = TargetPrimId; target <= TargetElementId; ++target)
+            glClearBufferiv(GL_COLOR, target, clearId);
+        glClearBufferfv(GL_DEPTH, 0, &clearDepth);
+
+        // ...update/draw your scene
+        _owner->queryFrustum(subframeView * proj, &_visiblePrimitives);
+        // instance LOD measures sizes in pixels of the data window.
+        const double pixelScale = 0.5 * _dataWindow.GetHeight() * proj[1][1];
+        needsRestart |= _owner->UpdateScene(_visiblePrimitives, subframeView, proj, pixelScale, subframe);
+
+        // a frame showing the same as the last one read back has nothing
+        // new for the pixels.
+        if (!readbackUnchanged)
         {
-            glGetShaderInfoLog(vertexShader, 512, NULL, infoLog);
-            std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
+            if (_owner->useAsyncReadback())
+                _QueueReadback(subframe, subframes);
+            else
+                _ReadPixels(subframe, subframes);
         }
-        // fragment shader
-        unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-        glShaderSource(fragmentShader, 1, &fragmentShaderSource, NULL);
-        glCompileShader(fragmentShader);
-        // check for shader compile errors
-        glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &success);
-        if (!success)
+    }
+    // the previous frame is usually done by now. When nothing changed, it
+    // is the last one to wait for: get it now and be converged.
+    _ResolveReadbacks(readbackUnchanged);
+    _readbackSceneVersion = sceneVersion;
+    auto frameEnd = std::chrono::high_resolution_clock::now();
+    _owner->recordMotionBlur(subframes, std::chrono::duration<double, std::milli>(frameEnd - frameStart).count());
+    _owner->recordReadback(_readbackStallMs, _readbackLatencyMs);
+
+    if (!offscreenContext)
+        hostState.restore();
+}
+
+/*static*/
+MyRenderPass::_Target MyRenderPass::_GetTarget(pxr::TfToken const& aovName)
+{
+    if (aovName == pxr::HdAovTokens->color)
+        return TargetColor;
+    if (aovName == pxr::HdAovTokens->primId)
+        return TargetPrimId;
+    if (aovName == pxr::HdAovTokens->instanceId)
+        return TargetInstanceId;
+    if (aovName == pxr::HdAovTokens->elementId)
+        return TargetElementId;
+    if (aovName == pxr::HdAovTokens->depth)
+        return TargetDepth;
+    return TargetCount;
+}
+
+void MyRenderPass::_UpdateFrameBuffer()
+{
+    const pxr::GfVec2i size(std::max(_dataWindow.GetWidth(), 1), std::max(_dataWindow.GetHeight(), 1));
+    if (_frameBuffer != 0 && size == _gBufferSize)
+        return;
+
+    if (_frameBuffer == 0)
+    {
+        glGenFramebuffers(1, &_frameBuffer);
+        glGenRenderbuffers(TargetCount, _gBuffer);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, _frameBuffer);
+    for (int target = 0; target < TargetCount; ++target)
+    {
+        glBindRenderbuffer(GL_RENDERBUFFER, _gBuffer[target]);
+        glRenderbufferStorage(GL_RENDERBUFFER, TARGET_INTERNAL_FORMATS[target], size[0], size[1]);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER,
+            target == TargetDepth ? GL_DEPTH_ATTACHMENT : GLenum(GL_COLOR_ATTACHMENT0 + target),
+            GL_RENDERBUFFER, _gBuffer[target]);
+    }
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+        std::cout << "ERROR::FRAMEBUFFER::INCOMPLETE 0x" << std::hex << status << std::dec << std::endl;
+    _gBufferSize = size;
+}
+
+size_t MyRenderPass::_LayoutTargets(size_t* o_offsets) const
+{
+    const size_t pixels = size_t(_dataWindow.GetWidth()) * _dataWindow.GetHeight();
+    size_t bytes = 0;
+    for (int target = 0; target < TargetCount; ++target)
+    {
+        o_offsets[target] = NOT_READ;
+        if (!(_readTargets & (1 << target)))
+            continue;
+        o_offsets[target] = bytes;
+        bytes += pixels * TARGET_COMPONENTS[target] * 4;
+    }
+    return bytes;
+}
+
+void MyRenderPass::_ReadTargets(size_t const* offsets, uint8_t* base) const
+{
+    for (int target = 0; target < TargetCount; ++target)
+    {
+        if (offsets[target] == NOT_READ)
+            continue;
+        if (target != TargetDepth)
+            glReadBuffer(GL_COLOR_ATTACHMENT0 + target);
+        glReadPixels(0, 0, _dataWindow.GetWidth(), _dataWindow.GetHeight(),
+            TARGET_READ_FORMATS[target], TARGET_READ_TYPES[target],
+            reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(base) + offsets[target]));
+    }
+}
+
+void MyRenderPass::_DeliverTargets(uint8_t const* data, size_t const* offsets, int width, int height,
+    size_t subframe, size_t subframes)
+{
+    // motion subframes add up in float, the last one resolves the average.
+    float const* color = offsets[TargetColor] != NOT_READ ?
+        reinterpret_cast<float const*>(data + offsets[TargetColor]) : nullptr;
+    float scale = 1.0f;
+    if (subframes > 1)
+    {
+        if (color)
         {
-            glGetShaderInfoLog(fragmentShader, 512, NULL, infoLog);
-            std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
-        }
-        // link shaders
-        _shaderProgram = glCreateProgram();
-        //glAttachShader(_shaderProgram, vertexShader);
-        glAttachShader(_shaderProgram, fragmentShader);
-        glLinkProgram(_shaderProgram);
-        // check for linking errors
-        glGetProgramiv(_shaderProgram, GL_LINK_STATUS, &success);
-        if (!success) {
-            glGetProgramInfoLog(_shaderProgram, 512, NULL, infoLog);
-            std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+            const size_t count = size_t(width) * height * 4;
+            if (subframe == 0)
+            {
+                _subframePixels.assign(color, color + count);
+            }
+            else
+            {
+                _subframePixels.resize(count, 0.0f);
+                for (size_t i = 0; i < count; ++i)
+                    _subframePixels[i] += color[i];
+            }
+            color = _subframePixels.data();
+            scale = 1.0f / float(subframes);
         }
-        glDeleteShader(vertexShader);
-        glDeleteShader(fragmentShader);
+        if (subframe + 1 < subframes)
+            return;
     }
 
-    glPushMatrix();
-    glPushClientAttrib(GL_CLIENT_ALL_ATTRIB_BITS);
-    glPushAttrib(GL_ALL_ATTRIB_BITS);
+    for (pxr::HdRenderPassAovBinding const& binding : _aovBindings)
+    {
+        const _Target target = _GetTarget(binding.aovName);
+        if (!binding.renderBuffer || target == TargetCount || offsets[target] == NOT_READ)
+            continue;
+
+        MyRenderBuffer* renderBuffer = static_cast<MyRenderBuffer*>(binding.renderBuffer);
+        uint8_t const* src = data + offsets[target];
+        if (target == TargetColor)
+            renderBuffer->WriteFrame(color, 4, width, height, scale);
+        else if (target == TargetDepth)
+            renderBuffer->WriteFrame(reinterpret_cast<float const*>(src), 1, width, height);
+        else
+            renderBuffer->WriteFrame(reinterpret_cast<int const*>(src), 1, width, height);
+    }
+    _owner->recordFirstPixel();
+}
 
-    //glDisable(GL_BLEND);
-    glDisable(GL_LIGHTING);
-    glDepthFunc(GL_LESS);
-    glClearColor(0.0,0.0,0.0,1.0);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+void MyRenderPass::_ReadPixels(size_t subframe, size_t subframes)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+
+    _readPixels.resize(_LayoutTargets(_readOffsets));
+    _ReadTargets(_readOffsets, _readPixels.data());
+    _DeliverTargets(_readPixels.data(), _readOffsets, _dataWindow.GetWidth(), _dataWindow.GetHeight(),
+        subframe, subframes);
+
+    auto end = std::chrono::high_resolution_clock::now();
+    _readbackStallMs += std::chrono::duration<double, std::milli>(end - start).count();
+}
 
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    glMultMatrixd(proj.data());
-    glMultMatrixd(view.data());
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
+void MyRenderPass::_QueueReadback(size_t subframe, size_t subframes)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+
+    // the ring is full: the oldest readback has to go first.
+    _Readback& readback = _readbacks[_readbackNext];
+    if (readback.fence)
+        _ResolveReadbacks(true);
+
+    readback.width = _dataWindow.GetWidth();
+    readback.height = _dataWindow.GetHeight();
+    readback.subframe = subframe;
+    readback.subframes = subframes;
+
+    // every target read back, one after the other.
+    const size_t bytes = _LayoutTargets(readback.offsets);
+    if (bytes == 0)
+        return;
+    if (readback.pbo == 0)
+        glGenBuffers(1, &readback.pbo);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.pbo);
+    if (readback.bytes != bytes)
+    {
+        glBufferData(GL_PIXEL_PACK_BUFFER, bytes, nullptr, GL_STREAM_READ);
+        readback.bytes = bytes;
+    }
+    _ReadTargets(readback.offsets, nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    readback.submitted = std::chrono::high_resolution_clock::now();
+    _readbackNext = (_readbackNext + 1) % READBACK_RING_SIZE;
 
-    //glUseProgram(_shaderProgram);
-    
-    //glUniformMatrix4dv(glGetUniformLocation(_shaderProgram, "projection"), 1, GL_FALSE, proj.data());
-    //glUniformMatrix4dv(glGetUniformLocation(_shaderProgram, "view"), 1, GL_FALSE, view.data());
+    _readbackStallMs += std::chrono::duration<double, std::milli>(readback.submitted - start).count();
+}
 
-    // ...update/draw your scene
-    bool needsRestart = _owner->UpdateScene();
+void MyRenderPass::_ResolveReadbacks(bool wait)
+{
+    auto start = std::chrono::high_resolution_clock::now();
 
+    for (int k = 0; k < READBACK_RING_SIZE; ++k)
     {
-        std::lock_guard<std::mutex> guardxx(_owner->rendererMutex());
-        
-        if (!_owner->ValidPixels(_dataWindow.GetWidth(), _dataWindow.GetHeight()))
-            _owner->ResetPixels(_dataWindow.GetWidth(), _dataWindow.GetHeight());
+        _Readback& readback = _readbacks[(_readbackNext + k) % READBACK_RING_SIZE];
+        if (!readback.fence)
+            continue;
 
-        float* pixels = _owner->GetPixels();
-        glReadPixels(0, 0, _dataWindow.GetWidth(), _dataWindow.GetHeight(), GL_RGBA, GL_FLOAT, pixels);
-    }
+        // in order: a later one can't go before this one is done.
+        GLenum status = glClientWaitSync(readback.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+        if (wait)
+        {
+            while (status == GL_TIMEOUT_EXPIRED)
+                status = glClientWaitSync(readback.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+        }
+        if (status == GL_TIMEOUT_EXPIRED)
+            break;
+        glDeleteSync(readback.fence);
+        readback.fence = nullptr;
+
+        // mapped and converted once, into the AOVs.
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.pbo);
+        const uint8_t* mapped = static_cast<const uint8_t*>(
+            glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, readback.bytes, GL_MAP_READ_BIT));
+        if (mapped)
+        {
+            _DeliverTargets(mapped, readback.offsets, readback.width, readback.height,
+                readback.subframe, readback.subframes);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
 
-    //glUseProgram(0);
+        _readbackLatencyMs = std::chrono::duration<double, std::milli>(
+            std::chrono::high_resolution_clock::now() - readback.submitted).count();
+    }
 
-    glPopAttrib();
-    glPopMatrix();
+    auto end = std::chrono::high_resolution_clock::now();
+    _readbackStallMs += std::chrono::duration<double, std::milli>(end - start).count();
 }
@@ -7,12 +7,24 @@
 #include <pxr/imaging/hd/renderThread.h>
 #include <pxr/base/gf/matrix4d.h>
 #include <pxr/base/gf/rect2i.h>
+#include <pxr/base/gf/vec2i.h>
 
 #include "renderBuffer.h"
 #include "renderDelegate.h"
 
 #include "glad.h"
 
+#include <chrono>
+
+// Small helpers around GL buffer objects, shared by the render pass and the
+// rprims. They must be called with the renderer GL context current.
+GLuint CreateVBO(const GLfloat* data, const GLuint size);
+void UpdateVBO(const GLuint id, const GLfloat* data, const GLuint size);
+void UpdateVBORange(const GLuint id, const GLuint offset, const GLfloat* data, const GLuint size);
+void BindVBO(const GLuint idx, const GLuint N, const GLuint id);
+GLuint CreateIBO(const GLuint* data, const GLuint size);
+void UpdateIBO(const GLuint id, const GLuint* data, const GLuint size);
+
 class MyRenderPass final : public pxr::HdRenderPass
 {
 public:
@@ -34,6 +46,46 @@ protected:
     void _MarkCollectionDirty() override {}
 
 private:
+    // G-buffer targets, each an attachment of _frameBuffer written by the
+    // same draw: the color ones in the order of the program outputs (see
+    // MyDrawList::COLOR_OUTPUT), then depth.
+    enum _Target : int
+    {
+        TargetColor,
+        TargetPrimId,
+        TargetInstanceId,
+        TargetElementId,
+        TargetDepth,
+        TargetCount
+    };
+    // offset of the targets not read back.
+    static const size_t NOT_READ = size_t(-1);
+
+    // The target an AOV comes from, TargetCount for none.
+    static _Target _GetTarget(pxr::TfToken const& aovName);
+    // (Re)allocate the G-buffer for the data window.
+    void _UpdateFrameBuffer();
+    // Where each target read back goes in a buffer of the data window's
+    // pixels, the targets of bound AOVs one after the other, and the
+    // buffer size.
+    size_t _LayoutTargets(size_t* o_offsets) const;
+    // glReadPixels of every target read back to its offset from base, a
+    // client pointer or, with a pixel pack buffer bound, null.
+    void _ReadTargets(size_t const* offsets, uint8_t* base) const;
+
+    // Queue the readback of the G-buffer, subframe of subframes, into the
+    // next buffer of the ring (see _readbacks).
+    void _QueueReadback(size_t subframe, size_t subframes);
+    // Deliver pending readbacks in order, as long as they are done or,
+    // with wait, all of them.
+    void _ResolveReadbacks(bool wait);
+    // Synchronous glReadPixels, for badgl:asyncReadback off.
+    void _ReadPixels(size_t subframe, size_t subframes);
+    // Write the targets of a subframe into the bound AOVs: color once all
+    // subframes are in, averaged, the others as the last one has them.
+    void _DeliverTargets(uint8_t const* data, size_t const* offsets, int width, int height,
+        size_t subframe, size_t subframes);
+
     MyRenderDelegate* _owner;
 
     pxr::HdRenderPassAovBindingVector _aovBindings;
@@ -43,10 +95,51 @@ private:
     MyRenderBuffer _colorBuffer;
     pxr::HdRenderThread* _renderThread;
 
-    bool shaderCreated;
-    GLuint _shaderProgram;
-    GLuint _gBuffer;
+    // what the pass renders into, one renderbuffer per target, and the
+    // size they have.
     GLuint _frameBuffer;
+    GLuint _gBuffer[TargetCount];
+    pxr::GfVec2i _gBufferSize;
+    // targets of the bound AOVs, a bit per _Target.
+    int _readTargets;
+    // where the draw list specifies its vertex arrays, the host's are left
+    // alone.
+    GLuint _vertexArray;
+
+    // what the scene BVH says is in view, kept to reuse its storage.
+    std::vector<uint32_t> _visiblePrimitives;
+
+    // motion subframes summed until the last one is in.
+    std::vector<float> _subframePixels;
+    // where the synchronous readback goes, and where each target is.
+    std::vector<uint8_t> _readPixels;
+    size_t _readOffsets[TargetCount];
+
+    // Async readback: glReadPixels into a pixel pack buffer returns at
+    // once, the pixels are mapped after its fence has passed, usually
+    // while the next frame (or subframe) is being submitted. Slots are
+    // used in turn, those with a fence are pending, oldest first from
+    // _readbackNext.
+    static const int READBACK_RING_SIZE = 3;
+    struct _Readback
+    {
+        GLuint pbo = 0;
+        size_t bytes = 0;
+        size_t offsets[TargetCount] = {};
+        GLsync fence = nullptr;
+        int width = 0;
+        int height = 0;
+        size_t subframe = 0;
+        size_t subframes = 1;
+        std::chrono::high_resolution_clock::time_point submitted;
+    };
+    _Readback _readbacks[READBACK_RING_SIZE];
+    int _readbackNext;
+    // what the last frame read back showed, nothing new to read back
+    // while it stays the same.
+    size_t _readbackSceneVersion;
+    double _readbackStallMs;
+    double _readbackLatencyMs;
 };
 
 #endif
\ No newline at end of file
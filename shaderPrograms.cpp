@@ -0,0 +1,336 @@
+#include "shaderPrograms.h"
+#include "offscreenContext.h"
+
+#include <pxr/base/arch/hash.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+std::mutex MyShaderPrograms::_mutex;
+std::unordered_map<void*, MyShaderPrograms::_ContextPrograms> MyShaderPrograms::_contexts;
+std::string MyShaderPrograms::_cacheDirectory;
+double MyShaderPrograms::_buildMs = 0.0;
+size_t MyShaderPrograms::_loaded = 0;
+size_t MyShaderPrograms::_compiled = 0;
+
+namespace {
+
+// Everything draws through the same transforms: the model one (the mesh's,
+// a uniform), in front of it the child transform of factored nested
+// instances (childCount > 0, 4 texels of the childTransforms texture
+// buffer) and the per-instance one (a divisor-1 attribute), then view and
+// projection. Instance colors replace the mesh's when set: read like the
+// instance transform, or like the child one from the childColors texture
+// buffer. The instance id (a divisor-1 attribute) is passed on for the
+// fragment stage. Point impostors of far instances are impostorSize pixels
+// wide at w = 1, scaled like the instance.
+const char* VERTEX_SHADER_SOURCE =
+    "layout(location = 0) in vec3 position;\n"
+    "layout(location = 0) uniform mat4 projection;\n"
+    "layout(location = 1) uniform mat4 view;\n"
+    "layout(location = 2) uniform mat4 model;\n"
+    "#ifdef VERTEX_COLORS\n"
+    "layout(location = 1) in vec4 color;\n"
+    "#else\n"
+    "layout(location = 3) uniform vec4 constantColor;\n"
+    "#endif\n"
+    "#ifdef INSTANCED\n"
+    "layout(location = 4) in mat4 instanceTransform;\n"
+    "layout(location = 8) in vec4 instanceColor;\n"
+    "layout(location = 10) in uint instanceId;\n"
+    "layout(location = 6) uniform int childCount;\n"
+    "layout(location = 7) uniform bool useInstanceColor;\n"
+    "layout(location = 8) uniform float impostorSize;\n"
+    "layout(location = 9) uniform bool useChildColors;\n"
+    "layout(binding = 0) uniform samplerBuffer childTransforms;\n"
+    "layout(binding = 2) uniform samplerBuffer childColors;\n"
+    "flat out uint primvarInstanceId;\n"
+    "#endif\n"
+    "out vec4 vertexColor;\n"
+    "void main()\n"
+    "{\n"
+    "#ifdef VERTEX_COLORS\n"
+    "   vertexColor = color;\n"
+    "#else\n"
+    "   vertexColor = constantColor;\n"
+    "#endif\n"
+    "#ifdef INSTANCED\n"
+    "   mat4 child = mat4(1.0);\n"
+    "   if (childCount > 0)\n"
+    "   {\n"
+    "       int texel = (gl_InstanceID % childCount) * 4;\n"
+    "       child = mat4(texelFetch(childTransforms, texel), texelFetch(childTransforms, texel + 1),\n"
+    "           texelFetch(childTransforms, texel + 2), texelFetch(childTransforms, texel + 3));\n"
+    "   }\n"
+    "   if (useChildColors)\n"
+    "       vertexColor = texelFetch(childColors, gl_InstanceID % childCount);\n"
+    "   else if (useInstanceColor)\n"
+    "       vertexColor = instanceColor;\n"
+    "   primvarInstanceId = instanceId;\n"
+    "   gl_Position = projection * view * instanceTransform * child * model * vec4(position, 1.0);\n"
+    "   gl_PointSize = max(1.0, impostorSize * length(instanceTransform[0].xyz) / gl_Position.w);\n"
+    "#else\n"
+    "   gl_Position = projection * view * model * vec4(position, 1.0);\n"
+    "#endif\n"
+    "}\n";
+
+// Every color target of the G-buffer. Non instanced meshes have no
+// instance id, -1.
+const char* FRAGMENT_SHADER_SOURCE =
+    "in vec4 vertexColor;\n"
+    "#ifdef INSTANCED\n"
+    "flat in uint primvarInstanceId;\n"
+    "#endif\n"
+    "layout(location = 4) uniform int primId;\n"
+    "layout(location = 5) uniform bool useTriangleFaces;\n"
+    "layout(binding = 1) uniform isamplerBuffer triangleFaces;\n"
+    "layout(location = 0) out vec4 outColor;\n"
+    "layout(location = 1) out int outPrimId;\n"
+    "layout(location = 2) out int outInstanceId;\n"
+    "layout(location = 3) out int outElementId;\n"
+    "void main()\n"
+    "{\n"
+    "   outColor = vertexColor;\n"
+    "   outPrimId = primId;\n"
+    "#ifdef INSTANCED\n"
+    "   outInstanceId = int(primvarInstanceId);\n"
+    "#else\n"
+    "   outInstanceId = -1;\n"
+    "#endif\n"
+    "   outElementId = useTriangleFaces ? texelFetch(triangleFaces, gl_PrimitiveID).r : -1;\n"
+    "}\n";
+
+const char* VERSION_LINE = "#version 430 core\n";
+
+// first bytes of a cache file, followed by the binary format and the
+// binary itself.
+const uint32_t CACHE_MAGIC = 0x50474c42; // "BGLP"
+
+GLuint CompileShader(GLenum type, std::string const& defines, const char* source)
+{
+    const char* sources[3] = { VERSION_LINE, defines.c_str(), source };
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 3, sources, NULL);
+    glCompileShader(shader);
+    // check for shader compile errors
+    int success;
+    char infoLog[512];
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+    if (!success)
+    {
+        glGetShaderInfoLog(shader, 512, NULL, infoLog);
+        std::cout << "ERROR::SHADER::" << (type == GL_VERTEX_SHADER ? "VERTEX" : "FRAGMENT")
+            << "::COMPILATION_FAILED\n" << defines << infoLog << std::endl;
+    }
+    return shader;
+}
+
+} // namespace
+
+/*static*/
+GLuint MyShaderPrograms::get(int features)
+{
+    void* context = MyOffscreenContext::CurrentHandle();
+    std::lock_guard<std::mutex> guard(_mutex);
+    _ContextPrograms& programs = _contexts[context];
+    // a context the host destroyed may leave its handle to a new one, that
+    // doesn't know our programs.
+    if (programs.built[features] && programs.programs[features] != 0 &&
+        !glIsProgram(programs.programs[features]))
+    {
+        programs = _ContextPrograms();
+    }
+    if (!programs.built[features])
+    {
+        programs.programs[features] = _Build(features);
+        programs.built[features] = true;
+    }
+    return programs.programs[features];
+}
+
+/*static*/
+void MyShaderPrograms::release()
+{
+    void* context = MyOffscreenContext::CurrentHandle();
+    std::lock_guard<std::mutex> guard(_mutex);
+    auto found = _contexts.find(context);
+    if (found == _contexts.end())
+        return;
+    for (GLuint program : found->second.programs)
+    {
+        if (program != 0)
+            glDeleteProgram(program);
+    }
+    _contexts.erase(found);
+}
+
+/*static*/
+void MyShaderPrograms::setCacheDirectory(std::string const& directory)
+{
+    std::lock_guard<std::mutex> guard(_mutex);
+    _cacheDirectory = directory;
+}
+
+/*static*/
+void MyShaderPrograms::stats(double* o_buildMs, size_t* o_loaded, size_t* o_compiled)
+{
+    std::lock_guard<std::mutex> guard(_mutex);
+    *o_buildMs = _buildMs;
+    *o_loaded = _loaded;
+    *o_compiled = _compiled;
+}
+
+/*static*/
+GLuint MyShaderPrograms::_Build(int features)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+
+    std::string defines;
+    if (features & FeatureVertexColors)
+        defines += "#define VERTEX_COLORS\n";
+    if (features & FeatureInstanced)
+        defines += "#define INSTANCED\n";
+
+    // a binary is only good for the driver that made it, and the sources
+    // it was made from.
+    std::string cachePath;
+    GLint binaryFormats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &binaryFormats);
+    if (!_cacheDirectory.empty() && binaryFormats > 0)
+    {
+        std::string key;
+        for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION })
+        {
+            const GLubyte* value = glGetString(name);
+            key += value ? reinterpret_cast<const char*>(value) : "";
+            key += '\n';
+        }
+        key += VERSION_LINE;
+        key += defines;
+        key += VERTEX_SHADER_SOURCE;
+        key += FRAGMENT_SHADER_SOURCE;
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.bin",
+            static_cast<unsigned long long>(pxr::ArchHash64(key.data(), key.size())));
+        cachePath = (std::filesystem::path(_cacheDirectory) / name).string();
+    }
+
+    GLuint program = cachePath.empty() ? 0 : _Load(cachePath);
+    if (program != 0)
+    {
+        _loaded++;
+    }
+    else
+    {
+        GLuint vertexShader = CompileShader(GL_VERTEX_SHADER, defines, VERTEX_SHADER_SOURCE);
+        GLuint fragmentShader = CompileShader(GL_FRAGMENT_SHADER, defines, FRAGMENT_SHADER_SOURCE);
+
+        // link shaders
+        program = glCreateProgram();
+        if (!cachePath.empty())
+            glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        glAttachShader(program, vertexShader);
+        glAttachShader(program, fragmentShader);
+        glLinkProgram(program);
+        glDetachShader(program, vertexShader);
+        glDetachShader(program, fragmentShader);
+        glDeleteShader(vertexShader);
+        glDeleteShader(fragmentShader);
+        // check for linking errors
+        int success;
+        char infoLog[512];
+        glGetProgramiv(program, GL_LINK_STATUS, &success);
+        if (!success)
+        {
+            glGetProgramInfoLog(program, 512, NULL, infoLog);
+            std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << defines << infoLog << std::endl;
+            glDeleteProgram(program);
+            program = 0;
+        }
+        else
+        {
+            _compiled++;
+            if (!cachePath.empty())
+                _Save(program, cachePath);
+        }
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    _buildMs += std::chrono::duration<double, std::milli>(end - start).count();
+    return program;
+}
+
+/*static*/
+GLuint MyShaderPrograms::_Load(std::string const& path)
+{
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file)
+        return 0;
+    const std::streamoff size = file.tellg();
+    uint32_t header[2] = {};
+    if (size <= std::streamoff(sizeof(header)))
+        return 0;
+    file.seekg(0);
+    std::vector<char> binary(size_t(size) - sizeof(header));
+    if (!file.read(reinterpret_cast<char*>(header), sizeof(header)) ||
+        !file.read(binary.data(), std::streamsize(binary.size())) || header[0] != CACHE_MAGIC)
+        return 0;
+
+    // a driver update that kept its version string may not take it.
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, GLenum(header[1]), binary.data(), GLsizei(binary.size()));
+    int success;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (!success)
+    {
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+/*static*/
+void MyShaderPrograms::_Save(GLuint program, std::string const& path)
+{
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+    std::vector<char> binary(length);
+    GLenum format = 0;
+    glGetProgramBinary(program, length, &length, &format, binary.data());
+    const uint32_t header[2] = { CACHE_MAGIC, uint32_t(format) };
+
+    // written aside and renamed, so that other processes sharing the
+    // directory (farm blades) never read a partial file.
+    std::error_code error;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+    const std::string partialPath = path + "." +
+        std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()) ^
+            size_t(std::chrono::high_resolution_clock::now().time_since_epoch().count()));
+    {
+        std::ofstream file(partialPath, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(header), sizeof(header));
+        file.write(binary.data(), length);
+        if (!file)
+        {
+            std::cout << "ERROR::SHADER::CACHE::WRITE_FAILED " << partialPath << std::endl;
+            file.close();
+            std::filesystem::remove(partialPath, error);
+            return;
+        }
+    }
+    std::filesystem::rename(partialPath, path, error);
+    if (error)
+    {
+        std::cout << "ERROR::SHADER::CACHE::WRITE_FAILED " << path << ": " << error.message() << std::endl;
+        std::filesystem::remove(partialPath, error);
+    }
+}
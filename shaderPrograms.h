@@ -0,0 +1,79 @@
+#ifndef MY_SHADERPROGRAMS_H
+#define MY_SHADERPROGRAMS_H
+
+#include "glad.h"
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// The G-buffer programs, GLSL 4.30 core: no fixed-function inputs, the
+// transforms and the constant mesh color are uniforms. There is one
+// program per permutation of the features a draw item needs, compiled the
+// first time it is asked for and kept until release(). Programs are only
+// valid in the context they were built in, so there is a set of them per
+// context, the one current when get() is called (see
+// MyOffscreenContext::CurrentHandle). Contexts sharing objects still build
+// their own, the cache directory keeps that cheap. Our offscreen context
+// releases its set when it is destroyed, the next one builds its own.
+//
+// Normals aren't a feature, nothing shades with them (lighting has always
+// been off). Attribute, uniform, texture unit and fragment output
+// locations are explicit in the sources and the same in every program,
+// see MyDrawList.
+//
+// With a cache directory set, linked programs are saved there as program
+// binaries and loaded from it by later processes instead of compiled, a
+// file per program named after a hash of the driver (vendor, renderer,
+// versions) and of the sources. A binary the driver turns down is
+// compiled again and replaced.
+class MyShaderPrograms
+{
+public:
+    enum Feature : int
+    {
+        // per-vertex colors, the color uniform otherwise.
+        FeatureVertexColors = 1 << 0,
+        // per-instance transforms, primvars and ids.
+        FeatureInstanced = 1 << 1,
+        FeatureCount = 1 << 2
+    };
+
+    // Program of the features for the current context, compiled on first
+    // use. 0 when it doesn't compile or link, the error is printed the
+    // first time only. Must be called on the thread owning the GL context.
+    static GLuint get(int features);
+
+    // Delete the programs of the current context, about to be destroyed.
+    // They are built again on the next get() in it.
+    static void release();
+
+    // Empty for no cache (the default). Programs built already stay as
+    // they are.
+    static void setCacheDirectory(std::string const& directory);
+
+    // What building programs took so far in this process, and how many
+    // came from the cache or were compiled.
+    static void stats(double* o_buildMs, size_t* o_loaded, size_t* o_compiled);
+
+private:
+    static GLuint _Build(int features);
+    static GLuint _Load(std::string const& path);
+    static void _Save(GLuint program, std::string const& path);
+
+    struct _ContextPrograms
+    {
+        GLuint programs[FeatureCount] = {};
+        bool built[FeatureCount] = {};
+    };
+
+    static std::mutex _mutex;
+    // by native context handle, null when it can't be told.
+    static std::unordered_map<void*, _ContextPrograms> _contexts;
+    static std::string _cacheDirectory;
+    static double _buildMs;
+    static size_t _loaded;
+    static size_t _compiled;
+};
+
+#endif
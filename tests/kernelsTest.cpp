@@ -0,0 +1,313 @@
+// Checks the normals and instance transform kernels against the scalar
+// code they replace, on the same inputs, and times both on a large one.
+// Built with HDBADGL_BUILD_TESTS: with HDBADGL_ENABLE_AVX2 the kernels are
+// the AVX2 ones, without it their scalar paths, run it in both builds.
+// Sizes leave every remainder modulo 8 and cross the TBB grains, so every
+// tail the 8-wide loops can leave is covered.
+//
+//     hdBadGL_kernelsTest [large count, default 1000000]
+
+#include "normals.h"
+#include "instanceTransforms.h"
+
+#include <pxr/imaging/hd/meshTopology.h>
+#include <pxr/imaging/hd/smoothNormals.h>
+#include <pxr/imaging/hd/vertexAdjacency.h>
+#include <pxr/imaging/pxOsd/tokens.h>
+#include <pxr/base/gf/quatd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <vector>
+
+namespace {
+
+static bool _Near(double a, double b, double tolerance)
+{
+    return std::abs(a - b) <= tolerance * std::max(1.0, std::abs(b));
+}
+
+// best of a few runs, in ms.
+static double _Time(std::function<void()> const& work, int runs = 5)
+{
+    double best = 0.0;
+    for (int run = 0; run < runs; ++run)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        work();
+        auto end = std::chrono::high_resolution_clock::now();
+        const double ms = std::chrono::duration<double, std::milli>(end - start).count();
+        best = run == 0 ? ms : std::min(best, ms);
+    }
+    return best;
+}
+
+// A jittered grid of width x height quads, every third one split in two
+// triangles and every fifth left out, so valences vary within a block of
+// 8 vertices. The last point is referenced by no face.
+struct _Mesh
+{
+    pxr::HdMeshTopology topology;
+    std::vector<pxr::GfVec3f> points;
+};
+
+static _Mesh _MakeMesh(int width, int height, std::mt19937& random)
+{
+    std::uniform_real_distribution<float> jitter(-0.3f, 0.3f);
+    _Mesh mesh;
+    for (int y = 0; y <= height; ++y)
+        for (int x = 0; x <= width; ++x)
+            mesh.points.emplace_back(float(x) + jitter(random), float(y) + jitter(random), jitter(random));
+    mesh.points.emplace_back(0.0f, 0.0f, 1.0f);
+
+    pxr::VtIntArray faceVertexCounts;
+    pxr::VtIntArray faceVertexIndices;
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            const int face = y * width + x;
+            const int a = y * (width + 1) + x;
+            const int b = a + 1;
+            const int c = b + width + 1;
+            const int d = a + width + 1;
+            if (face % 5 == 4)
+                continue;
+            if (face % 3 == 2)
+            {
+                faceVertexCounts.push_back(3);
+                faceVertexIndices.push_back(a);
+                faceVertexIndices.push_back(b);
+                faceVertexIndices.push_back(c);
+                faceVertexCounts.push_back(3);
+                faceVertexIndices.push_back(a);
+                faceVertexIndices.push_back(c);
+                faceVertexIndices.push_back(d);
+            }
+            else
+            {
+                faceVertexCounts.push_back(4);
+                faceVertexIndices.push_back(a);
+                faceVertexIndices.push_back(b);
+                faceVertexIndices.push_back(c);
+                faceVertexIndices.push_back(d);
+            }
+        }
+    }
+    mesh.topology = pxr::HdMeshTopology(pxr::PxOsdOpenSubdivTokens->catmullClark, pxr::HdTokens->rightHanded,
+        faceVertexCounts, faceVertexIndices);
+    return mesh;
+}
+
+// MySmoothNormals against Hd_SmoothNormals, false on a mismatch.
+static bool _CheckNormals(int width, int height, bool time, std::mt19937& random)
+{
+    const _Mesh mesh = _MakeMesh(width, height, random);
+    pxr::Hd_VertexAdjacency adjacency;
+    adjacency.BuildAdjacencyTable(&mesh.topology);
+    const int numPoints = int(mesh.points.size());
+
+    pxr::VtVec3fArray normals = MySmoothNormals::ComputeSmoothNormals(&adjacency, numPoints, mesh.points.data());
+    pxr::VtVec3fArray reference = pxr::Hd_SmoothNormals::ComputeSmoothNormals(&adjacency, numPoints,
+        mesh.points.data());
+    if (normals.size() != reference.size())
+    {
+        std::cout << "ERROR::TEST::NORMALS " << numPoints << " points: " << normals.size() << " normals, "
+            << reference.size() << " expected" << std::endl;
+        return false;
+    }
+    for (size_t i = 0; i < normals.size(); ++i)
+    {
+        for (int c = 0; c < 3; ++c)
+        {
+            if (!_Near(normals[i][c], reference[i][c], 1e-4))
+            {
+                std::cout << "ERROR::TEST::NORMALS " << numPoints << " points, vertex " << i << ": ("
+                    << normals[i] << ") instead of (" << reference[i] << ")" << std::endl;
+                return false;
+            }
+        }
+    }
+
+    if (time)
+    {
+        const double kernelMs = _Time([&]()
+            { MySmoothNormals::ComputeSmoothNormals(&adjacency, numPoints, mesh.points.data()); });
+        const double referenceMs = _Time([&]()
+            { pxr::Hd_SmoothNormals::ComputeSmoothNormals(&adjacency, numPoints, mesh.points.data()); });
+        std::cout << "normals: " << numPoints << " points, " << kernelMs << " ms, Hd_SmoothNormals "
+            << referenceMs << " ms" << std::endl;
+    }
+    return true;
+}
+
+// The four GfMatrix4d passes MyInstanceTransforms replaces (see
+// MyInstancer::_ComposeLegacy), for one instance.
+static pxr::GfMatrix4d _ComposeReference(MyInstanceTransforms::Inputs const& in, size_t i)
+{
+    const size_t index = in.indices ? size_t(in.indices[i]) : i;
+    pxr::GfMatrix4d transform = in.instancerTransform;
+    if (index < in.numTranslations)
+    {
+        pxr::GfMatrix4d translate(1.0);
+        translate.SetTranslate(pxr::GfVec3d(in.translations[index]));
+        transform = translate * transform;
+    }
+    pxr::GfMatrix4d rotate(1.0);
+    if (index < in.numHalfRotations)
+        transform = rotate.SetRotate(pxr::GfQuatd(in.halfRotations[index])) * transform;
+    else if (index < in.numQuatRotations)
+        transform = rotate.SetRotate(pxr::GfQuatd(in.quatRotations[index])) * transform;
+    else if (index < in.numFloatRotations)
+    {
+        const pxr::GfVec4f& q = in.floatRotations[index];
+        transform = rotate.SetRotate(pxr::GfQuatd(q[0], q[1], q[2], q[3])) * transform;
+    }
+    if (index < in.numScales)
+    {
+        pxr::GfMatrix4d scale(1.0);
+        scale.SetScale(pxr::GfVec3d(in.scales[index]));
+        transform = scale * transform;
+    }
+    if (index < in.numInstanceTransforms)
+        transform = in.instanceTransforms[index] * transform;
+    return transform;
+}
+
+// MyInstanceTransforms::Compose, float and double, against
+// _ComposeReference. rotationKind picks the primvar type of the rotations:
+// GfQuath, GfQuatf or GfVec4f. false on a mismatch.
+static bool _CheckInstanceTransforms(size_t count, int rotationKind, bool time, std::mt19937& random)
+{
+    std::uniform_real_distribution<float> value(-2.0f, 2.0f);
+    std::uniform_real_distribution<float> positive(0.5f, 2.0f);
+
+    // a few elements short of the instances, and indices running past
+    // every primvar (and negative ones): those instances take identity.
+    const size_t numElements = count > 3 ? count - 3 : count;
+    std::vector<pxr::GfVec3f> translations(numElements);
+    std::vector<pxr::GfQuath> halfRotations;
+    std::vector<pxr::GfQuatf> quatRotations;
+    std::vector<pxr::GfVec4f> floatRotations;
+    std::vector<pxr::GfVec3f> scales(numElements / 2);
+    std::vector<pxr::GfMatrix4d> instanceTransforms(numElements / 3);
+    for (pxr::GfVec3f& t : translations)
+        t = pxr::GfVec3f(value(random), value(random), value(random));
+    for (size_t i = 0; i < numElements; ++i)
+    {
+        pxr::GfQuatf q(value(random), pxr::GfVec3f(value(random), value(random), value(random)));
+        q.Normalize();
+        if (rotationKind == 0)
+            halfRotations.push_back(pxr::GfQuath(q));
+        else if (rotationKind == 1)
+            quatRotations.push_back(q);
+        else
+            floatRotations.emplace_back(q.GetReal(), q.GetImaginary()[0], q.GetImaginary()[1], q.GetImaginary()[2]);
+    }
+    for (pxr::GfVec3f& s : scales)
+        s = pxr::GfVec3f(positive(random), positive(random), positive(random));
+    for (pxr::GfMatrix4d& m : instanceTransforms)
+    {
+        m.SetTranslate(pxr::GfVec3d(value(random), value(random), value(random)));
+        m[0][1] = value(random) * 0.1;
+    }
+    std::vector<int> indices(count);
+    for (size_t i = 0; i < count; ++i)
+        indices[i] = i % 97 == 96 ? -1 : int((i * 7) % (numElements + 2));
+
+    MyInstanceTransforms::Inputs inputs;
+    inputs.indices = indices.data();
+    inputs.count = count;
+    inputs.instancerTransform.SetTranslate(pxr::GfVec3d(1.0, 2.0, 3.0));
+    inputs.translations = translations.data();
+    inputs.numTranslations = translations.size();
+    inputs.halfRotations = halfRotations.data();
+    inputs.numHalfRotations = halfRotations.size();
+    inputs.quatRotations = quatRotations.data();
+    inputs.numQuatRotations = quatRotations.size();
+    inputs.floatRotations = floatRotations.data();
+    inputs.numFloatRotations = floatRotations.size();
+    inputs.scales = scales.data();
+    inputs.numScales = scales.size();
+    inputs.instanceTransforms = instanceTransforms.data();
+    inputs.numInstanceTransforms = instanceTransforms.size();
+
+    std::vector<pxr::GfMatrix4f> floats(count);
+    std::vector<pxr::GfMatrix4d> doubles(count);
+    MyInstanceTransforms::Compose(inputs, floats.data());
+    MyInstanceTransforms::Compose(inputs, doubles.data());
+    for (size_t i = 0; i < count; ++i)
+    {
+        const pxr::GfMatrix4d reference = _ComposeReference(inputs, i);
+        for (int r = 0; r < 4; ++r)
+        {
+            for (int c = 0; c < 4; ++c)
+            {
+                // the half rotations are exact in float and double alike.
+                if (!_Near(floats[i][r][c], reference[r][c], 1e-4) || !_Near(doubles[i][r][c], reference[r][c], 1e-5))
+                {
+                    std::cout << "ERROR::TEST::INSTANCE_TRANSFORMS " << count << " instances, rotations "
+                        << rotationKind << ", instance " << i << " [" << r << "][" << c << "]: " << floats[i][r][c]
+                        << " (float), " << doubles[i][r][c] << " (double) instead of " << reference[r][c]
+                        << std::endl;
+                    return false;
+                }
+            }
+        }
+    }
+
+    if (time)
+    {
+        const double kernelMs = _Time([&]() { MyInstanceTransforms::Compose(inputs, floats.data()); });
+        const double referenceMs = _Time([&]()
+            {
+                for (size_t i = 0; i < count; ++i)
+                    doubles[i] = _ComposeReference(inputs, i);
+            });
+        std::cout << "instance transforms: " << count << " instances, " << kernelMs << " ms, by primvar "
+            << referenceMs << " ms" << std::endl;
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    const size_t largeCount = argc > 1 ? size_t(std::strtoull(argv[1], nullptr, 10)) : 1000000;
+#if defined(__AVX2__)
+    std::cout << "kernels: AVX2" << std::endl;
+#else
+    std::cout << "kernels: scalar" << std::endl;
+#endif
+
+    std::mt19937 random(42);
+    bool ok = true;
+
+    // (width + 1) * (height + 1) vertices with faces, 4 to 40: every
+    // remainder modulo 8. Then across the 4096 vertex grain.
+    for (int width = 1; width <= 9; ++width)
+        for (int height = 1; height <= 3; ++height)
+            ok = _CheckNormals(width, height, false, random) && ok;
+    ok = _CheckNormals(63, 64, false, random) && ok;
+    ok = _CheckNormals(64, 64, false, random) && ok;
+    const int side = std::max(1, int(std::sqrt(double(largeCount))));
+    ok = _CheckNormals(side, side + 1, true, random) && ok;
+
+    for (int rotationKind = 0; rotationKind < 3; ++rotationKind)
+    {
+        for (size_t count = 0; count <= 33; ++count)
+            ok = _CheckInstanceTransforms(count, rotationKind, false, random) && ok;
+        ok = _CheckInstanceTransforms(4095, rotationKind, false, random) && ok;
+        ok = _CheckInstanceTransforms(4097, rotationKind, false, random) && ok;
+    }
+    ok = _CheckInstanceTransforms(largeCount | 5, 0, true, random) && ok;
+
+    std::cout << (ok ? "kernels: ok" : "kernels: FAILED") << std::endl;
+    return ok ? 0 : 1;
+}